@@ -13,8 +13,14 @@
 #include "iochain.h"
 #include "lz4.h"
 
+#ifdef ZSTD_SUPPORT
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 
 #if defined(__AVX2__) && defined (__SSE2__)
@@ -38,8 +44,11 @@
 #define BSHUF_MIN_RECOMMEND_BLOCK 128
 #define BSHUF_BLOCKED_MULT 8    // Block sizes must be multiple of this.
 #define BSHUF_TARGET_BLOCK_SIZE_B 8192
-// Use fast decompression instead of safe decompression for LZ4.
-#define BSHUF_LZ4_DECOMPRESS_FAST
+#define BSHUF_TUNE_MAX_BLOCK 65536  // Largest block (elements) tried by the tuner.
+#define BSHUF_TUNE_SPEED_SLACK 1.25 // Accepted decode slowdown for better ratio.
+#define BSHUF_TUNE_MIN_CLOCKS (CLOCKS_PER_SEC / 200)  // Time each trial >= 5 ms.
+// Define BSHUF_LZ4_DECOMPRESS_FAST to use fast decompression instead of safe
+// decompression for LZ4. The safe decoder is no slower with the bundled LZ4.
 
 
 // Macros.
@@ -50,6 +59,8 @@
 #define CHECK_ERR_FREE(count, buf) if (count < 0) { free(buf); return count; }
 #define CHECK_ERR_FREE_LZ(count, buf) if (count < 0) {                      \
     free(buf); return count - 1000; }
+#define CHECK_ERR_FREE_ZSTD(count, buf) if (ZSTD_isError(count)) {          \
+    free(buf); return -2000 - (int64_t) ZSTD_getErrorCode(count); }
 
 
 /* ---- Functions indicating compile time instruction set. ---- */
@@ -1109,13 +1120,15 @@ int64_t bshuf_untrans_bit_elem(void* in, void* out, const size_t size,
 
 /* Function definition for worker functions that process a single block. */
 typedef int64_t (*bshufBlockFunDef)(ioc_chain* C_ptr,
-        const size_t size, const size_t elem_size);
+        const size_t size, const size_t elem_size, const int option);
 
 
 /* Wrap a function for processing a single block to process an entire buffer in
- * parallel. */
+ * parallel. *option* is passed through to the block function unchanged; it is
+ * the compression level for the zstd routines and ignored by the others. */
 int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
-        const size_t size, const size_t elem_size, size_t block_size) {
+        const size_t size, const size_t elem_size, size_t block_size,
+        const int option) {
 
     size_t ii;
     ioc_chain C;
@@ -1131,7 +1144,7 @@ int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
 
     #pragma omp parallel for private(count) reduction(+ : cum_count)
     for (ii = 0; ii < size / block_size; ii ++) {
-        count = fun(&C, block_size, elem_size);
+        count = fun(&C, block_size, elem_size, option);
         if (count < 0) err = count;
         cum_count += count;
     }
@@ -1139,7 +1152,7 @@ int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
     last_block_size = size % block_size;
     last_block_size = last_block_size - last_block_size % BSHUF_BLOCKED_MULT;
     if (last_block_size) {
-        count = fun(&C, last_block_size, elem_size);
+        count = fun(&C, last_block_size, elem_size, option);
         if (count < 0) err = count;
         cum_count += count;
     }
@@ -1163,7 +1176,7 @@ int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
 
 /* Bitshuffle a single block. */
 int64_t bshuf_bitshuffle_block(ioc_chain *C_ptr,
-        const size_t size, const size_t elem_size) {
+        const size_t size, const size_t elem_size, const int option) {
 
     size_t this_iter;
     void *in = ioc_get_in(C_ptr, &this_iter);
@@ -1180,7 +1193,7 @@ int64_t bshuf_bitshuffle_block(ioc_chain *C_ptr,
 
 /* Bitunshuffle a single block. */
 int64_t bshuf_bitunshuffle_block(ioc_chain* C_ptr,
-        const size_t size, const size_t elem_size) {
+        const size_t size, const size_t elem_size, const int option) {
 
 
     size_t this_iter;
@@ -1248,7 +1261,7 @@ uint32_t bshuf_read_uint32_BE(void* buf) {
 
 /* Bitshuffle and compress a single block. */
 int64_t bshuf_compress_lz4_block(ioc_chain *C_ptr,
-        const size_t size, const size_t elem_size) {
+        const size_t size, const size_t elem_size, const int option) {
 
     int64_t nbytes, count;
 
@@ -1272,7 +1285,8 @@ int64_t bshuf_compress_lz4_block(ioc_chain *C_ptr,
         free(tmp_buf_bshuf);
         return count;
     }
-    nbytes = LZ4_compress(tmp_buf_bshuf, tmp_buf_lz4, size * elem_size);
+    nbytes = LZ4_compress_default(tmp_buf_bshuf, tmp_buf_lz4, size * elem_size,
+                                  LZ4_compressBound(size * elem_size));
     free(tmp_buf_bshuf);
     CHECK_ERR_FREE_LZ(nbytes, tmp_buf_lz4);
 
@@ -1290,7 +1304,7 @@ int64_t bshuf_compress_lz4_block(ioc_chain *C_ptr,
 
 /* Decompress and bitunshuffle a single block. */
 int64_t bshuf_decompress_lz4_block(ioc_chain *C_ptr,
-        const size_t size, const size_t elem_size) {
+        const size_t size, const size_t elem_size, const int option) {
 
     int64_t nbytes, count;
 
@@ -1333,6 +1347,88 @@ int64_t bshuf_decompress_lz4_block(ioc_chain *C_ptr,
 }
 
 
+#ifdef ZSTD_SUPPORT
+/* Bitshuffle and compress a single block with zstd at level *comp_lvl*. */
+int64_t bshuf_compress_zstd_block(ioc_chain *C_ptr,
+        const size_t size, const size_t elem_size, const int comp_lvl) {
+
+    int64_t count;
+    size_t nbytes;
+
+    void* tmp_buf_bshuf = malloc(size * elem_size);
+    if (tmp_buf_bshuf == NULL) return -1;
+
+    size_t tmp_buf_zstd_size = ZSTD_compressBound(size * elem_size);
+    void* tmp_buf_zstd = malloc(tmp_buf_zstd_size);
+    if (tmp_buf_zstd == NULL){
+        free(tmp_buf_bshuf);
+        return -1;
+    }
+
+    size_t this_iter;
+
+    void *in = ioc_get_in(C_ptr, &this_iter);
+    ioc_set_next_in(C_ptr, &this_iter, (void*) ((char*) in + size * elem_size));
+
+    count = bshuf_trans_bit_elem(in, tmp_buf_bshuf, size, elem_size);
+    if (count < 0) {
+        free(tmp_buf_zstd);
+        free(tmp_buf_bshuf);
+        return count;
+    }
+    nbytes = ZSTD_compress(tmp_buf_zstd, tmp_buf_zstd_size, tmp_buf_bshuf,
+                           size * elem_size, comp_lvl);
+    free(tmp_buf_bshuf);
+    CHECK_ERR_FREE_ZSTD(nbytes, tmp_buf_zstd);
+
+    void *out = ioc_get_out(C_ptr, &this_iter);
+    ioc_set_next_out(C_ptr, &this_iter, (void *) ((char *) out + nbytes + 4));
+
+    bshuf_write_uint32_BE(out, nbytes);
+    memcpy((char *) out + 4, tmp_buf_zstd, nbytes);
+
+    free(tmp_buf_zstd);
+
+    return nbytes + 4;
+}
+
+
+/* Decompress and bitunshuffle a single zstd compressed block. */
+int64_t bshuf_decompress_zstd_block(ioc_chain *C_ptr,
+        const size_t size, const size_t elem_size, const int option) {
+
+    int64_t count;
+    size_t nbytes;
+
+    size_t this_iter;
+    void *in = ioc_get_in(C_ptr, &this_iter);
+    int32_t nbytes_from_header = bshuf_read_uint32_BE(in);
+    ioc_set_next_in(C_ptr, &this_iter,
+            (void*) ((char*) in + nbytes_from_header + 4));
+
+    void *out = ioc_get_out(C_ptr, &this_iter);
+    ioc_set_next_out(C_ptr, &this_iter,
+            (void *) ((char *) out + size * elem_size));
+
+    void* tmp_buf = malloc(size * elem_size);
+    if (tmp_buf == NULL) return -1;
+
+    nbytes = ZSTD_decompress(tmp_buf, size * elem_size, (char*) in + 4,
+                             nbytes_from_header);
+    CHECK_ERR_FREE_ZSTD(nbytes, tmp_buf);
+    if (nbytes != size * elem_size) {
+        free(tmp_buf);
+        return -91;
+    }
+    count = bshuf_untrans_bit_elem(tmp_buf, out, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+
+    free(tmp_buf);
+    return nbytes_from_header + 4;
+}
+#endif // ZSTD_SUPPORT
+
+
 /* ---- Public functions ----
  *
  * See header file for description and usage.
@@ -1372,11 +1468,35 @@ size_t bshuf_compress_lz4_bound(const size_t size,
 }
 
 
+#ifdef ZSTD_SUPPORT
+size_t bshuf_compress_zstd_bound(const size_t size,
+        const size_t elem_size, size_t block_size) {
+
+    size_t bound, leftover;
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size < 0 || block_size % BSHUF_BLOCKED_MULT) return -81;
+
+    // Note that each block gets a 4 byte header.
+    // Size of full blocks.
+    bound = (ZSTD_compressBound(block_size * elem_size) + 4) * (size / block_size);
+    // Size of partial blocks, if any.
+    leftover = ((size % block_size) / BSHUF_BLOCKED_MULT) * BSHUF_BLOCKED_MULT;
+    if (leftover) bound += ZSTD_compressBound(leftover * elem_size) + 4;
+    // Size of uncompressed data not fitting into any blocks.
+    bound += (size % BSHUF_BLOCKED_MULT) * elem_size;
+    return bound;
+}
+#endif // ZSTD_SUPPORT
+
+
 int64_t bshuf_bitshuffle(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
 
     return bshuf_blocked_wrap_fun(&bshuf_bitshuffle_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, 0);
 }
 
 
@@ -1384,21 +1504,259 @@ int64_t bshuf_bitunshuffle(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
 
     return bshuf_blocked_wrap_fun(&bshuf_bitunshuffle_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, 0);
 }
 
 
 int64_t bshuf_compress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
     return bshuf_blocked_wrap_fun(&bshuf_compress_lz4_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, 0);
 }
 
 
 int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
     return bshuf_blocked_wrap_fun(&bshuf_decompress_lz4_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, 0);
+}
+
+
+#ifdef ZSTD_SUPPORT
+int64_t bshuf_compress_zstd(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const int comp_lvl) {
+    return bshuf_blocked_wrap_fun(&bshuf_compress_zstd_block, in, out, size,
+            elem_size, block_size, comp_lvl);
+}
+
+
+int64_t bshuf_decompress_zstd(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size) {
+    return bshuf_blocked_wrap_fun(&bshuf_decompress_zstd_block, in, out, size,
+            elem_size, block_size, 0);
+}
+#endif // ZSTD_SUPPORT
+
+
+/* ---- Streaming decoder ----
+ *
+ * Runs the single block workers one block per call, each on its own
+ * ioc_chain whose output is the caller's buffer. See header file.
+ *
+ */
+
+struct bshuf_stream {
+    void* in;               // Next compressed block.
+    size_t size;            // Elements in the whole buffer.
+    size_t elem_size;
+    size_t block_size;
+    size_t done;            // Elements decoded so far.
+    bshufBlockFunDef fun;
+};
+
+
+bshuf_stream* bshuf_stream_open(void* in, const size_t size,
+        const size_t elem_size, size_t block_size, const int comp) {
+
+    bshufBlockFunDef fun;
+    bshuf_stream* S;
+
+    switch (comp) {
+        case 0:
+            fun = &bshuf_bitunshuffle_block;
+            break;
+        case 2:
+            fun = &bshuf_decompress_lz4_block;
+            break;
+#ifdef ZSTD_SUPPORT
+        case 3:
+            fun = &bshuf_decompress_zstd_block;
+            break;
+#endif
+        default:
+            return NULL;
+    }
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size % BSHUF_BLOCKED_MULT) return NULL;
+
+    S = malloc(sizeof(bshuf_stream));
+    if (S == NULL) return NULL;
+    S->in = in;
+    S->size = size;
+    S->elem_size = elem_size;
+    S->block_size = block_size;
+    S->done = 0;
+    S->fun = fun;
+    return S;
+}
+
+
+int64_t bshuf_stream_next(bshuf_stream* S, void* out) {
+
+    size_t this_size, this_iter;
+    int64_t count;
+    ioc_chain C;
+
+    if (S->done == S->size) return 0;
+
+    this_size = MIN(S->block_size, S->size - S->done);
+    this_size -= this_size % BSHUF_BLOCKED_MULT;
+    if (this_size == 0) {
+        // Trailing elements that do not fill a multiple of 8 are stored as is.
+        this_size = S->size - S->done;
+        memcpy(out, S->in, this_size * S->elem_size);
+        S->in = (char *) S->in + this_size * S->elem_size;
+        S->done = S->size;
+        return this_size;
+    }
+
+    ioc_init(&C, S->in, out);
+    count = S->fun(&C, this_size, S->elem_size, 0);
+    if (count < 0) {
+        ioc_destroy(&C);
+        return count;
+    }
+    S->in = ioc_get_in(&C, &this_iter);
+    ioc_set_next_in(&C, &this_iter, S->in);
+    ioc_get_out(&C, &this_iter);
+    ioc_set_next_out(&C, &this_iter, out);
+    ioc_destroy(&C);
+
+    S->done += this_size;
+    return this_size;
+}
+
+
+size_t bshuf_stream_done(const bshuf_stream* S) {
+    return S->done;
+}
+
+
+void bshuf_stream_close(bshuf_stream* S) {
+    free(S);
+}
+
+
+/* Compress *in* with the given block size and time decoding it. Returns the
+ * compressed size in bytes, or a negative error code. */
+static int64_t bshuf_tune_trial(void* in, void* comp_buf, void* dec_buf,
+        const size_t size, const size_t elem_size, const size_t block_size,
+        const int comp, const int comp_lvl, double* decode_time) {
+
+    int64_t nbytes, count;
+    clock_t start, elapsed;
+    long reps = 0;
+
+    switch (comp) {
+        case 0:
+            nbytes = bshuf_bitshuffle(in, comp_buf, size, elem_size,
+                    block_size);
+            break;
+        case 2:
+            nbytes = bshuf_compress_lz4(in, comp_buf, size, elem_size,
+                    block_size);
+            break;
+#ifdef ZSTD_SUPPORT
+        case 3:
+            nbytes = bshuf_compress_zstd(in, comp_buf, size, elem_size,
+                    block_size, comp_lvl);
+            break;
+#endif
+        default:
+            return -82;
+    }
+    CHECK_ERR(nbytes);
+
+    start = clock();
+    do {
+        switch (comp) {
+            case 0:
+                count = bshuf_bitunshuffle(comp_buf, dec_buf, size, elem_size,
+                        block_size);
+                break;
+#ifdef ZSTD_SUPPORT
+            case 3:
+                count = bshuf_decompress_zstd(comp_buf, dec_buf, size,
+                        elem_size, block_size);
+                break;
+#endif
+            default:
+                count = bshuf_decompress_lz4(comp_buf, dec_buf, size,
+                        elem_size, block_size);
+        }
+        CHECK_ERR(count);
+        reps++;
+        elapsed = clock() - start;
+    } while (elapsed < BSHUF_TUNE_MIN_CLOCKS);
+
+    *decode_time = (double) elapsed / reps;
+    return nbytes;
+}
+
+
+size_t bshuf_tune_block_size(void* in, const size_t size,
+        const size_t elem_size, const int comp, const int comp_lvl) {
+
+    size_t block_size, max_block, ii, ntrial = 0;
+    long best = -1;
+    size_t trial_block[32];
+    int64_t trial_bytes[32];
+    double trial_time[32], fastest = -1;
+    size_t buf_size;
+
+    max_block = MIN(size, BSHUF_TUNE_MAX_BLOCK);
+    max_block -= max_block % BSHUF_BLOCKED_MULT;
+    if (max_block < BSHUF_BLOCKED_MULT) return 0;
+
+#ifdef ZSTD_SUPPORT
+    if (comp == 3) {
+        buf_size = bshuf_compress_zstd_bound(size, elem_size,
+                BSHUF_BLOCKED_MULT);
+    } else
+#endif
+    buf_size = bshuf_compress_lz4_bound(size, elem_size, BSHUF_BLOCKED_MULT);
+    buf_size = MAX(buf_size, size * elem_size);
+
+    void* comp_buf = malloc(buf_size);
+    void* dec_buf = malloc(size * elem_size);
+    if (comp_buf == NULL || dec_buf == NULL) {
+        free(comp_buf);
+        free(dec_buf);
+        return 0;
+    }
+
+    // Powers of two from the smallest recommended block up to the sample
+    // size, plus the sample size itself if it is not a power of two.
+    for (block_size = BSHUF_MIN_RECOMMEND_BLOCK; ntrial < 32;
+            block_size *= 2) {
+        if (block_size > max_block) block_size = max_block;
+        trial_block[ntrial] = block_size;
+        trial_bytes[ntrial] = bshuf_tune_trial(in, comp_buf, dec_buf, size,
+                elem_size, block_size, comp, comp_lvl, &trial_time[ntrial]);
+        if (trial_bytes[ntrial] < 0) {
+            free(comp_buf);
+            free(dec_buf);
+            return 0;
+        }
+        if (fastest < 0 || trial_time[ntrial] < fastest) {
+            fastest = trial_time[ntrial];
+        }
+        ntrial++;
+        if (block_size == max_block) break;
+    }
+
+    // Smallest output among the candidates that decode nearly as fast as the
+    // fastest one; ties go to the smaller block.
+    for (ii = 0; ii < ntrial; ii++) {
+        if (trial_time[ii] > fastest * BSHUF_TUNE_SPEED_SLACK) continue;
+        if (best < 0 || trial_bytes[ii] < trial_bytes[best]) best = ii;
+    }
+
+    free(comp_buf);
+    free(dec_buf);
+    return trial_block[best];
 }
 
 
@@ -1410,6 +1768,7 @@ int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
 #undef CHECK_ERR
 #undef CHECK_ERR_FREE
 #undef CHECK_ERR_FREE_LZ
+#undef CHECK_ERR_FREE_ZSTD
 
 #undef USESSE2
 #undef USEAVX2
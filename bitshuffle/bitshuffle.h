@@ -22,6 +22,7 @@
  *      -81   : block_size not multiple of 8.
  *      -91   : Decompression error, wrong number of bytes processed.
  *      -1YYY : Error internal to compression routine with error code -YYY.
+ *      -2YYY : Error internal to zstd with ZSTD_ErrorCode YYY.
  */
 
 
@@ -87,6 +88,38 @@ int bshuf_using_AVX2(void);
 size_t bshuf_default_block_size(const size_t elem_size);
 
 
+/* ---- bshuf_tune_block_size ----
+ *
+ * Pick a block size for compressing data like *in* on the current CPU.
+ *
+ * Block sizes from 128 elements upwards (powers of two, up to *size* or
+ * 65536 elements) are tried on the sample. For each, the sample is compressed
+ * and the time to decode it measured. The block size giving the smallest
+ * output is returned, among those decoding no more than 25% slower than the
+ * fastest candidate.
+ *
+ * The result is only a recommendation for writing data; it must be stored
+ * with the data (the HDF5 filter records it in its cd_values) since it is
+ * needed to decode again. Pass a few representative frames as the sample.
+ *
+ * Parameters
+ * ----------
+ *  in : sample data, size * elem_size bytes
+ *  size : number of elements in the sample
+ *  elem_size : element size of typed data
+ *  comp : 0 (bitshuffle only), 2 (LZ4) or 3 (zstd, with ZSTD_SUPPORT); the
+ *  values of the HDF5 filter compression option
+ *  comp_lvl : zstd compression level, ignored otherwise
+ *
+ * Returns
+ * -------
+ *  chosen block size in elements, 0 on failure.
+ *
+ */
+size_t bshuf_tune_block_size(void* in, const size_t size,
+        const size_t elem_size, const int comp, const int comp_lvl);
+
+
 /* ---- bshuf_bitshuffle ----
  *
  * Bitshuffle the data.
@@ -199,10 +232,10 @@ int64_t bshuf_compress_lz4(void* in, void* out, const size_t size, const size_t
  * To properly unshuffle bitshuffled data, *size*, *elem_size* and *block_size*
  * must patch the parameters used to compress the data.
  *
- * NOT TO BE USED WITH UNTRUSTED DATA: This routine uses the function
- * LZ4_decompress_fast from LZ4, which does not protect against maliciously
- * formed datasets. By modifying the compressed data, this function could be
- * coerced into leaving the boundaries of the input buffer.
+ * Blocks are decoded with LZ4_decompress_safe, which never reads or writes
+ * outside of the block boundaries. Compiling with BSHUF_LZ4_DECOMPRESS_FAST
+ * switches to LZ4_decompress_fast, which does not protect against maliciously
+ * formed datasets and should only be used with trusted data.
  *
  * Parameters
  * ----------
@@ -221,6 +254,123 @@ int64_t bshuf_compress_lz4(void* in, void* out, const size_t size, const size_t
 int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size);
 
+
+#ifdef ZSTD_SUPPORT
+/* ---- bshuf_compress_zstd_bound ----
+ *
+ * Bound on size of data compressed with *bshuf_compress_zstd*.
+ *
+ * Parameters
+ * ----------
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Process in blocks of this many elements. Pass 0 to
+ *  select automatically (recommended).
+ *
+ * Returns
+ * -------
+ *  Bound on compressed data size.
+ *
+ */
+size_t bshuf_compress_zstd_bound(const size_t size,
+        const size_t elem_size, size_t block_size);
+
+
+/* ---- bshuf_compress_zstd ----
+ *
+ * Bitshuffle and compress the data using zstd.
+ *
+ * Same layout as *bshuf_compress_lz4*: each block of *block_size* elements is
+ * transposed, compressed as a single zstd frame and prefixed by a 4 byte
+ * integer giving its compressed size. Use *bshuf_compress_zstd_bound* to size
+ * the output buffer.
+ *
+ * Only available when compiled with ZSTD_SUPPORT.
+ *
+ * Parameters
+ * ----------
+ *  in : input buffer, must be of size * elem_size bytes
+ *  out : output buffer, must be large enough to hold data.
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Process in blocks of this many elements. Pass 0 to
+ *  select automatically (recommended).
+ *  comp_lvl : zstd compression level; 0 selects the zstd default.
+ *
+ * Returns
+ * -------
+ *  number of bytes used in output buffer, negative error-code if failed.
+ *
+ */
+int64_t bshuf_compress_zstd(void* in, void* out, const size_t size, const size_t
+        elem_size, size_t block_size, const int comp_lvl);
+
+
+/* ---- bshuf_decompress_zstd ----
+ *
+ * Undo zstd compression and bitshuffling.
+ *
+ * *size*, *elem_size* and *block_size* must match the parameters used to
+ * compress the data. Only available when compiled with ZSTD_SUPPORT.
+ *
+ * Parameters
+ * ----------
+ *  in : input buffer
+ *  out : output buffer, must be of size * elem_size bytes
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Process in blocks of this many elements. Pass 0 to
+ *  select automatically (recommended).
+ *
+ * Returns
+ * -------
+ *  number of bytes consumed in *input* buffer, negative error-code if failed.
+ *
+ */
+int64_t bshuf_decompress_zstd(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size);
+#endif // ZSTD_SUPPORT
+
+
+/* ---- Streaming decoder ----
+ *
+ * Decode bitshuffled (and optionally compressed) data one block at a time
+ * into a caller supplied buffer, so that each block can be consumed while it
+ * is still in cache instead of after the whole buffer has been decoded.
+ *
+ * Usage
+ * -----
+ *  bshuf_stream* S = bshuf_stream_open(in, size, elem_size, block_size, comp);
+ *  while ((n = bshuf_stream_next(S, block)) > 0) {
+ *      // block holds the next n elements, starting at element
+ *      // bshuf_stream_done(S) - n of the full buffer.
+ *  }
+ *  bshuf_stream_close(S);
+ *
+ * *in*, *size*, *elem_size* and *block_size* are as for *bshuf_decompress_lz4*;
+ * *block_size* is in elements. For HDF5 filter chunks, skip the 12 byte
+ * header; bytes 8-11 hold the block size in bytes, which must be divided by
+ * *elem_size*, as bshuf_h5filter.c does. *comp* is 0 (bitshuffle only),
+ * 2 (LZ4) or 3 (zstd, with ZSTD_SUPPORT), as in the HDF5 filter options. The
+ * block buffer must hold *block_size* elements (or *bshuf_default_block_size*
+ * elements if 0 was given). *in* must stay valid until the stream is closed.
+ *
+ * *bshuf_stream_open* returns NULL for bad arguments or allocation failure.
+ * *bshuf_stream_next* returns the number of elements decoded, 0 once all
+ * *size* elements have been produced, or a negative error code.
+ *
+ */
+typedef struct bshuf_stream bshuf_stream;
+
+bshuf_stream* bshuf_stream_open(void* in, const size_t size,
+        const size_t elem_size, size_t block_size, const int comp);
+
+int64_t bshuf_stream_next(bshuf_stream* S, void* out);
+
+size_t bshuf_stream_done(const bshuf_stream* S);
+
+void bshuf_stream_close(bshuf_stream* S);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -13,6 +13,10 @@
 #include "bshuf_h5filter.h"
 #include "bitshuffle.h"
 
+#ifdef ZSTD_SUPPORT
+#include <zstd.h>
+#endif
+
 
 #define PUSH_ERR(func, minor, str)                                      \
     H5Epush1(__FILE__, func, __LINE__, H5E_PLINE, minor, str)
@@ -78,11 +82,26 @@ herr_t bshuf_h5_set_local(hid_t dcpl, hid_t type, hid_t space){
                 break;
             case BSHUF_H5_COMPRESS_LZ4:
                 break;
+#ifdef ZSTD_SUPPORT
+            case BSHUF_H5_COMPRESS_ZSTD:
+                break;
+#endif
             default:
                 PUSH_ERR("bshuf_h5_set_local", H5E_CALLBACK, 
                          "Invalid bitshuffle compression.");
+                return -1;
+        }
+    }
+#ifdef ZSTD_SUPPORT
+    if (nelements > 5 && values[4] == BSHUF_H5_COMPRESS_ZSTD) {
+        if ((int) values[5] > ZSTD_maxCLevel()) {
+            sprintf(msg, "Error in bitshuffle. Invalid zstd level: %d.",
+                    (int) values[5]);
+            PUSH_ERR("bshuf_h5_set_local", H5E_CALLBACK, msg);
+            return -1;
         }
     }
+#endif
 
     r = H5Pmodify_filter(dcpl, BSHUF_H5FILTER, flags, nelements, values);
     if(r<0) return -1;
@@ -101,6 +120,10 @@ size_t bshuf_h5_filter(unsigned int flags, size_t cd_nelmts,
     size_t block_size = 0;
     size_t buf_size_out, nbytes_uncomp, nbytes_out;
     char* in_buf = *buf;
+    unsigned int comp = 0;
+#ifdef ZSTD_SUPPORT
+    int comp_lvl = 0;
+#endif
 
     if (cd_nelmts < 3) {
         PUSH_ERR("bshuf_h5_filter", H5E_CALLBACK, 
@@ -115,7 +138,26 @@ size_t bshuf_h5_filter(unsigned int flags, size_t cd_nelmts,
     if (block_size == 0) block_size = bshuf_default_block_size(elem_size);
 
     // Compression in addition to bitshiffle.
-    if (cd_nelmts > 4 && cd_values[4] == BSHUF_H5_COMPRESS_LZ4) {
+    if (cd_nelmts > 4) comp = cd_values[4];
+#ifdef ZSTD_SUPPORT
+    if (cd_nelmts > 5) comp_lvl = (int) cd_values[5];
+#endif
+
+    if (comp != 0 && comp != BSHUF_H5_COMPRESS_LZ4
+            && comp != BSHUF_H5_COMPRESS_ZSTD) {
+        sprintf(msg, "Unknown bitshuffle compression %u.", comp);
+        PUSH_ERR("bshuf_h5_filter", H5E_CALLBACK, msg);
+        return 0;
+    }
+#ifndef ZSTD_SUPPORT
+    if (comp == BSHUF_H5_COMPRESS_ZSTD) {
+        PUSH_ERR("bshuf_h5_filter", H5E_CALLBACK, 
+                "Bitshuffle was built without zstd support (ZSTD_SUPPORT).");
+        return 0;
+    }
+#endif
+
+    if (comp) {
         if (flags & H5Z_FLAG_REVERSE) {
             // First eight bytes is the number of bytes in the output buffer,
             // little endian.
@@ -127,6 +169,12 @@ size_t bshuf_h5_filter(unsigned int flags, size_t cd_nelmts,
             buf_size_out = nbytes_uncomp;
         } else {
             nbytes_uncomp = nbytes;
+#ifdef ZSTD_SUPPORT
+            if (comp == BSHUF_H5_COMPRESS_ZSTD) {
+                buf_size_out = bshuf_compress_zstd_bound(nbytes_uncomp
+                        / elem_size, elem_size, block_size) + 12;
+            } else
+#endif
             buf_size_out = bshuf_compress_lz4_bound(nbytes_uncomp / elem_size, 
                     elem_size, block_size) + 12;
         }
@@ -151,9 +199,15 @@ size_t bshuf_h5_filter(unsigned int flags, size_t cd_nelmts,
         return 0;
     }
 
-    if (cd_nelmts > 4 && cd_values[4] == BSHUF_H5_COMPRESS_LZ4) {
+    if (comp) {
         if (flags & H5Z_FLAG_REVERSE) {
             // Bit unshuffle/decompress.
+#ifdef ZSTD_SUPPORT
+            if (comp == BSHUF_H5_COMPRESS_ZSTD) {
+                err = bshuf_decompress_zstd(in_buf, out_buf, size, elem_size,
+                        block_size);
+            } else
+#endif
             err = bshuf_decompress_lz4(in_buf, out_buf, size, elem_size, block_size);
             nbytes_out = nbytes_uncomp;
         } else {
@@ -165,6 +219,12 @@ size_t bshuf_h5_filter(unsigned int flags, size_t cd_nelmts,
             // have the same representation.
             bshuf_write_uint64_BE(out_buf, nbytes_uncomp);
             bshuf_write_uint32_BE((char*) out_buf + 8, block_size * elem_size);
+#ifdef ZSTD_SUPPORT
+            if (comp == BSHUF_H5_COMPRESS_ZSTD) {
+                err = bshuf_compress_zstd(in_buf, (char*) out_buf + 12, size,
+                        elem_size, block_size, comp_lvl);
+            } else
+#endif
             err = bshuf_compress_lz4(in_buf, (char*) out_buf + 12, size,
                     elem_size, block_size); nbytes_out = err + 12; } } else {
                 if (flags & H5Z_FLAG_REVERSE) {
@@ -216,3 +276,21 @@ int bshuf_register_h5filter(void){
     return retval;
 }
 
+
+int bshuf_h5_set_filter_tuned(hid_t dcpl, void* sample, size_t size,
+        size_t elem_size, unsigned int comp, unsigned int comp_lvl){
+
+    herr_t r;
+    unsigned int values[] = {0, comp, comp_lvl};
+
+    values[0] = bshuf_tune_block_size(sample, size, elem_size, comp,
+            (int) comp_lvl);
+
+    r = H5Pset_filter(dcpl, BSHUF_H5FILTER, H5Z_FLAG_MANDATORY, 3, values);
+    if(r<0){
+        PUSH_ERR("bshuf_h5_set_filter_tuned",
+                 H5E_CALLBACK, "Can't set bitshuffle filter");
+        return -1;
+    }
+    return values[0];
+}
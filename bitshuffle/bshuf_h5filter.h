@@ -16,8 +16,9 @@
  *  block_size (option slot 0) : interger (optional)
  *      What block size to use (in elements not bytes). Default is 0,
  *      for which bitshuffle will pick a block size with a target of 8kb.
- *  Compression (option slot 1) : 0 or BSHUF_H5_COMPRESS_LZ4
- *      Whether to apply LZ4 compression to the data after bitshuffling.
+ *  Compression (option slot 1) : 0, BSHUF_H5_COMPRESS_LZ4 or
+ *      BSHUF_H5_COMPRESS_ZSTD
+ *      Whether to apply LZ4 or zstd compression to the data after bitshuffling.
  *      This is much faster than applying compression as a second filter
  *      because it is done when the small block of data is already in the
  *      L1 cache.
@@ -26,6 +27,12 @@
  *      for the normal LZ4 filter described in
  *      http://www.hdfgroup.org/services/filters/HDF5_LZ4.pdf.
  *
+ *      zstd uses the same layout with each block stored as a zstd frame. It
+ *      is only available when compiled with ZSTD_SUPPORT; without it such
+ *      datasets fail to read with an explicit error.
+ *  Compression level (option slot 2) : integer (optional)
+ *      zstd compression level. Default is 0, the zstd default level.
+ *
  */
 
 
@@ -40,6 +47,7 @@
 
 
 #define BSHUF_H5_COMPRESS_LZ4 2
+#define BSHUF_H5_COMPRESS_ZSTD 3
 
 
 extern H5Z_class_t bshuf_H5Filter[1];
@@ -56,4 +64,22 @@ extern H5Z_class_t bshuf_H5Filter[1];
 int bshuf_register_h5filter(void);
 
 
+/* ---- bshuf_h5_set_filter_tuned ----
+ *
+ * Add the bitshuffle filter to the dataset creation property list *dcpl*
+ * with a block size picked by *bshuf_tune_block_size* on *sample* (*size*
+ * elements of *elem_size* bytes, e.g. the first frames to be written).
+ *
+ * The block size ends up in cd_values like a user supplied one, so readers
+ * need nothing special. *comp* is 0, BSHUF_H5_COMPRESS_LZ4 or
+ * BSHUF_H5_COMPRESS_ZSTD; *comp_lvl* is the zstd level.
+ *
+ * Returns the chosen block size (0 if tuning failed and the default is
+ * used), negative on error.
+ *
+ */
+int bshuf_h5_set_filter_tuned(hid_t dcpl, void* sample, size_t size,
+        size_t elem_size, unsigned int comp, unsigned int comp_lvl);
+
+
 #endif // BSHUF_H5FILTER_H
@@ -0,0 +1,379 @@
+/* cbftemplate.c -- template based miniCBF writer for eiger2cbf
+
+   See cbftemplate.h. The MD5 code follows RFC 1321.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#include "cbftemplate.h"
+
+#define CBF_PAD 4095   /* PAD_4K */
+#define CBF_DIGEST_SLICE 4096  /* pixels encoded between MD5 updates */
+
+static const char cbf_binary_marker[4] = {0x0C, 0x1A, 0x04, (char)0xD5};
+static const char cbf_trailer[] = "\r\n--CIF-BINARY-FORMAT-SECTION----\r\n;\r\n\r\n";
+static const char cbf_padding[CBF_PAD] = {0};
+
+
+/* ---- MD5 (RFC 1321) ---- */
+
+typedef struct {
+  uint32_t state[4];
+  uint64_t count;              /* bytes processed */
+  unsigned char buffer[64];
+} md5_ctx;
+
+#define MD5_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_STEP(f, a, b, c, d, x, k, r) \
+  (a) += f((b), (c), (d)) + (x) + (uint32_t)(k); \
+  (a) = ((a) << (r)) | ((a) >> (32 - (r))); \
+  (a) += (b);
+
+/* One 64 byte block, unrolled as in RFC 1321 so the compiler can keep the
+   whole state in registers. */
+static void md5_transform(uint32_t state[4], const unsigned char block[64]) {
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], m[16];
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    m[i] = (uint32_t)block[4 * i] | ((uint32_t)block[4 * i + 1] << 8) |
+      ((uint32_t)block[4 * i + 2] << 16) | ((uint32_t)block[4 * i + 3] << 24);
+  }
+
+  MD5_STEP(MD5_F, a, b, c, d, m[0], 0xd76aa478, 7)
+  MD5_STEP(MD5_F, d, a, b, c, m[1], 0xe8c7b756, 12)
+  MD5_STEP(MD5_F, c, d, a, b, m[2], 0x242070db, 17)
+  MD5_STEP(MD5_F, b, c, d, a, m[3], 0xc1bdceee, 22)
+  MD5_STEP(MD5_F, a, b, c, d, m[4], 0xf57c0faf, 7)
+  MD5_STEP(MD5_F, d, a, b, c, m[5], 0x4787c62a, 12)
+  MD5_STEP(MD5_F, c, d, a, b, m[6], 0xa8304613, 17)
+  MD5_STEP(MD5_F, b, c, d, a, m[7], 0xfd469501, 22)
+  MD5_STEP(MD5_F, a, b, c, d, m[8], 0x698098d8, 7)
+  MD5_STEP(MD5_F, d, a, b, c, m[9], 0x8b44f7af, 12)
+  MD5_STEP(MD5_F, c, d, a, b, m[10], 0xffff5bb1, 17)
+  MD5_STEP(MD5_F, b, c, d, a, m[11], 0x895cd7be, 22)
+  MD5_STEP(MD5_F, a, b, c, d, m[12], 0x6b901122, 7)
+  MD5_STEP(MD5_F, d, a, b, c, m[13], 0xfd987193, 12)
+  MD5_STEP(MD5_F, c, d, a, b, m[14], 0xa679438e, 17)
+  MD5_STEP(MD5_F, b, c, d, a, m[15], 0x49b40821, 22)
+
+  MD5_STEP(MD5_G, a, b, c, d, m[1], 0xf61e2562, 5)
+  MD5_STEP(MD5_G, d, a, b, c, m[6], 0xc040b340, 9)
+  MD5_STEP(MD5_G, c, d, a, b, m[11], 0x265e5a51, 14)
+  MD5_STEP(MD5_G, b, c, d, a, m[0], 0xe9b6c7aa, 20)
+  MD5_STEP(MD5_G, a, b, c, d, m[5], 0xd62f105d, 5)
+  MD5_STEP(MD5_G, d, a, b, c, m[10], 0x02441453, 9)
+  MD5_STEP(MD5_G, c, d, a, b, m[15], 0xd8a1e681, 14)
+  MD5_STEP(MD5_G, b, c, d, a, m[4], 0xe7d3fbc8, 20)
+  MD5_STEP(MD5_G, a, b, c, d, m[9], 0x21e1cde6, 5)
+  MD5_STEP(MD5_G, d, a, b, c, m[14], 0xc33707d6, 9)
+  MD5_STEP(MD5_G, c, d, a, b, m[3], 0xf4d50d87, 14)
+  MD5_STEP(MD5_G, b, c, d, a, m[8], 0x455a14ed, 20)
+  MD5_STEP(MD5_G, a, b, c, d, m[13], 0xa9e3e905, 5)
+  MD5_STEP(MD5_G, d, a, b, c, m[2], 0xfcefa3f8, 9)
+  MD5_STEP(MD5_G, c, d, a, b, m[7], 0x676f02d9, 14)
+  MD5_STEP(MD5_G, b, c, d, a, m[12], 0x8d2a4c8a, 20)
+
+  MD5_STEP(MD5_H, a, b, c, d, m[5], 0xfffa3942, 4)
+  MD5_STEP(MD5_H, d, a, b, c, m[8], 0x8771f681, 11)
+  MD5_STEP(MD5_H, c, d, a, b, m[11], 0x6d9d6122, 16)
+  MD5_STEP(MD5_H, b, c, d, a, m[14], 0xfde5380c, 23)
+  MD5_STEP(MD5_H, a, b, c, d, m[1], 0xa4beea44, 4)
+  MD5_STEP(MD5_H, d, a, b, c, m[4], 0x4bdecfa9, 11)
+  MD5_STEP(MD5_H, c, d, a, b, m[7], 0xf6bb4b60, 16)
+  MD5_STEP(MD5_H, b, c, d, a, m[10], 0xbebfbc70, 23)
+  MD5_STEP(MD5_H, a, b, c, d, m[13], 0x289b7ec6, 4)
+  MD5_STEP(MD5_H, d, a, b, c, m[0], 0xeaa127fa, 11)
+  MD5_STEP(MD5_H, c, d, a, b, m[3], 0xd4ef3085, 16)
+  MD5_STEP(MD5_H, b, c, d, a, m[6], 0x04881d05, 23)
+  MD5_STEP(MD5_H, a, b, c, d, m[9], 0xd9d4d039, 4)
+  MD5_STEP(MD5_H, d, a, b, c, m[12], 0xe6db99e5, 11)
+  MD5_STEP(MD5_H, c, d, a, b, m[15], 0x1fa27cf8, 16)
+  MD5_STEP(MD5_H, b, c, d, a, m[2], 0xc4ac5665, 23)
+
+  MD5_STEP(MD5_I, a, b, c, d, m[0], 0xf4292244, 6)
+  MD5_STEP(MD5_I, d, a, b, c, m[7], 0x432aff97, 10)
+  MD5_STEP(MD5_I, c, d, a, b, m[14], 0xab9423a7, 15)
+  MD5_STEP(MD5_I, b, c, d, a, m[5], 0xfc93a039, 21)
+  MD5_STEP(MD5_I, a, b, c, d, m[12], 0x655b59c3, 6)
+  MD5_STEP(MD5_I, d, a, b, c, m[3], 0x8f0ccc92, 10)
+  MD5_STEP(MD5_I, c, d, a, b, m[10], 0xffeff47d, 15)
+  MD5_STEP(MD5_I, b, c, d, a, m[1], 0x85845dd1, 21)
+  MD5_STEP(MD5_I, a, b, c, d, m[8], 0x6fa87e4f, 6)
+  MD5_STEP(MD5_I, d, a, b, c, m[15], 0xfe2ce6e0, 10)
+  MD5_STEP(MD5_I, c, d, a, b, m[6], 0xa3014314, 15)
+  MD5_STEP(MD5_I, b, c, d, a, m[13], 0x4e0811a1, 21)
+  MD5_STEP(MD5_I, a, b, c, d, m[4], 0xf7537e82, 6)
+  MD5_STEP(MD5_I, d, a, b, c, m[11], 0xbd3af235, 10)
+  MD5_STEP(MD5_I, c, d, a, b, m[2], 0x2ad7d2bb, 15)
+  MD5_STEP(MD5_I, b, c, d, a, m[9], 0xeb86d391, 21)
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+static void md5_init(md5_ctx *ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->count = 0;
+}
+
+static void md5_update(md5_ctx *ctx, const unsigned char *data, size_t len) {
+  size_t have = ctx->count & 63, need = 64 - have;
+
+  ctx->count += len;
+  if (have && len >= need) {
+    memcpy(ctx->buffer + have, data, need);
+    md5_transform(ctx->state, ctx->buffer);
+    data += need;
+    len -= need;
+    have = 0;
+  }
+  while (len >= 64) {
+    md5_transform(ctx->state, data);
+    data += 64;
+    len -= 64;
+  }
+  memcpy(ctx->buffer + have, data, len);
+}
+
+static void md5_final(md5_ctx *ctx, unsigned char digest[16]) {
+  static const unsigned char pad[64] = {0x80};
+  unsigned char bits[8];
+  uint64_t nbits = ctx->count * 8;
+  size_t have = ctx->count & 63;
+  int i;
+
+  for (i = 0; i < 8; i++) bits[i] = (nbits >> (8 * i)) & 0xff;
+  md5_update(ctx, pad, (have < 56) ? 56 - have : 120 - have);
+  md5_update(ctx, bits, 8);
+  for (i = 0; i < 16; i++) digest[i] = (ctx->state[i / 4] >> (8 * (i % 4))) & 0xff;
+}
+
+/* Base64 of a 16 byte digest, as used by Content-MD5 (24 characters). */
+static void md5_to_base64(const unsigned char digest[16], char out[25]) {
+  static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int i, o = 0;
+  uint32_t v;
+
+  for (i = 0; i < 15; i += 3) {
+    v = ((uint32_t)digest[i] << 16) | ((uint32_t)digest[i + 1] << 8) | digest[i + 2];
+    out[o++] = b64[(v >> 18) & 63];
+    out[o++] = b64[(v >> 12) & 63];
+    out[o++] = b64[(v >> 6) & 63];
+    out[o++] = b64[v & 63];
+  }
+  v = (uint32_t)digest[15] << 16;
+  out[o++] = b64[(v >> 18) & 63];
+  out[o++] = b64[(v >> 12) & 63];
+  out[o++] = '=';
+  out[o++] = '=';
+  out[o] = '\0';
+}
+
+
+/* ---- byte-offset compression ---- */
+
+/* CBF_BYTE_OFFSET: each pixel is stored as the difference from the previous
+   one, in 1 byte if it fits, else 0x80 and 2 bytes, else 0x80 0x8000 and
+   4 bytes, else 0x80 0x8000 0x80000000 and 8 bytes, all little endian.
+   *prev carries the last pixel between calls, so an image can be encoded in
+   slices; n_after is the number of pixels still to come after this slice.
+   Returns the encoded size, or (size_t)-1 if it would exceed cap. */
+static size_t byte_offset_encode(const int *data, size_t n, size_t n_after,
+                                 int64_t *prev_pixel, unsigned char *out,
+                                 size_t cap) {
+  unsigned char *p = out, *end = out + cap;
+  int64_t prev = *prev_pixel, d;
+  size_t i;
+  int k;
+
+  for (i = 0; i < n; i++) {
+    d = (int64_t)data[i] - prev;
+    prev = data[i];
+    if (d >= -127 && d <= 127) {
+      *p++ = (unsigned char)(d & 0xff);
+      continue;
+    }
+    *p++ = 0x80;
+    if (d >= -32767 && d <= 32767) {
+      *p++ = d & 0xff;
+      *p++ = (d >> 8) & 0xff;
+      continue;
+    }
+    *p++ = 0x00;
+    *p++ = 0x80;
+    if (d >= -2147483647LL && d <= 2147483647LL) {
+      for (k = 0; k < 4; k++) *p++ = (d >> (8 * k)) & 0xff;
+      continue;
+    }
+    // only differences between large values of opposite sign get here
+    if ((size_t)(end - p) < 12 + 7 * (n - i - 1 + n_after)) return (size_t)-1;
+    *p++ = 0x00;
+    *p++ = 0x00;
+    *p++ = 0x00;
+    *p++ = 0x80;
+    for (k = 0; k < 8; k++) *p++ = (d >> (8 * k)) & 0xff;
+  }
+  *prev_pixel = prev;
+  return p - out;
+}
+
+
+/* ---- template ---- */
+
+static char *dup_printf(size_t *len, const char *format, ...);
+
+int cbf_template_init(cbf_template *t, const char *header_head,
+                      const char *header_tail, size_t fast, size_t slow,
+                      int digest) {
+  memset(t, 0, sizeof(*t));
+  t->digest = digest;
+  t->fast = fast;
+  t->slow = slow;
+  t->nelements = fast * slow;
+
+  // the text field starts on the line after ';'
+  if (header_head[0] == '\n') header_head++;
+  t->head = dup_printf(&t->head_len,
+    "###CBF: VERSION 1.5, eiger2cbf template writer\n"
+    "\n"
+    "data_image_1\n"
+    "\n"
+    "_array_data.header_convention \"SLS_1.0\"\n"
+    "_array_data.header_contents\n"
+    ";\n"
+    "%s", header_head);
+  t->tail = dup_printf(&t->tail_len,
+    "%s"
+    ";\n"
+    "\n"
+    "_array_data.data\n"
+    ";\n"
+    "--CIF-BINARY-FORMAT-SECTION--\r\n"
+    "Content-Type: application/octet-stream;\r\n"
+    "     conversions=\"x-CBF_BYTE_OFFSET\"\r\n"
+    "Content-Transfer-Encoding: BINARY\r\n"
+    "X-Binary-Size: ", header_tail);
+  t->mime1 = dup_printf(&t->mime1_len,
+    "\r\n"
+    "X-Binary-ID: 1\r\n"
+    "X-Binary-Element-Type: \"signed 32-bit integer\"\r\n"
+    "X-Binary-Element-Byte-Order: LITTLE_ENDIAN\r\n");
+  t->mime2 = dup_printf(&t->mime2_len,
+    "X-Binary-Number-of-Elements: %lu\r\n"
+    "X-Binary-Size-Fastest-Dimension: %lu\r\n"
+    "X-Binary-Size-Second-Dimension: %lu\r\n"
+    "X-Binary-Size-Padding: %d\r\n"
+    "\r\n",
+    (unsigned long)t->nelements, (unsigned long)fast, (unsigned long)slow, CBF_PAD);
+
+  // 7 bytes per pixel covers all 32-bit differences; the payload is
+  // enlarged to the 15 byte worst case only if a frame needs it
+  t->payload_cap = 7 * t->nelements + 16;
+  t->payload = (unsigned char*)malloc(t->payload_cap);
+
+  if (!t->head || !t->tail || !t->mime1 || !t->mime2 || !t->payload) {
+    cbf_template_free(t);
+    return -1;
+  }
+  return 0;
+}
+
+/* Byte-offset encode the image, feeding each slice of output to MD5 while it
+   is still in cache. Returns the payload size, or (size_t)-1 if the 7 byte
+   per pixel payload is too small. */
+static size_t encode_and_digest(cbf_template *t, const int *data, md5_ctx *ctx) {
+  size_t done = 0, nbytes = 0, n, len;
+  int64_t prev = 0;
+
+  while (done < t->nelements) {
+    n = t->nelements - done;
+    if (n > CBF_DIGEST_SLICE) n = CBF_DIGEST_SLICE;
+    len = byte_offset_encode(data + done, n, t->nelements - done - n, &prev,
+                             t->payload + nbytes, t->payload_cap - nbytes);
+    if (len == (size_t)-1) return len;
+    if (t->digest) md5_update(ctx, t->payload + nbytes, len);
+    nbytes += len;
+    done += n;
+  }
+  return nbytes;
+}
+
+int cbf_template_write(cbf_template *t, FILE *fh, const char *varying,
+                       const int *data) {
+  size_t nbytes;
+  md5_ctx ctx;
+  unsigned char digest[16];
+  char md5[25];
+
+  md5_init(&ctx);
+  nbytes = encode_and_digest(t, data, &ctx);
+  if (nbytes == (size_t)-1) {
+    unsigned char *p = (unsigned char*)realloc(t->payload, 15 * t->nelements);
+    if (p == NULL) return -1;
+    t->payload = p;
+    t->payload_cap = 15 * t->nelements;
+    md5_init(&ctx);
+    nbytes = encode_and_digest(t, data, &ctx);
+  }
+  if (t->digest) {
+    md5_final(&ctx, digest);
+    md5_to_base64(digest, md5);
+  }
+
+  if (fwrite(t->head, 1, t->head_len, fh) != t->head_len ||
+      fputs(varying, fh) < 0 ||
+      fwrite(t->tail, 1, t->tail_len, fh) != t->tail_len ||
+      fprintf(fh, "%lu", (unsigned long)nbytes) < 0 ||
+      fwrite(t->mime1, 1, t->mime1_len, fh) != t->mime1_len ||
+      (t->digest && fprintf(fh, "Content-MD5: %s\r\n", md5) < 0) ||
+      fwrite(t->mime2, 1, t->mime2_len, fh) != t->mime2_len ||
+      fwrite(cbf_binary_marker, 1, 4, fh) != 4 ||
+      fwrite(t->payload, 1, nbytes, fh) != nbytes ||
+      fwrite(cbf_padding, 1, CBF_PAD, fh) != CBF_PAD ||
+      fwrite(cbf_trailer, 1, sizeof(cbf_trailer) - 1, fh) != sizeof(cbf_trailer) - 1) {
+    return -1;
+  }
+  return 0;
+}
+
+void cbf_template_free(cbf_template *t) {
+  free(t->head);
+  free(t->tail);
+  free(t->mime1);
+  free(t->mime2);
+  free(t->payload);
+  memset(t, 0, sizeof(*t));
+}
+
+
+static char *dup_printf(size_t *len, const char *format, ...) {
+  va_list ap;
+  int n;
+  char *s;
+
+  va_start(ap, format);
+  n = vsnprintf(NULL, 0, format, ap);
+  va_end(ap);
+  if (n < 0) return NULL;
+  s = (char*)malloc(n + 1);
+  if (s == NULL) return NULL;
+  va_start(ap, format);
+  vsnprintf(s, n + 1, format, ap);
+  va_end(ap);
+  *len = n;
+  return s;
+}
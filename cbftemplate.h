@@ -0,0 +1,49 @@
+/* cbftemplate.h -- template based miniCBF writer for eiger2cbf
+
+   A conversion run writes thousands of CBFs that differ only in a few
+   header values and the image. The template renders the CIF header,
+   the MIME framing and the padding once; each frame then only formats the
+   varying header text, byte-offset compresses the image, computes the
+   MD5 and writes the pieces out. The output is the same miniCBF layout
+   CBFlib writes with MSG_DIGEST | MIME_HEADERS | PAD_4K.
+*/
+
+#ifndef CBFTEMPLATE_H
+#define CBFTEMPLATE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct {
+  char *head;              /* magic, CIF header and header contents up to the varying text */
+  size_t head_len;
+  char *tail;              /* header contents after the varying text, up to X-Binary-Size */
+  size_t tail_len;
+  char *mime1;             /* MIME lines after X-Binary-Size up to Content-MD5 */
+  size_t mime1_len;
+  char *mime2;             /* MIME lines after Content-MD5 up to the binary marker */
+  size_t mime2_len;
+  size_t nelements, fast, slow;
+  unsigned char *payload;  /* byte-offset compressed image, reused for every frame */
+  size_t payload_cap;
+  int digest;              /* write a Content-MD5 line */
+} cbf_template;
+
+/* Prepare a template for fast x slow images of signed 32-bit pixels.
+   header_head and header_tail are the miniCBF header contents before and
+   after the text that changes from frame to frame (e.g. the Start_angle
+   value); a leading newline in header_head is dropped. If digest is
+   nonzero, a Content-MD5 is computed while the image is encoded; otherwise
+   the line is left out. Returns 0 on success, -1 on allocation failure. */
+int cbf_template_init(cbf_template *t, const char *header_head,
+                      const char *header_tail, size_t fast, size_t slow,
+                      int digest);
+
+/* Write one CBF with the varying header text and image data to fh.
+   Returns 0 on success, -1 on a write error. */
+int cbf_template_write(cbf_template *t, FILE *fh, const char *varying,
+                       const int *data);
+
+void cbf_template_free(cbf_template *t);
+
+#endif /* CBFTEMPLATE_H */
@@ -0,0 +1,138 @@
+/* convcore.c -- conversion core shared by eiger2cbf, xsplambda2cbf and
+   the XDS plugin
+
+   See convcore.h.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hdf5.h"
+#include "convcore.h"
+
+static int eiger_detect(frame_source *fs, metacache *mc) {
+  fs->block_start = metacache_find_dataset(mc, fs->group, "data_000000") ? 0 : 1;
+  return 1;
+}
+
+static void eiger_locate(const frame_source *fs, int frame, char *name, size_t size, hsize_t *index) {
+  int per_block = fs->per_block > 0 ? fs->per_block : 1;
+  snprintf(name, size, "data_%06d", fs->block_start + (frame - 1) / per_block);
+  *index = (frame - 1) % per_block;
+}
+
+static int single_detect(frame_source *fs, metacache *mc) {
+  return metacache_find_dataset(mc, fs->group, "data");
+}
+
+static void single_locate(const frame_source *fs, int frame, char *name, size_t size, hsize_t *index) {
+  (void)fs;
+  snprintf(name, size, "data");
+  *index = frame - 1;
+}
+
+const frame_layout frame_layout_eiger = {"eiger", eiger_detect, eiger_locate};
+const frame_layout frame_layout_single = {"single", single_detect, single_locate};
+
+static void close_dataset(frame_source *fs) {
+  if (fs->data < 0) return;
+  if (fs->space >= 0) H5Sclose(fs->space);
+  H5Dclose(fs->data);
+  fs->data = fs->space = -1;
+}
+
+void frame_source_init(frame_source *fs, metacache *mc, hid_t group,
+                       const frame_layout *const *layouts, int xpixels, int ypixels) {
+  hsize_t index;
+
+  memset(fs, 0, sizeof(*fs));
+  fs->group = group;
+  fs->xpixels = xpixels;
+  fs->ypixels = ypixels;
+  fs->out_width = xpixels;
+  fs->data = fs->space = fs->memspace = -1;
+  for (; *layouts != NULL; layouts++) {
+    fs->layout = *layouts;
+    if (fs->layout->detect(fs, mc)) break;
+  }
+  fs->layout->locate(fs, 1, fs->name, sizeof(fs->name), &index);
+}
+
+int frame_source_dims(frame_source *fs, metacache *mc, hsize_t dims[3]) {
+  int rank = metacache_get_dims(mc, fs->group, fs->name, dims);
+  if (rank == 3) fs->per_block = dims[0];
+  return rank;
+}
+
+int frame_source_read(frame_source *fs, int frame, unsigned int *buf) {
+  char name[20];
+  hsize_t index;
+  hsize_t count[3] = {1, fs->ypixels, fs->xpixels};
+
+  fs->layout->locate(fs, frame, name, sizeof(name), &index);
+  if (fs->reopen || fs->data < 0 || strcmp(name, fs->name)) {
+    close_dataset(fs);
+    snprintf(fs->name, sizeof(fs->name), "%s", name);
+    fs->data = fs->open ? fs->open(fs->open_arg, fs->group, name, index)
+                        : H5Dopen2(fs->group, name, H5P_DEFAULT);
+    if (fs->data < 0) return -1;
+    fs->space = H5Dget_space(fs->data);
+    if (fs->space < 0 || H5Sget_simple_extent_ndims(fs->space) != 3) {
+      close_dataset(fs);
+      return -2;
+    }
+  }
+  if (fs->memspace < 0) {
+    hsize_t image[3] = {1, fs->out_y + fs->ypixels, fs->out_width};
+    hsize_t start[3] = {0, fs->out_y, fs->out_x};
+    fs->memspace = H5Screate_simple(3, image, NULL);
+    if (fs->memspace < 0) return -3;
+    if (H5Sselect_hyperslab(fs->memspace, H5S_SELECT_SET, start, NULL, count, NULL) < 0) {
+      H5Sclose(fs->memspace);
+      fs->memspace = -1;
+      return -3;
+    }
+  }
+
+  hsize_t offset[3] = {index, 0, 0};
+  if (H5Sselect_hyperslab(fs->space, H5S_SELECT_SET, offset, NULL, count, NULL) < 0 ||
+      H5Dread(fs->data, H5T_NATIVE_UINT, fs->memspace, fs->space, H5P_DEFAULT, buf) < 0) {
+    return -3;
+  }
+  return 0;
+}
+
+void frame_source_close(frame_source *fs) {
+  close_dataset(fs);
+  if (fs->memspace >= 0) H5Sclose(fs->memspace);
+  fs->memspace = -1;
+}
+
+void mask_frame(const unsigned int *buf, const int *mask, unsigned int error_val,
+                int *out, size_t n) {
+  size_t i;
+
+  if (mask == NULL) {
+    for (i = 0; i < n; i++) out[i] = buf[i] == error_val ? -1 : (int)buf[i];
+  } else {
+    for (i = 0; i < n; i++) {
+      if (mask[i] == 1) out[i] = -1;
+      else if (mask[i] > 1) out[i] = -2;
+      else out[i] = buf[i];
+    }
+  }
+}
+
+void sum_frame(unsigned int *acc, const unsigned int *buf, unsigned int cutoff, unsigned int cap,
+               unsigned int error_val, size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    unsigned int a = acc[i], v = buf[i];
+    unsigned int w = v >= cutoff || v > cap ? cap : v;
+    // a <= cap and w <= cap, so a + w cannot wrap
+    unsigned int s = a + w;
+    s = s > cap ? cap : s;
+    acc[i] = a == SUM_ERROR || v == error_val ? SUM_ERROR : s;
+  }
+}
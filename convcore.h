@@ -0,0 +1,86 @@
+/* convcore.h -- conversion core shared by eiger2cbf, xsplambda2cbf and
+   the XDS plugin
+
+   The tools differ in their metadata and in what they write, but not in
+   how a frame gets from HDF5 into a signed 32-bit image. A frame_source
+   finds the frames through a layout adapter (Eiger data_NNNNNN blocks or
+   the single "data" dataset of Lambda), keeps the dataset holding the
+   last frame open so that consecutive frames are plain hyperslab reads,
+   and mask_frame turns the raw counts into CBF values. Changes to either
+   reach every tool at once.
+*/
+
+#ifndef CONVCORE_H
+#define CONVCORE_H
+
+#include <stddef.h>
+#include "hdf5.h"
+#include "metacache.h"
+
+typedef struct frame_source frame_source;
+
+typedef struct {
+  const char *name;
+  /* Set up fs for its group; non-zero if the group has this layout. */
+  int (*detect)(frame_source *fs, metacache *mc);
+  /* The dataset holding frame (1-indexed) and the frame's index in it. */
+  void (*locate)(const frame_source *fs, int frame, char *name, size_t size, hsize_t *index);
+} frame_layout;
+
+extern const frame_layout frame_layout_eiger;   /* data_NNNNNN from data_000000 or data_000001 */
+extern const frame_layout frame_layout_single;  /* all frames in one "data" dataset */
+
+struct frame_source {
+  const frame_layout *layout;
+  hid_t group;             /* /entry/data, or /entry if there is none */
+  int block_start;         /* first data_NNNNNN block */
+  int per_block;           /* frames per dataset */
+  int xpixels, ypixels;
+  /* Opens a dataset for the frame at index in it; NULL for H5Dopen2.
+     eiger2cbf --follow uses this to wait for the frame to be written. */
+  hid_t (*open)(void *arg, hid_t group, const char *name, hsize_t index);
+  void *open_arg;
+  int reopen;              /* reopen the dataset for every frame, e.g. while it grows */
+  /* Where frames go in the image passed to frame_source_read: an image
+     out_width pixels wide with the frame's first pixel at (out_x, out_y).
+     By default the image is just the frame; a stitched multi-module image
+     sets these per module. Set them before the first read. */
+  int out_width, out_x, out_y;
+  char name[20];           /* the first dataset after init, then that of the last frame read */
+  hid_t data, space, memspace;
+};
+
+/* Pick the first of the NULL-terminated layouts that matches group; the
+   last one is used if none does. fs->name is the first dataset. */
+void frame_source_init(frame_source *fs, metacache *mc, hid_t group,
+                       const frame_layout *const *layouts, int xpixels, int ypixels);
+
+/* The dims of the first dataset, setting per_block from them. Returns the
+   rank, or -1 if it cannot be opened. */
+int frame_source_dims(frame_source *fs, metacache *mc, hsize_t dims[3]);
+
+/* Read frame (1-indexed) into buf as unsigned ints, placed as given by
+   out_width, out_x and out_y. Returns 0 on success,
+   -1 if its dataset (fs->name) cannot be opened, -2 if that is not 3-D
+   and -3 if the read fails. */
+int frame_source_read(frame_source *fs, int frame, unsigned int *buf);
+
+void frame_source_close(frame_source *fs);
+
+/* Convert n raw pixels to CBF values: -1 for pixels masked as 1 (or equal
+   to error_val when there is no mask), -2 for other masked pixels. mask
+   is NULL if the file has no pixel mask. */
+void mask_frame(const unsigned int *buf, const int *mask, unsigned int error_val,
+                int *out, size_t n);
+
+/* Summing frames: add n raw pixels of buf into acc, zeroed for the first
+   frame. Sums saturate at cap (at most INT_MAX) and a pixel at or above
+   cutoff in any frame, an overload, makes the sum cap. A pixel at
+   error_val in any frame makes the sum SUM_ERROR, which mask_frame with
+   error_val SUM_ERROR writes as -1 unless the mask says otherwise. The
+   loop is branch-free so that the compiler can vectorize it. */
+#define SUM_ERROR 0xFFFFFFFFu
+void sum_frame(unsigned int *acc, const unsigned int *buf, unsigned int cutoff, unsigned int cap,
+               unsigned int error_val, size_t n);
+
+#endif /* CONVCORE_H */
@@ -0,0 +1,556 @@
+/*
+ EIGER HDF5 to CBF virtual filesystem
+
+ Mounts a directory in which every frame of a master h5 file appears as
+ prefix_NNNNNN.cbf. Nothing is stored: the CBF is produced when a frame is
+ first looked at, by running "eiger2cbf --template --stream -" on the frame
+ (or a run of frames) and reading back the records, in the same way
+ plugin.c hands the HDF5 work to eiger2cbf-so-worker.
+
+ - sizes of converted frames are remembered for the life of the mount, so
+   stat() is cheap after a frame has been seen once. The size is only known
+   from the CBF, so a stat of an unseen frame converts it together with the
+   next --readahead frames in one run, and "ls -l" on a fresh mount still
+   converts the whole dataset, a run at a time;
+ - converted CBFs are kept in an LRU cache of --cache frames;
+ - when frames are read in order (as XDS and MOSFLM do), the next
+   --readahead frames are converted in the background by one eiger2cbf
+   run while the current frame is being processed;
+ - every eiger2cbf run shares a metadata cache (--meta-cache, by default a
+   private directory removed at unmount), so only the first run reads the
+   header metadata and pixel mask from HDF5.
+
+To build:
+
+ gcc -std=gnu99 -o eiger2cbf-fuse -g -O3 -D_FILE_OFFSET_BITS=64 \
+     -I/usr/include/fuse eiger2cbf-fuse.c -lfuse -lpthread
+
+Usage:
+
+ eiger2cbf-fuse [options] master.h5 mountpoint [FUSE options]
+ fusermount -u mountpoint
+*/
+
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fuse.h>
+
+#define DEFAULT_CACHE 64
+#define DEFAULT_READAHEAD 8
+
+typedef struct {
+  int frame;                  /* 0 when the slot is empty */
+  char *data;
+  size_t len;
+  unsigned long last_use;
+} cached_frame;
+
+struct FsData {
+  char master[PATH_MAX];      /* absolute path of the master h5 */
+  char prefix[256];           /* file names are prefix%06d.cbf */
+  const char *converter;      /* eiger2cbf executable */
+  char meta_cache[PATH_MAX];  /* EIGER2CBF_META_CACHE of the converter runs */
+  int private_cache;          /* meta_cache was made by us, remove at exit */
+  int nimages;
+  struct stat master_st;
+
+  off_t *sizes;               /* CBF size of each frame, -1 if not known yet */
+  cached_frame *cache;
+  int ncache;
+  unsigned long clock;        /* LRU time stamp */
+  int readahead;
+  int last_frame;             /* last frame read, to detect sequential access */
+  pthread_mutex_t lock;       /* sizes, cache, clock and last_frame */
+
+  pthread_mutex_t convert_lock; /* one eiger2cbf run at a time */
+  int converting_from, converting_to; /* frames of the current run, 0 for none */
+  pthread_cond_t converted;   /* signalled as each frame of a run arrives */
+
+  pthread_t prefetcher;
+  pthread_cond_t prefetch_cond;
+  int prefetch_from;          /* first frame the prefetcher should convert, 0 for none */
+};
+struct FsData FS;
+
+void usage(int argc, char **argv) {
+    printf("Usage:\n");
+    printf("  %s [options] master.h5 mountpoint [FUSE options]\n", argv[0]);
+    printf("  Frames appear in mountpoint as prefix_NNNNNN.cbf, converted on first access.\n");
+    printf("  The size of a frame is only known once it is converted, so a stat of an\n");
+    printf("  unseen frame (e.g. ls -l) converts it and the next --readahead frames;\n");
+    printf("  plain ls does not.\n");
+    printf("  options:\n");
+    printf("    -h or --help                     -- print this message\n");
+    printf("    --prefix prefix                  -- file name prefix (default: the master file\n");
+    printf("                                        name without \"master.h5\")\n");
+    printf("    --cache nframes                  -- keep nframes converted CBFs in memory (default %d)\n", DEFAULT_CACHE);
+    printf("    --readahead nframes              -- convert nframes ahead on sequential reads,\n");
+    printf("                                        0 to disable (default %d); at most nframes-1\n", DEFAULT_READAHEAD);
+    printf("    --eiger2cbf path                 -- converter to run (default: eiger2cbf in PATH)\n");
+    printf("    --meta-cache dir                 -- metadata cache shared by the converter runs\n");
+    printf("                                        (default: $EIGER2CBF_META_CACHE, or a private\n");
+    printf("                                        directory removed at unmount)\n");
+    return;
+}
+
+/* Start the converter with its STDOUT connected to a pipe. */
+FILE *run_converter(char **args, pid_t *pid) {
+  int fds[2];
+  if (pipe(fds) != 0) return NULL;
+  *pid = fork();
+  if (*pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return NULL;
+  }
+  if (*pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(fds[1], 1);
+    if (devnull >= 0) dup2(devnull, 2);
+    close(fds[0]);
+    close(fds[1]);
+    execvp(args[0], args);
+    _exit(127);
+  }
+  close(fds[1]);
+  return fdopen(fds[0], "rb");
+}
+
+/* Put a converted CBF into the LRU cache; takes ownership of data.
+   Called with FS.lock held. */
+void cache_insert(int frame, char *data, size_t len) {
+  int i, victim = 0;
+  for (i = 0; i < FS.ncache; i++) {
+    if (FS.cache[i].frame == frame) {
+      free(data);
+      return;
+    }
+    // empty slots have last_use 0, so they are taken first
+    if (FS.cache[i].last_use < FS.cache[victim].last_use) victim = i;
+  }
+  free(FS.cache[victim].data);
+  FS.cache[victim].frame = frame;
+  FS.cache[victim].data = data;
+  FS.cache[victim].len = len;
+  FS.cache[victim].last_use = ++FS.clock;
+  FS.sizes[frame - 1] = len;
+}
+
+/* Called with FS.lock held. */
+int cache_has(int frame) {
+  int i;
+  for (i = 0; i < FS.ncache; i++) {
+    if (FS.cache[i].frame == frame) return 1;
+  }
+  return 0;
+}
+
+/* As cache_has, but returns the entry and marks it as recently used. */
+cached_frame *cache_find(int frame) {
+  int i;
+  for (i = 0; i < FS.ncache; i++) {
+    if (FS.cache[i].frame == frame) {
+      FS.cache[i].last_use = ++FS.clock;
+      return &FS.cache[i];
+    }
+  }
+  return NULL;
+}
+
+/* Read --stream records for frames from..to into the cache. Returns 0 when
+   the end of stream record is seen, -1 otherwise. */
+int read_records(FILE *fh, int from, int to) {
+  unsigned char head[16];
+  unsigned long long len;
+  unsigned int frame;
+  char *data;
+  int i;
+
+  while (fread(head, 1, sizeof(head), fh) == sizeof(head)) {
+    if (memcmp(head, "E2CF", 4) != 0) return -1;
+    frame = 0;
+    len = 0;
+    for (i = 0; i < 4; i++) frame |= (unsigned int)head[4 + i] << (8 * i);
+    for (i = 0; i < 8; i++) len |= (unsigned long long)head[8 + i] << (8 * i);
+    if (frame == 0 && len == 0) return 0;
+    if (frame < (unsigned int)from || frame > (unsigned int)to) return -1;
+    data = (char*)malloc(len);
+    if (data == NULL || fread(data, 1, len, fh) != len) {
+      free(data);
+      return -1;
+    }
+    pthread_mutex_lock(&FS.lock);
+    cache_insert(frame, data, len);
+    pthread_cond_broadcast(&FS.converted);
+    pthread_mutex_unlock(&FS.lock);
+  }
+  return -1;
+}
+
+/* Convert frames from..to with one eiger2cbf run and cache them. Frames
+   already in the cache are skipped at the ends of the range. */
+int convert_range(int from, int to) {
+  char range[64];
+  char *args[] = {(char*)FS.converter, "--template", "--stream", "-", FS.master, range, NULL};
+  int status, ret = -1;
+  pid_t pid;
+  FILE *fh;
+
+  pthread_mutex_lock(&FS.convert_lock);
+  pthread_mutex_lock(&FS.lock);
+  while (from <= to && cache_has(from)) from++;
+  while (to >= from && cache_has(to)) to--;
+  if (from > to) {
+    pthread_mutex_unlock(&FS.lock);
+    pthread_mutex_unlock(&FS.convert_lock);
+    return 0;
+  }
+  FS.converting_from = from;
+  FS.converting_to = to;
+  pthread_mutex_unlock(&FS.lock);
+
+  snprintf(range, sizeof(range), "%d:%d", from, to);
+  fh = run_converter(args, &pid);
+  if (fh != NULL) {
+    ret = read_records(fh, from, to);
+    fclose(fh);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ret = -1;
+  }
+
+  pthread_mutex_lock(&FS.lock);
+  FS.converting_from = FS.converting_to = 0;
+  pthread_cond_broadcast(&FS.converted);
+  pthread_mutex_unlock(&FS.lock);
+  pthread_mutex_unlock(&FS.convert_lock);
+  if (ret < 0) fprintf(stderr, "eiger2cbf-fuse error: %s failed for frames %d:%d\n", FS.converter, from, to);
+  return ret;
+}
+
+void *prefetch_loop(void *arg) {
+  int from, to;
+  (void)arg;
+  pthread_mutex_lock(&FS.lock);
+  for (;;) {
+    while (FS.prefetch_from == 0) pthread_cond_wait(&FS.prefetch_cond, &FS.lock);
+    from = FS.prefetch_from;
+    FS.prefetch_from = 0;
+    pthread_mutex_unlock(&FS.lock);
+
+    to = from + FS.readahead - 1;
+    if (to > FS.nimages) to = FS.nimages;
+    convert_range(from, to);
+
+    pthread_mutex_lock(&FS.lock);
+  }
+  return NULL;
+}
+
+/* Copy up to size bytes at offset of a frame's CBF into buf, converting it
+   first if it is not cached. Returns the number of bytes copied or -errno. */
+int read_frame(int frame, char *buf, size_t size, off_t offset) {
+  cached_frame *c;
+  int sequential, ret, ahead, tries;
+
+  pthread_mutex_lock(&FS.lock);
+  sequential = (frame == FS.last_frame || frame == FS.last_frame + 1);
+  FS.last_frame = frame;
+  // the frame may be on its way from a read-ahead run; no need to wait for
+  // the rest of that run
+  while (!cache_has(frame) && frame >= FS.converting_from && frame <= FS.converting_to) {
+    pthread_cond_wait(&FS.converted, &FS.lock);
+  }
+  // the copy is made with the lock held: once it is dropped, other readers
+  // and the read-ahead run may evict the frame, so convert again if that
+  // happened before we got back here
+  for (tries = 0; (c = cache_find(frame)) == NULL && tries < 2; tries++) {
+    pthread_mutex_unlock(&FS.lock);
+    ret = convert_range(frame, frame);
+    pthread_mutex_lock(&FS.lock);
+    if (ret < 0) break;
+  }
+  if (c == NULL) {
+    ret = -EIO;
+  } else if (offset >= (off_t)c->len) {
+    ret = 0;
+  } else {
+    if (offset + size > c->len) size = c->len - offset;
+    memcpy(buf, c->data + offset, size);
+    ret = size;
+  }
+  // a sequential reader will want the following frames as well
+  if (sequential && c != NULL && FS.readahead > 0 && FS.prefetch_from == 0) {
+    for (ahead = frame + 1; ahead <= frame + FS.readahead && ahead <= FS.nimages; ahead++) {
+      if (!cache_has(ahead)) {
+        FS.prefetch_from = ahead;
+        pthread_cond_signal(&FS.prefetch_cond);
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&FS.lock);
+  return ret;
+}
+
+/* Frame number for "/prefixNNNNNN.cbf", or 0. */
+int path_to_frame(const char *path) {
+  size_t plen = strlen(FS.prefix);
+  char *endptr;
+  long frame;
+  if (path[0] != '/' || strncmp(path + 1, FS.prefix, plen) != 0) return 0;
+  path += 1 + plen;
+  if (strlen(path) != 10 || strcmp(path + 6, ".cbf") != 0) return 0;
+  frame = strtol(path, &endptr, 10);
+  if (endptr != path + 6 || frame < 1 || frame > FS.nimages) return 0;
+  return frame;
+}
+
+static int fs_getattr(const char *path, struct stat *st) {
+  int frame;
+  off_t size;
+  memset(st, 0, sizeof(*st));
+  st->st_uid = FS.master_st.st_uid;
+  st->st_gid = FS.master_st.st_gid;
+  st->st_mtime = st->st_ctime = st->st_atime = FS.master_st.st_mtime;
+  if (strcmp(path, "/") == 0) {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    return 0;
+  }
+  frame = path_to_frame(path);
+  if (frame == 0) return -ENOENT;
+
+  pthread_mutex_lock(&FS.lock);
+  size = FS.sizes[frame - 1];
+  pthread_mutex_unlock(&FS.lock);
+  if (size < 0) {
+    // the size is only known once the frame has been converted; one run
+    // for the following frames as well spares "ls -l" a converter start
+    // per frame. This is not a read, so it does not start read-ahead.
+    int to = frame + FS.readahead;
+    if (to > FS.nimages) to = FS.nimages;
+    convert_range(frame, to);
+    pthread_mutex_lock(&FS.lock);
+    size = FS.sizes[frame - 1];
+    pthread_mutex_unlock(&FS.lock);
+    if (size < 0) return -EIO;
+  }
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_size = size;
+  return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t offset, struct fuse_file_info *fi) {
+  char name[300];
+  int frame;
+  (void)offset;
+  (void)fi;
+  if (strcmp(path, "/") != 0) return -ENOENT;
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  for (frame = 1; frame <= FS.nimages; frame++) {
+    snprintf(name, sizeof(name), "%s%06d.cbf", FS.prefix, frame);
+    if (filler(buf, name, NULL, 0)) break;
+  }
+  return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+  if (path_to_frame(path) == 0) return -ENOENT;
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+  fi->keep_cache = 1;
+  return 0;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi) {
+  int frame = path_to_frame(path);
+  (void)fi;
+  if (frame == 0) return -ENOENT;
+  return read_frame(frame, buf, size, offset);
+}
+
+/* Runs in the mounted (possibly daemonized) process, so the read-ahead
+   thread is started here rather than in main(). */
+static void *fs_init(struct fuse_conn_info *conn) {
+  (void)conn;
+  if (FS.readahead > 0 && pthread_create(&FS.prefetcher, NULL, prefetch_loop, NULL) != 0) {
+    fprintf(stderr, "eiger2cbf-fuse error: failed to start the read-ahead thread\n");
+    FS.readahead = 0;
+  }
+  return NULL;
+}
+
+static struct fuse_operations fs_ops = {
+  .init = fs_init,
+  .getattr = fs_getattr,
+  .readdir = fs_readdir,
+  .open = fs_open,
+  .read = fs_read,
+};
+
+/* Remove a metadata cache directory made by main. */
+void remove_private_cache(void) {
+  char name[PATH_MAX + 256];
+  struct dirent *de;
+  DIR *dir = opendir(FS.meta_cache);
+  if (dir != NULL) {
+    while ((de = readdir(dir)) != NULL) {
+      if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+      snprintf(name, sizeof(name), "%s/%s", FS.meta_cache, de->d_name);
+      unlink(name);
+    }
+    closedir(dir);
+  }
+  rmdir(FS.meta_cache);
+}
+
+/* Number of frames as reported by "eiger2cbf master.h5". */
+int query_nimages(void) {
+  char *args[] = {(char*)FS.converter, FS.master, NULL};
+  int nimages = -1, status;
+  pid_t pid;
+  FILE *fh = run_converter(args, &pid);
+  if (fh == NULL) return -1;
+  if (fscanf(fh, "%d", &nimages) != 1) nimages = -1;
+  fclose(fh);
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+  return nimages;
+}
+
+int main(int argc, char **argv) {
+  int optcount = 0;
+  int ii, i;
+  char *endptr, *fndptr;
+  char *prefix = NULL;
+  char *meta_cache = getenv("EIGER2CBF_META_CACHE");
+  char **fuse_argv;
+  int fuse_argc, ret;
+
+  FS.converter = "eiger2cbf";
+  FS.ncache = DEFAULT_CACHE;
+  FS.readahead = DEFAULT_READAHEAD;
+
+  for (ii = 1; ii < argc; ii++) {
+    if (!strcmp(argv[ii],"-h") || !strcmp(argv[ii],"--help")) {
+      usage(argc, argv);
+      return 0;
+    } else if (!strcmp(argv[ii],"--prefix") && ii < argc-1) {
+      prefix = argv[++ii];
+      optcount += 2;
+    } else if (!strcmp(argv[ii],"--eiger2cbf") && ii < argc-1) {
+      FS.converter = argv[++ii];
+      optcount += 2;
+    } else if (!strcmp(argv[ii],"--meta-cache") && ii < argc-1) {
+      meta_cache = argv[++ii];
+      optcount += 2;
+    } else if (!strcmp(argv[ii],"--cache") && ii < argc-1) {
+      FS.ncache = strtol(argv[++ii],&endptr,10);
+      optcount += 2;
+      if (!endptr || endptr==argv[ii] || *endptr!='\0' || FS.ncache < 1) {
+        fprintf(stderr, "eiger2cbf-fuse error: --cache invalid value\n");
+        return -1;
+      }
+    } else if (!strcmp(argv[ii],"--readahead") && ii < argc-1) {
+      FS.readahead = strtol(argv[++ii],&endptr,10);
+      optcount += 2;
+      if (!endptr || endptr==argv[ii] || *endptr!='\0' || FS.readahead < 0) {
+        fprintf(stderr, "eiger2cbf-fuse error: --readahead invalid value\n");
+        return -1;
+      }
+    } else break;
+  }
+  if (argc-optcount < 3) {
+    usage(argc, argv);
+    return -1;
+  }
+  // a read-ahead run must leave room in the cache for the frame being read
+  if (FS.readahead > FS.ncache - 1) {
+    fprintf(stderr, "eiger2cbf-fuse warning: --readahead reduced to %d to fit --cache %d\n",
+      FS.ncache - 1, FS.ncache);
+    FS.readahead = FS.ncache - 1;
+  }
+
+  // FUSE changes the working directory, so resolve the master file first
+  if (realpath(argv[1+optcount], FS.master) == NULL || stat(FS.master, &FS.master_st) != 0) {
+    fprintf(stderr, "eiger2cbf-fuse error: failed to open file %s\n", argv[1+optcount]);
+    return -1;
+  }
+  if (prefix) {
+    snprintf(FS.prefix, sizeof(FS.prefix), "%s", prefix);
+  } else {
+    fndptr = strrchr(FS.master, '/');
+    snprintf(FS.prefix, sizeof(FS.prefix), "%s", fndptr ? fndptr + 1 : FS.master);
+    fndptr = strstr(FS.prefix, "master.h5");
+    if (fndptr) *fndptr = '\0';
+  }
+  if (strchr(FS.prefix, '/')) {
+    fprintf(stderr, "eiger2cbf-fuse error: --prefix must not contain '/'\n");
+    return -1;
+  }
+
+  // every converter run reads the same header metadata and pixel mask, so
+  // they share a metadata cache; like the master file, it must be an
+  // absolute path
+  if (meta_cache != NULL && meta_cache[0] != '\0') {
+    if (realpath(meta_cache, FS.meta_cache) == NULL) {
+      fprintf(stderr, "eiger2cbf-fuse error: failed to open --meta-cache directory %s\n", meta_cache);
+      return -1;
+    }
+  } else {
+    snprintf(FS.meta_cache, sizeof(FS.meta_cache), "/tmp/eiger2cbf-fuse.XXXXXX");
+    if (mkdtemp(FS.meta_cache) != NULL) {
+      FS.private_cache = 1;
+    } else {
+      fprintf(stderr, "eiger2cbf-fuse warning: failed to make a metadata cache directory\n");
+      FS.meta_cache[0] = '\0';
+    }
+  }
+  if (FS.meta_cache[0] != '\0') setenv("EIGER2CBF_META_CACHE", FS.meta_cache, 1);
+
+  FS.nimages = query_nimages();
+  if (FS.nimages < 1) {
+    fprintf(stderr, "eiger2cbf-fuse error: %s could not read the number of frames in %s\n",
+            FS.converter, FS.master);
+    if (FS.private_cache) remove_private_cache();
+    return -1;
+  }
+  fprintf(stderr, "eiger2cbf-fuse: %d frames as %s000001.cbf to %s%06d.cbf\n",
+          FS.nimages, FS.prefix, FS.prefix, FS.nimages);
+
+  FS.sizes = (off_t*)malloc(sizeof(off_t) * FS.nimages);
+  FS.cache = (cached_frame*)calloc(FS.ncache, sizeof(cached_frame));
+  if (FS.sizes == NULL || FS.cache == NULL) {
+    fprintf(stderr, "eiger2cbf-fuse error: failed to allocate memory\n");
+    if (FS.private_cache) remove_private_cache();
+    return -1;
+  }
+  for (i = 0; i < FS.nimages; i++) FS.sizes[i] = -1;
+  pthread_mutex_init(&FS.lock, NULL);
+  pthread_mutex_init(&FS.convert_lock, NULL);
+  pthread_cond_init(&FS.prefetch_cond, NULL);
+  pthread_cond_init(&FS.converted, NULL);
+
+  // hand the mountpoint and any remaining options to FUSE
+  fuse_argc = argc - optcount - 1;
+  fuse_argv = (char**)malloc(sizeof(char*) * (fuse_argc + 1));
+  fuse_argv[0] = argv[0];
+  for (i = 1; i < fuse_argc; i++) fuse_argv[i] = argv[optcount + 1 + i];
+  fuse_argv[fuse_argc] = NULL;
+  ret = fuse_main(fuse_argc, fuse_argv, &fs_ops, NULL);
+  if (FS.private_cache) remove_private_cache();
+  return ret;
+}
@@ -9,7 +9,7 @@ Linux
 gcc -std=c99 -o eiger2cbf -g \
  -I$HOME/prog/dials/modules/cbflib/include \
  -L$HOME/prog/dials/build/lib -Ilz4 \
- eiger2cbf.c \
+ eiger2cbf.c cbftemplate.c \
  lz4/lz4.c lz4/h5zlz4.c \
  bitshuffle/bshuf_h5filter.c \
  bitshuffle/bshuf_h5plugin.c \
@@ -22,7 +22,7 @@ Mac OS X
 
 gcc -std=c99 -o eiger2cbf -g \
  -ICBFlib-0.9.5.2/include -Ilz4 \
- eiger2cbf.c \
+ eiger2cbf.c cbftemplate.c \
  lz4/lz4.c lz4/h5zlz4.c \
  bitshuffle/bshuf_h5filter.c \
  bitshuffle/bshuf_h5plugin.c \
@@ -34,14 +34,35 @@ gcc -std=c99 -o eiger2cbf -g \
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "cbf.h"
 #include "cbf_simple.h"
 #include "hdf5.h"
 #include "hdf5_hl.h"
+#include "cbftemplate.h"
+#include "metacache.h"
+#include "convcore.h"
 
 
 extern const H5Z_class2_t H5Z_LZ4;
@@ -57,7 +78,16 @@ void usage( int argc, char **argv ) {
     printf("  %s [options] filename.h5 N out.cbf -- write N-th frame to out.cbf\n", argv[0]);
     printf("  %s [options] filename.h5 N         -- write N-th frame to STDOUT\n", argv[0]);
     printf("  %s [options] filename.h5 N:M   out -- write N to M-th frames to outNNNNNN.cbf\n", argv[0]);
+    printf("  %s --count [options] a.h5 [b.h5 ...]\n", argv[0]);
+    printf("                                     -- print \"frames filename\" for each master file,\n");
+    printf("                                        counting the frames in its data blocks\n");
+    printf("                                        (-1 if they cannot be read)\n");
+    printf("  %s --stream dest [options] filename.h5 N:M\n", argv[0]);
+    printf("                                     -- write N to M-th frames as a stream of records\n");
     printf("  N starts from 1. The file should be \"master\" h5.\n");
+    printf("  CBF files are written as name.part and renamed when complete. With N:M, each\n");
+    printf("  completed frame is also recorded in out.journal. Files are only known to be\n");
+    printf("  on disk, and so to survive a crash, with --sync-batch.\n");
     printf("  options:\n");
     printf("    -h or --help                     -- print this message\n");
     printf("    -v or --verbose                  -- provide more detail in output\n"); 
@@ -65,10 +95,572 @@ void usage( int argc, char **argv ) {
     printf("    --detector detector              -- dectector such as \"Eiger 1M CdTe\"\n");
     printf("    --detector_sn serial_no          -- dectector serial number\n");
     printf("    --nimages images                 -- override the number of images\n");
+    printf("    --nproc nproc                    -- convert N:M with nproc worker processes\n");
+    printf("                                        sharing the metadata read once\n");
+    printf("    --sum nsum                       -- sum each nsum consecutive frames into one\n");
+    printf("                                        image; N:M must cover whole groups (such as\n");
+    printf("                                        1:3600 with --sum 10) and image k, the sum of\n");
+    printf("                                        frames (k-1)*nsum+1 to k*nsum, is outNNNNNN.cbf\n");
+    printf("                                        with NNNNNN = k\n");
+    printf("    --stream dest                    -- stream frames to dest: - for STDOUT or\n");
+    printf("                                        unix:path for a Unix domain socket. Each\n");
+    printf("                                        frame is a 16 byte record header (\"E2CF\",\n");
+    printf("                                        uint32 frame number, uint64 CBF length, all\n");
+    printf("                                        little endian) followed by the CBF. A record\n");
+    printf("                                        with frame number and length 0 ends the stream\n");
+    printf("    --template                       -- write CBFs from a header rendered once per run\n");
+    printf("                                        instead of building each one with CBFlib\n");
+    printf("    --direct                         -- write CBF files with O_DIRECT, bypassing the\n");
+    printf("                                        page cache\n");
+    printf("    --sync-batch nfiles              -- start writeback of each CBF file at once and\n");
+    printf("                                        fsync them in batches of nfiles; files are\n");
+    printf("                                        renamed and journaled once fsync()ed\n");
+    printf("    --digest none|md5                -- Content-MD5 of each image (default md5)\n");
+    printf("    --pack nframes                   -- with N:M, write nframes CBFs per tar file\n");
+    printf("                                        outNNNNNN.tar (NNNNNN is its first frame)\n");
+    printf("                                        instead of one file per frame. Each tar has\n");
+    printf("                                        an index outNNNNNN.tar.idx with one 45 byte\n");
+    printf("                                        line \"frame offset length\" per member, so\n");
+    printf("                                        the CBF of the k-th frame starts at the\n");
+    printf("                                        offset given on line k\n");
+    printf("    --resume                         -- with N:M, skip frames that out.journal records\n");
+    printf("                                        as complete and whose CBF is still in place\n");
+    printf("    --follow timeout                 -- convert frames while the collection is still\n");
+    printf("                                        being written, waiting for each one to appear;\n");
+    printf("                                        give up after timeout seconds without it\n");
+    printf("    --meta-cache dir                 -- keep the metadata read from the master file in\n");
+    printf("                                        dir and reuse it while the file is unchanged\n");
+    printf("                                        (default: $EIGER2CBF_META_CACHE)\n");
     return;  
 }
 
 
+/* Write one --stream record: "E2CF", frame number (uint32) and length
+   (uint64), little endian, followed by the CBF itself. */
+int write_stream_record(FILE *fh, int frame, const char *data, size_t len) {
+  unsigned char head[16] = {'E', '2', 'C', 'F'};
+  int i;
+  for (i = 0; i < 4; i++) head[4 + i] = ((unsigned int)frame >> (8 * i)) & 0xff;
+  for (i = 0; i < 8; i++) head[8 + i] = ((unsigned long long)len >> (8 * i)) & 0xff;
+  if (fwrite(head, 1, sizeof(head), fh) != sizeof(head)) return -1;
+  if (len > 0 && fwrite(data, 1, len, fh) != len) return -1;
+  return 0;
+}
+
+
+/* CBFs are rendered into memory before they are written. Where there is
+   no open_memstream (MinGW) the CBF goes to the scratch file instead and
+   render_finish reads it back; both close the stream themselves, as
+   CBFlib does. */
+FILE *render_open(char **buf, size_t *len, const char *scratch) {
+  *buf = NULL;
+  *len = 0;
+#ifndef _WIN32
+  (void)scratch;
+  return open_memstream(buf, len);
+#else
+  return fopen(scratch, "wb");
+#endif
+}
+
+/* Make buf and len valid once the stream is closed. */
+int render_finish(char **buf, size_t *len, const char *scratch) {
+#ifndef _WIN32
+  (void)scratch;
+  return *buf == NULL ? -1 : 0;
+#else
+  FILE *fh = fopen(scratch, "rb");
+  long size;
+  int ret = -1;
+  if (fh == NULL) return -1;
+  if (fseek(fh, 0, SEEK_END) == 0 && (size = ftell(fh)) >= 0 && fseek(fh, 0, SEEK_SET) == 0) {
+    *buf = (char*)malloc(size > 0 ? size : 1);
+    if (*buf != NULL && fread(*buf, 1, size, fh) == (size_t)size) {
+      *len = size;
+      ret = 0;
+    }
+  }
+  fclose(fh);
+  remove(scratch);
+  return ret;
+#endif
+}
+
+
+/* Output backend for --direct and --sync-batch. CBFs are rendered into
+   memory and written with a single write(2). With --direct the file is
+   opened with O_DIRECT (falling back to buffered IO where the filesystem
+   refuses it) and written from a page aligned buffer padded to 4 KB, then
+   truncated to the real length. With --sync-batch, writeback of each file
+   is started immediately with sync_file_range() so dirty pages never pile
+   up, and every nfiles files are fsync()ed together.
+
+   Every CBF file goes through here. It is written under its temporary
+   name and only renamed into place and recorded in the journal once the
+   write and close have succeeded, so a full disk or an IO error never
+   leaves a truncated CBF that --resume takes for a complete one. With
+   --sync-batch the rename and the journal entry wait for the fsync of
+   the batch; without it a crash can still lose files that were renamed
+   but not yet written back. */
+#define MAX_SYNC_BATCH 256
+#define DIRECT_ALIGN 4096
+
+int journal_add(FILE *jf, int frame, const char *filename);
+
+typedef struct {
+  char *tmpname, *filename;
+  int fd, frame;
+} out_pending;
+
+typedef struct {
+  int direct;                 /* use O_DIRECT */
+  int batch;                  /* fsync every batch files, 0 for never */
+  int npending;               /* files written but not yet fsync()ed */
+  out_pending pending[MAX_SYNC_BATCH];
+  FILE *journal;              /* out.journal, or NULL */
+} out_backend;
+
+/* Move a complete CBF into place and record it in the journal. */
+int out_commit(out_backend *ob, const char *tmpname, const char *filename, int frame) {
+#ifdef _WIN32
+  // rename() does not replace an existing file there
+  remove(filename);
+#endif
+  if (rename(tmpname, filename) != 0) {
+    fprintf(stderr, "eiger2cbf error: failed to rename %s to %s\n", tmpname, filename);
+    return -1;
+  }
+  if (ob->journal && journal_add(ob->journal, frame, filename) < 0) {
+    fprintf(stderr, "eiger2cbf warning: failed to record frame %d in the journal\n", frame);
+  }
+  return 0;
+}
+
+int out_backend_flush(out_backend *ob) {
+  int i, ret = 0;
+#ifndef _WIN32
+  for (i = 0; i < ob->npending; i++) {
+    out_pending *p = &ob->pending[i];
+    int ok = fsync(p->fd) == 0;
+    if (close(p->fd) != 0) ok = 0;
+    if (!ok || out_commit(ob, p->tmpname, p->filename, p->frame) < 0) ret = -1;
+    free(p->tmpname);
+    free(p->filename);
+  }
+#endif
+  ob->npending = 0;
+  return ret;
+}
+
+/* Write data to tmpname, then rename it to filename as frame, at once or
+   after the fsync of its batch. */
+int out_backend_write(out_backend *ob, const char *tmpname, const char *filename, int frame,
+                      const char *data, size_t len) {
+#ifndef _WIN32
+  int fd = -1, flags = O_WRONLY | O_CREAT | O_TRUNC;
+  const char *wbuf = data;
+  char *abuf = NULL;
+  size_t wlen = len, done = 0;
+  ssize_t n;
+
+#ifdef O_DIRECT
+  if (ob->direct) {
+    fd = open(tmpname, flags | O_DIRECT, 0666);
+    if (fd >= 0) {
+      wlen = (len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+      if (posix_memalign((void**)&abuf, DIRECT_ALIGN, wlen) != 0) {
+        close(fd);
+        return -1;
+      }
+      memcpy(abuf, data, len);
+      memset(abuf + len, 0, wlen - len);
+      wbuf = abuf;
+    }
+  }
+#endif
+  if (fd < 0) fd = open(tmpname, flags, 0666);
+  if (fd < 0) {
+    free(abuf);
+    return -1;
+  }
+  while (done < wlen) {
+    n = write(fd, wbuf + done, wlen - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      free(abuf);
+      close(fd);
+      return -1;
+    }
+    done += n;
+  }
+  free(abuf);
+  if (wlen != len && ftruncate(fd, len) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (ob->batch == 0) {
+    if (close(fd) != 0) return -1;
+    return out_commit(ob, tmpname, filename, frame);
+  }
+#ifdef __linux__
+  sync_file_range(fd, 0, len, SYNC_FILE_RANGE_WRITE);
+#endif
+  out_pending *p = &ob->pending[ob->npending++];
+  p->fd = fd;
+  p->frame = frame;
+  p->tmpname = strdup(tmpname);
+  p->filename = strdup(filename);
+  if (p->tmpname == NULL || p->filename == NULL) return -1;
+  if (ob->npending >= ob->batch) return out_backend_flush(ob);
+  return 0;
+#else
+  FILE *fh = fopen(tmpname, "wb");
+  if (fh == NULL) return -1;
+  if (fwrite(data, 1, len, fh) != len || fflush(fh) != 0 || ferror(fh)) {
+    fclose(fh);
+    return -1;
+  }
+  if (fclose(fh) != 0) return -1;
+  return out_commit(ob, tmpname, filename, frame);
+#endif
+}
+
+
+/* Progress journal for N:M runs writing outNNNNNN.cbf. Once a CBF has
+   been renamed into place, a "frame size" line is appended to out.journal
+   with a single unbuffered write in append mode, so runs sharing a prefix
+   (eiger2cbf_par, --nproc workers) can share the journal. --resume loads
+   it and skips frames whose CBF is still there with the recorded size;
+   the last line for a frame wins. */
+FILE *journal_open(const char *prefix) {
+  char name[4096];
+  FILE *jf;
+  snprintf(name, 4096, "%s.journal", prefix);
+  jf = fopen(name, "a");
+  if (jf) setvbuf(jf, NULL, _IONBF, 0);
+  return jf;
+}
+
+/* Recorded sizes of frames from..to, -1 where there is none. */
+long long *journal_load(const char *prefix, int from, int to) {
+  char name[4096];
+  long long *sizes, size;
+  int frame, i;
+  FILE *jf;
+  sizes = (long long*)malloc(sizeof(long long) * (to - from + 1));
+  if (sizes == NULL) return NULL;
+  for (i = 0; i <= to - from; i++) sizes[i] = -1;
+  snprintf(name, 4096, "%s.journal", prefix);
+  jf = fopen(name, "r");
+  if (jf == NULL) return sizes;
+  while (fscanf(jf, "%d %lld", &frame, &size) == 2) {
+    if (frame >= from && frame <= to) sizes[frame - from] = size;
+  }
+  fclose(jf);
+  return sizes;
+}
+
+int journal_add(FILE *jf, int frame, const char *filename) {
+  char line[64];
+  struct stat st;
+  int len;
+  if (stat(filename, &st) != 0) return -1;
+  len = snprintf(line, 64, "%d %lld\n", frame, (long long)st.st_size);
+  if (fwrite(line, 1, len, jf) != (size_t)len) return -1;
+  return 0;
+}
+
+/* Non-zero if the journal shows frame complete and its file agrees. */
+int journal_done(const long long *sizes, int from, int frame, const char *filename) {
+  struct stat st;
+  if (sizes[frame - from] < 0) return 0;
+  if (stat(filename, &st) != 0) return 0;
+  return (long long)st.st_size == sizes[frame - from];
+}
+
+
+/* Container output for --pack. Frames go into a ustar archive, so the
+   usual tools can list and extract them, and an index sidecar records
+   where each CBF starts. Index lines have a fixed width: the k-th frame of
+   a container is described at byte k * PACK_INDEX_RECORD of the index, and
+   its CBF is at that offset in the tar, so a reader can seek to any frame
+   without scanning the archive. */
+#define TAR_BLOCK 512
+#define PACK_INDEX_RECORD 45  /* "%010d %016llu %016llu\n" */
+
+typedef struct {
+  int nframes;                /* frames per container, 0 when not packing */
+  int count;                  /* frames in the open container */
+  FILE *tar, *idx;
+  unsigned long long offset;  /* bytes written to the open container */
+} pack_writer;
+
+int pack_open(pack_writer *pk, const char *prefix, int frame) {
+  char filename[4096];
+  snprintf(filename, 4096, "%s%06d.tar", prefix, frame);
+  pk->tar = fopen(filename, "wb");
+  snprintf(filename, 4096, "%s%06d.tar.idx", prefix, frame);
+  pk->idx = fopen(filename, "wb");
+  pk->count = 0;
+  pk->offset = 0;
+  if (pk->tar == NULL || pk->idx == NULL) return -1;
+  return 0;
+}
+
+int pack_close(pack_writer *pk) {
+  static const char zeros[2 * TAR_BLOCK];
+  int ret = 0;
+  if (pk->tar == NULL && pk->idx == NULL) return 0;
+  if (pk->tar && fwrite(zeros, 1, sizeof(zeros), pk->tar) != sizeof(zeros)) ret = -1;
+  if (pk->tar && fclose(pk->tar) != 0) ret = -1;
+  if (pk->idx && fclose(pk->idx) != 0) ret = -1;
+  pk->tar = pk->idx = NULL;
+  return ret;
+}
+
+/* Append one CBF as the tar member name; opens the container on the first
+   frame and closes it once it holds nframes frames. */
+int pack_write(pack_writer *pk, const char *prefix, const char *name, int frame,
+               const char *data, size_t len) {
+  static const char zeros[TAR_BLOCK];
+  unsigned char head[TAR_BLOCK];
+  unsigned int sum = 0;
+  size_t pad = (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK;
+  int i;
+
+  if (strlen(name) > 99) return -1;
+  if (pk->tar == NULL && pack_open(pk, prefix, frame) < 0) return -1;
+
+  memset(head, 0, sizeof(head));
+  memcpy(head, name, strlen(name));                          /* name */
+  snprintf((char*)head + 100, 8, "%07o", 0644);              /* mode */
+  snprintf((char*)head + 108, 8, "%07o", 0);                 /* uid */
+  snprintf((char*)head + 116, 8, "%07o", 0);                 /* gid */
+  snprintf((char*)head + 124, 12, "%011llo", (unsigned long long)len);
+  snprintf((char*)head + 136, 12, "%011llo", (unsigned long long)time(NULL));
+  memset(head + 148, ' ', 8);                                /* chksum */
+  head[156] = '0';                                           /* regular file */
+  memcpy(head + 257, "ustar", 6);
+  memcpy(head + 263, "00", 2);
+  for (i = 0; i < TAR_BLOCK; i++) sum += head[i];
+  snprintf((char*)head + 148, 8, "%06o", sum);
+  head[155] = ' ';
+
+  pk->offset += TAR_BLOCK;
+  if (fwrite(head, 1, TAR_BLOCK, pk->tar) != TAR_BLOCK ||
+      fwrite(data, 1, len, pk->tar) != len ||
+      fwrite(zeros, 1, pad, pk->tar) != pad ||
+      fprintf(pk->idx, "%010d %016llu %016llu\n", frame, pk->offset,
+              (unsigned long long)len) != PACK_INDEX_RECORD) {
+    return -1;
+  }
+  pk->offset += len + pad;
+  if (++pk->count >= pk->nframes) return pack_close(pk);
+  return 0;
+}
+
+
+/* --follow: convert a collection that is still being written. Data blocks
+   are reopened (and refreshed when written in SWMR mode) until they hold
+   the frame wanted. An inotify watch on the directory of the master file
+   wakes the wait as soon as a file there is written; the poll interval
+   bounds the lag where inotify does not see the writer (e.g. NFS). */
+#define FOLLOW_POLL_MS 200
+
+typedef struct {
+  int timeout;  /* seconds to wait for a frame, 0 when not following */
+  int fd;       /* inotify descriptor, -1 if not available */
+  hid_t lapl;   /* opens external data files for SWMR reading */
+} follow_state;
+
+void follow_init(follow_state *fw, const char *master) {
+  fw->fd = -1;
+  fw->lapl = H5Pcreate(H5P_LINK_ACCESS);
+#ifdef H5F_ACC_SWMR_READ
+  H5Pset_elink_acc_flags(fw->lapl, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ);
+#endif
+#ifdef __linux__
+  char dir[4096];
+  char *slash;
+  snprintf(dir, 4096, "%s", master);
+  slash = strrchr(dir, '/');
+  if (slash == NULL) {
+    snprintf(dir, 4096, ".");
+  } else if (slash == dir) {
+    dir[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+  fw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fw->fd >= 0 &&
+      inotify_add_watch(fw->fd, dir, IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(fw->fd);
+    fw->fd = -1;
+  }
+#endif
+}
+
+/* Sleep until a file next to the master changes or FOLLOW_POLL_MS passes. */
+void follow_wait(follow_state *fw) {
+#ifndef _WIN32
+  if (fw->fd >= 0) {
+    char events[4096];
+    struct pollfd pfd = {fw->fd, POLLIN, 0};
+    if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0) {
+      while (read(fw->fd, events, sizeof(events)) > 0);
+    }
+    return;
+  }
+  usleep(FOLLOW_POLL_MS * 1000);
+#endif
+}
+
+/* Open data block name once it holds at least need frames and store its
+   dimensions in dims. Returns -1 if that does not happen within
+   fw->timeout seconds. */
+hid_t follow_open_block(follow_state *fw, hid_t group, const char *name, hsize_t need,
+                        hsize_t *dims, hsize_t *maxdims) {
+  struct timespec start, now;
+  hid_t data, dataspace;
+  int waited = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (;;) {
+    data = H5Dopen2(group, name, fw->lapl);
+    if (data < 0) data = H5Dopen2(group, name, H5P_DEFAULT);
+    if (data >= 0) {
+#if H5_VERSION_GE(1,10,0)
+      H5Drefresh(data); // fails harmlessly when the writer is not in SWMR mode
+#endif
+      dataspace = H5Dget_space(data);
+      if (H5Sget_simple_extent_ndims(dataspace) == 3) {
+        H5Sget_simple_extent_dims(dataspace, dims, maxdims);
+        if (dims[0] >= need) {
+          H5Sclose(dataspace);
+          if (waited) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            fprintf(stderr, " waited %.1f s for %s\n",
+                    (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9, name);
+          }
+          return data;
+        }
+      }
+      H5Sclose(dataspace);
+      H5Dclose(data);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - start.tv_sec >= fw->timeout) return -1;
+    if (!waited) fprintf(stderr, " waiting for frame %llu of %s\n", (unsigned long long)need, name);
+    waited = 1;
+    follow_wait(fw);
+  }
+}
+
+/* frame_source opener for --follow: wait until the frame is written */
+hid_t follow_open_frame(void *arg, hid_t group, const char *name, hsize_t index) {
+  hsize_t dims[3];
+  return follow_open_block((follow_state*)arg, group, name, index + 1, dims, NULL);
+}
+
+/* Start angles come from /entry/sample/goniometer/omega. Only the part of
+   the array around the frames being converted is read, OMEGA_WINDOW values
+   at a time, so memory does not grow with the length of the run and runs
+   longer than any fixed buffer are handled. (With --meta-cache the whole
+   array is held by the cache instead and windows are copied from it.) */
+#define OMEGA_WINDOW 1024
+#define OMEGA_PATH "/entry/sample/goniometer/omega"
+
+typedef struct {
+  double values[OMEGA_WINDOW];
+  hsize_t start;   /* omega index of values[0] */
+  int count;       /* values held, -1 if omega is not present */
+  hsize_t extent;  /* length of omega */
+  double last;     /* the last value of omega */
+} omega_window;
+
+int omega_window_init(omega_window *ow, metacache *mc, hid_t hdf) {
+  ow->start = 0;
+  ow->extent = 0;
+  ow->count = metacache_read_doubles(mc, hdf, OMEGA_PATH, 0, OMEGA_WINDOW, ow->values, &ow->extent);
+  if (ow->count <= 0) return ow->count;
+  if (ow->extent <= (hsize_t)ow->count) {
+    ow->last = ow->values[ow->count - 1];
+  } else if (metacache_read_doubles(mc, hdf, OMEGA_PATH, ow->extent - 1, 1, &ow->last, &ow->extent) != 1) {
+    ow->count = -1;
+  }
+  return ow->count;
+}
+
+/* Start angle of frame (1-indexed) into *angle. Returns 0 if it is taken
+   from omega, 1 if the frame is past the end of omega and the angle is
+   extrapolated from the last value with osc_width, and -1 if omega is not
+   present. */
+int omega_window_get(omega_window *ow, metacache *mc, hid_t hdf, int frame, double osc_width, double *angle) {
+  hsize_t index = frame - 1;
+  int n;
+
+  if (ow->count < 0) return -1;
+  if (index >= ow->extent) {
+    *angle = ow->last + osc_width * (index - ow->extent + 1);
+    return 1;
+  }
+  if (index < ow->start || index >= ow->start + ow->count) {
+    n = metacache_read_doubles(mc, hdf, OMEGA_PATH, index, OMEGA_WINDOW, ow->values, &ow->extent);
+    if (n <= 0) return -1;
+    ow->start = index;
+    ow->count = n;
+  }
+  *angle = ow->values[index - ow->start];
+  return 0;
+}
+
+/* Number of frames actually stored in the data blocks of a master file,
+   rather than the nimages the firmware writes. Blocks data_NNNNNN are
+   numbered consecutively and all but the last hold as many frames as the
+   first, which the frame to block mapping in main() relies on as well, so
+   only the first and the last block are opened; the links themselves come
+   from the metadata index and the extents from the cache when it is
+   enabled. Returns the count (*nblocks and *per_block describe the
+   blocks), or -1 if the file or its first block cannot be read. */
+int count_frames(const char *filename, const char *cache_dir, int *nblocks, int *per_block) {
+  hid_t hdf, group;
+  metacache mc;
+  frame_source fs;
+  const frame_layout *layouts[] = {&frame_layout_eiger, NULL};
+  hsize_t dims[3];
+  char data_name[20];
+  int first, last, count = -1;
+
+  hdf = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (hdf < 0) return -1;
+  metacache_open(&mc, cache_dir, filename);
+  group = H5Gopen2(hdf, "/entry/data", H5P_DEFAULT);
+  if (group >= 0) {
+    frame_source_init(&fs, &mc, group, layouts, 0, 0);
+    first = fs.block_start;
+    for (last = first; ; last++) {
+      snprintf(data_name, sizeof(data_name), "data_%06d", last + 1);
+      if (!metacache_find_dataset(&mc, group, data_name)) break;
+    }
+    snprintf(data_name, sizeof(data_name), "data_%06d", first);
+    if (metacache_get_dims(&mc, group, data_name, dims) == 3) {
+      *nblocks = last - first + 1;
+      *per_block = dims[0];
+      count = dims[0];
+      if (last > first) {
+        snprintf(data_name, sizeof(data_name), "data_%06d", last);
+        // a last block that cannot be opened holds no frames we can convert
+        count = (last - first) * *per_block;
+        if (metacache_get_dims(&mc, group, data_name, dims) == 3) count += dims[0];
+      }
+    }
+    H5Gclose(group);
+  }
+  metacache_save(&mc);
+  metacache_free(&mc);
+  H5Fclose(hdf);
+  return count;
+}
 
 
 int main(int argc, char **argv) {
@@ -89,6 +681,22 @@ int main(int argc, char **argv) {
   int verbose = 0;       /* verbose mode */
   int new_beam_cent = 0; /* new beam center provided */
   int new_nimages = 0;   /* new number of images provided */
+  int nproc = 1;         /* number of worker processes for N:M */
+  int sum = 1;           /* --sum: frames per output image */
+  int *next_frame = NULL; /* frame counter shared by the workers */
+  char* stream_dest = NULL; /* --stream destination */
+  FILE* stream_fh = NULL;
+  out_backend ob = {0, 0, 0}; /* --direct and --sync-batch */
+  int use_template = 0;  /* --template */
+  int digest = 1;        /* --digest */
+  pack_writer pk = {0, 0, NULL, NULL, 0}; /* --pack */
+  follow_state fw = {0, -1, H5P_DEFAULT}; /* --follow */
+  int resume = 0;        /* --resume */
+  int count_only = 0;    /* --count */
+  FILE* journal = NULL;  /* out.journal */
+  long long* journal_sizes = NULL; /* frames recorded in out.journal, for --resume */
+  char* meta_cache_dir = getenv("EIGER2CBF_META_CACHE"); /* --meta-cache */
+  metacache mc;
   int ii;
   char* endptr;
   char* fndptr;
@@ -160,6 +768,147 @@ int main(int argc, char **argv) {
         usage_printed  ++;
         new_beam_cent = 0;
       }
+    } else if (!strcmp(argv[ii],"--stream")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        stream_dest = argv[ii];
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --stream provided without a destination; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--template")) {
+      use_template = 1;
+      optcount ++;
+    } else if (!strcmp(argv[ii],"--digest")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        if (!strcmp(argv[ii],"none")) {
+          digest = 0;
+        } else if (!strcmp(argv[ii],"md5")) {
+          digest = 1;
+        } else {
+          fprintf(stderr, "eiger2cbf error: --digest invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --digest provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--pack")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        pk.nframes=strtol(argv[ii],&endptr,10);
+        if (!endptr || endptr==argv[ii] || *endptr!='\0' || pk.nframes < 1) {
+          pk.nframes = 0;
+          fprintf(stderr, "eiger2cbf error: --pack invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --pack provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--resume")) {
+      resume = 1;
+      optcount ++;
+    } else if (!strcmp(argv[ii],"--count")) {
+      count_only = 1;
+      optcount ++;
+    } else if (!strcmp(argv[ii],"--follow")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        fw.timeout=strtol(argv[ii],&endptr,10);
+        if (!endptr || endptr==argv[ii] || *endptr!='\0' || fw.timeout < 1) {
+          fw.timeout = 0;
+          fprintf(stderr, "eiger2cbf error: --follow invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --follow provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--meta-cache")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        meta_cache_dir = argv[ii];
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --meta-cache provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--direct")) {
+      ob.direct = 1;
+      optcount ++;
+    } else if (!strcmp(argv[ii],"--sync-batch")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        ob.batch=strtol(argv[ii],&endptr,10);
+        if (!endptr || endptr==argv[ii] || *endptr!='\0' || ob.batch < 1) {
+          ob.batch = 0;
+          fprintf(stderr, "eiger2cbf error: --sync-batch invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        } else if (ob.batch > MAX_SYNC_BATCH) {
+          fprintf(stderr, "eiger2cbf warning: --sync-batch limited to %d files\n", MAX_SYNC_BATCH);
+          ob.batch = MAX_SYNC_BATCH;
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --sync-batch provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--nproc")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        nproc=strtol(argv[ii],&endptr,10);
+        if (!endptr || endptr==argv[ii] || *endptr!='\0' || nproc < 1) {
+          nproc = 1;
+          fprintf(stderr, "eiger2cbf error: --nproc invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --nproc provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--sum")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        sum=strtol(argv[ii],&endptr,10);
+        if (!endptr || endptr==argv[ii] || *endptr!='\0' || sum < 1) {
+          sum = 1;
+          fprintf(stderr, "eiger2cbf error: --sum invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --sum provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
     } else if (!strcmp(argv[ii],"--nimages")) {
       new_nimages = 1;
       optcount ++;
@@ -173,6 +922,22 @@ int main(int argc, char **argv) {
     } else break;
   }
 
+  if (count_only && argc-optcount > 1) {
+    int nblocks = 0, per_block = 0, failed = 0;
+    H5Eset_auto(0, NULL, NULL);
+    for (ii = 1 + optcount; ii < argc; ii++) {
+      ret = count_frames(argv[ii], meta_cache_dir, &nblocks, &per_block);
+      if (ret < 0) {
+        fprintf(stderr, "eiger2cbf error: failed to count the frames in %s\n", argv[ii]);
+        failed++;
+      } else if (verbose) {
+        fprintf(stderr, " %s: %d blocks of %d frames\n", argv[ii], nblocks, per_block);
+      }
+      printf("%d %s\n", ret, argv[ii]);
+    }
+    return failed ? -1 : 0;
+  }
+
   if (argc-optcount <= 1 || argc-optcount  >= 5) {
     if (usage_printed == 0) usage (argc, argv); 
     return -1;
@@ -180,14 +945,22 @@ int main(int argc, char **argv) {
 
   register_filters();
 
-  hdf = H5Fopen(argv[1+optcount], H5F_ACC_RDONLY, H5P_DEFAULT);
+  hdf = -1;
+#ifdef H5F_ACC_SWMR_READ
+  if (fw.timeout) hdf = H5Fopen(argv[1+optcount], H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
+#endif
+  if (hdf < 0) hdf = H5Fopen(argv[1+optcount], H5F_ACC_RDONLY, H5P_DEFAULT);
   if (hdf < 0) {
     fprintf(stderr, "eiger2cbf error: failed to open file %s\n", argv[1+optcount]);
     return -1;
   }
+  if (fw.timeout) follow_init(&fw, argv[1+optcount]);
+  // a collection still being written is not cached, nor indexed
+  metacache_open(&mc, fw.timeout ? NULL : meta_cache_dir, argv[1+optcount]);
+  mc.resolve = !fw.timeout;
 
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
   if (nimages == 1 && ntrigger > 1) {
     fprintf(stderr, "eiger2cbf warning: nimages == 1 and ntrigger == %d \n", ntrigger);
     fprintf(stderr, "eiger2cbf warning: setting nimages to ntrigger \n");
@@ -203,6 +976,8 @@ int main(int argc, char **argv) {
     } else {
       printf("No. images: %d\n", nimages);
     }
+    metacache_save(&mc);
+    metacache_free(&mc);
     H5Fclose(hdf);
     return 0;
   }
@@ -215,13 +990,45 @@ int main(int argc, char **argv) {
   } else if (retfromto == 1) {
     to = from;
   }
-  if ((to != from || retfromto < 1 || retfromto > 2) && argc-optcount < 4) {
+  if (sum > 1) {
+    // From here on from..to are the summed images, which is what the
+    // output names, the journal and --nproc work with
+    if (from < 1 || to < from || (from - 1) % sum != 0 || to % sum != 0) {
+      fprintf(stderr, "eiger2cbf error: --sum %d needs N:M covering whole groups of %d frames, such as 1:%d\n",
+              sum, sum, 10 * sum);
+      return -1;
+    }
+    fprintf(stderr, "Going to sum frames %d to %d in groups of %d", from, to, sum);
+    from = (from - 1) / sum + 1;
+    to /= sum;
+    fprintf(stderr, " into images %d to %d.\n", from, to);
+  }
+  if (stream_dest && argc-optcount > 3) {
+    fprintf(stderr, "eiger2cbf error: --stream does not take an output file name\n");
+    return -1;
+  }
+  if (pk.nframes && (stream_dest || argc-optcount < 4 || (from == to && retfromto != 2))) {
+    fprintf(stderr, "eiger2cbf warning: --pack needs N:M and an output prefix; ignored\n");
+    pk.nframes = 0;
+  }
+  if (argc-optcount > 3 && !pk.nframes && !(from == to && retfromto != 2)) {
+    if (resume) journal_sizes = journal_load(argv[3+optcount], from, to);
+    journal = journal_open(argv[3+optcount]);
+    ob.journal = journal;
+    if (journal == NULL) {
+      fprintf(stderr, "eiger2cbf warning: cannot write %s.journal; --resume will not see this run\n",
+              argv[3+optcount]);
+    }
+  } else if (resume) {
+    fprintf(stderr, "eiger2cbf warning: --resume needs N:M and an output prefix; ignored\n");
+  }
+  if ((to != from || retfromto < 1 || retfromto > 2) && argc-optcount < 4 && !stream_dest) {
     fprintf(stderr, "frames argument '%s', from: %d, to: %d\n", argv[2+optcount], from, to);
     fprintf(stderr, "retfromto: %d, argc: %d, optcount %d\n", retfromto, argc, optcount);
     fprintf(stderr, "You cannot output multiple images into STDOUT.");
     return -1;
   }
-  fprintf(stderr, "Going to convert frame %d to %d.\n", from, to);  
+  if (sum == 1) fprintf(stderr, "Going to convert frame %d to %d.\n", from, to);  
   
   H5Eset_auto(0, NULL, NULL); // Comment out this line for debugging.
 
@@ -231,7 +1038,7 @@ int main(int argc, char **argv) {
       description[255]=0;
       fprintf(stderr,"  /entry/instrument/detector/description overidden by %s\n", description);
   } else {
-      H5LTread_dataset_string(hdf, "/entry/instrument/detector/description", description);
+      metacache_read_string(&mc, hdf, "/entry/instrument/detector/description", description, sizeof(description));
       fprintf(stderr, " /entry/instrument/detector/description = %s\n", description);
   }
   if (detector_xsn) {
@@ -239,16 +1046,16 @@ int main(int argc, char **argv) {
       detector_sn[255]=0;
       fprintf(stderr, " /entry/instrument/detector/detector_number overridden by %s\n", detector_sn);
   } else {
-      H5LTread_dataset_string(hdf, "/entry/instrument/detector/detector_number", detector_sn);
+      metacache_read_string(&mc, hdf, "/entry/instrument/detector/detector_number", detector_sn, sizeof(detector_sn));
       fprintf(stderr, " /entry/instrument/detector/detector_number = %s\n", detector_sn);
   }
-  if (H5LTread_dataset_string(hdf, "/entry/instrument/detector/detectorSpecific/software_version", version) < 0){
+  if (metacache_read_string(&mc, hdf, "/entry/instrument/detector/detectorSpecific/software_version", version, sizeof(version)) < 0){
     fprintf(stderr, " /entry/instrument/detector/detectorSpecific/software_version not found, set to '.'\n");
     version[0]='.';
     version[1]='\0';
   };
   fprintf(stderr, " /entry/instrument/detector/detectorSpecific/software_version = %s\n", version);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/bit_depth_image", &depth);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/bit_depth_image", &depth);
   if (depth > 0) {
     fprintf(stderr, " /entry/instrument/detector/bit_depth_image = %d\n", depth);
   } else {
@@ -259,20 +1066,20 @@ int main(int argc, char **argv) {
 
   // Saturation value
   // Firmware >= 1.5
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/saturation_value", &countrate_cutoff);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/saturation_value", &countrate_cutoff);
   if (countrate_cutoff > 0) {
     fprintf(stderr, " /entry/instrument/detector/detectorSpecific/saturation_value = %d\n", countrate_cutoff);
   } else {
     // Firmware >= 1.4
     fprintf(stderr, "  /entry/instrument/detector/detectorSpecific/saturation_value not present. Trying another place.\n");
-    H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff", &countrate_cutoff);
+    metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff", &countrate_cutoff);
     if (countrate_cutoff > 0) {
       fprintf(stderr, " /entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff = %d\n", countrate_cutoff);
       countrate_cutoff++;
     } else {
       fprintf(stderr, "  /entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff not present. Trying another place.\n");
       // < 1.4
-      H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff", &countrate_cutoff);
+      metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff", &countrate_cutoff);
       if (countrate_cutoff > 0) {
         fprintf(stderr, " /entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff = %d\n", countrate_cutoff);
 	fprintf(stderr, "  WARNING: The use of this field is not recommended now.\n");
@@ -287,7 +1094,7 @@ int main(int argc, char **argv) {
     }
   }
 
-  ret = H5LTread_dataset_double(hdf, "/entry/instrument/detector/sensor_thickness", &thickness); // in m
+  ret = metacache_read_double(&mc, hdf, "/entry/instrument/detector/sensor_thickness", &thickness); // in m
   if (ret >= 0) { 
     if (thickness > 0) {
       fprintf(stderr, " /entry/instrument/detector/sensor_thickness = %f (um)\n", thickness * 1E6);
@@ -297,22 +1104,22 @@ int main(int argc, char **argv) {
     }
     thicknessint=(int)(thickness*1.e6+0.5);
   }
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
   fprintf(stderr, " /entry/instrument/detector/detectorSpecific/{x,y}_pixels_in_detector = (%d, %d) (px)\n",
 	  xpixels, ypixels);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/beam_center_x", &beamx);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/beam_center_y", &beamy);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/beam_center_x", &beamx);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/beam_center_y", &beamy);
   fprintf(stderr, " /entry/instrument/detector/beam_center_{x,y} = (%.2f, %.2f) (px)\n", new_beam_cent?nbeamx:beamx, new_beam_cent?nbeamy:beamy);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/count_time", &count_time); // in m
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/count_time", &count_time); // in m
   fprintf(stderr, " /entry/instrument/detector/count_time = %f (sec)\n", count_time);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/frame_time", &frame_time); // in 
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/frame_time", &frame_time); // in 
   fprintf(stderr, " /entry/instrument/detector/frame_time = %f (sec)\n", frame_time);
-  if (H5LTread_dataset_double(hdf, "/entry/instrument/detector/x_pixel_size", &pixelsizex) < 0 ) {
+  if (metacache_read_double(&mc, hdf, "/entry/instrument/detector/x_pixel_size", &pixelsizex) < 0 ) {
     fprintf(stderr, " /entry/instrument/detector/x_pixel_size not found.  We assume it is 75 um\n");
     pixelsizex = 0.000075;
   }; // in m
-  if (H5LTread_dataset_double(hdf, "/entry/instrument/detector/y_pixel_size", &pixelsizey) < 0 ) {
+  if (metacache_read_double(&mc, hdf, "/entry/instrument/detector/y_pixel_size", &pixelsizey) < 0 ) {
     fprintf(stderr, " /entry/instrument/detector/y_pixel_size not found.  We assume it is 75 um\n");
     pixelsizey = 0.000075;
   }; // in m
@@ -323,13 +1130,13 @@ int main(int argc, char **argv) {
 
   // Detector distance
 
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/distance", &distance); // Firmware >= 1.7
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/distance", &distance); // Firmware >= 1.7
   if (distance > 0) {
     fprintf(stderr, " /entry/instrument/detector/distance = %f (m)\n", distance);
   } else {
     fprintf(stderr, "  /entry/instrument/detector/distance not present. Trying another place.\n");
 
-    H5LTread_dataset_double(hdf, "/entry/instrument/detector/detector_distance", &distance); // Firmware< 1.7
+    metacache_read_double(&mc, hdf, "/entry/instrument/detector/detector_distance", &distance); // Firmware< 1.7
     if (distance > 0) {
       fprintf(stderr, " /entry/instrument/detector/detector_distance = %f (m)\n", distance);
     } else {
@@ -339,25 +1146,25 @@ int main(int argc, char **argv) {
   }
 
   // Wavelength
-  H5LTread_dataset_double(hdf, "/entry/sample/beam/incident_wavelength", &wavelength); // Firmware >= 1.7
+  metacache_read_double(&mc, hdf, "/entry/sample/beam/incident_wavelength", &wavelength); // Firmware >= 1.7
   if (wavelength > 0) {
     fprintf(stderr, " /entry/sample/beam/incident_wavelength = %f (A)\n", wavelength);
   } else {
     fprintf(stderr, "  /entry/sample/beam/incident_wavelength not present. Trying another place.\n");
 
-    H5LTread_dataset_double(hdf, "/entry/instrument/beam/wavelength", &wavelength);
+    metacache_read_double(&mc, hdf, "/entry/instrument/beam/wavelength", &wavelength);
     if (wavelength > 0) {
       fprintf(stderr, " /entry/instrument/beam/wavelength = %f (A)\n", wavelength);
     } else {
       fprintf(stderr, "  /entry/instrument/beam/wavelength not present. Trying another place.\n");
 
-      H5LTread_dataset_double(hdf, "/entry/instrument/monochromator/wavelength", &wavelength);
+      metacache_read_double(&mc, hdf, "/entry/instrument/monochromator/wavelength", &wavelength);
       if (wavelength > 0) {
 	fprintf(stderr, " /entry/instrument/monochromator/wavelength = %f (A)\n", wavelength);
       } else {
 	fprintf(stderr, "  /entry/instrument/monochromator/wavelength not present. Trying another place.\n");
 
-	H5LTread_dataset_double(hdf, "/entry/instrument/beam/incident_wavelength", &wavelength); // Firmware 1.6
+	metacache_read_double(&mc, hdf, "/entry/instrument/beam/incident_wavelength", &wavelength); // Firmware 1.6
 	if (wavelength > 0) {
 	  fprintf(stderr, " /entry/instrument/beam/incident_wavelength = %f (A)\n", wavelength);
 	} else {
@@ -370,7 +1177,7 @@ int main(int argc, char **argv) {
     fprintf(stderr, " WARNING: wavelength was not defined! \"Wavelength\" field in the output is set to -1.\n");
   }
 
-  H5LTread_dataset_double(hdf, "/entry/sample/goniometer/omega_range_average", &osc_width);
+  metacache_read_double(&mc, hdf, "/entry/sample/goniometer/omega_range_average", &osc_width);
   if (osc_width > 0) {
     fprintf(stderr, " /entry/sample/goniometer/omega_range_average = %f (deg)\n", osc_width);
   } else {
@@ -386,15 +1193,10 @@ int main(int argc, char **argv) {
   }
 
   // TODO: Is it always in omega?
-  int bufsize = (nimages < 100000) ? 100000 : nimages;
-  double *angles = (double*)malloc(bufsize * sizeof(double));
-  // I don't know why but nimages can be too small ...
-  if (angles == NULL) {
-    fprintf(stderr, "failed to allocate buffer for omega.\n");
-    return -1;
-  }
-  angles[0] = -9999;
-  H5LTread_dataset_double(hdf, "/entry/sample/goniometer/omega", angles);
+  // Only a window is read here; nimages can be too small, so the extent of
+  // omega itself is used.
+  omega_window omega;
+  omega_window_init(&omega, &mc, hdf);
   fprintf(stderr, "\n");
 
   hid_t entry, group;
@@ -405,7 +1207,7 @@ int main(int argc, char **argv) {
   }
 
   pixel_mask[0] = -9999;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask);
+  metacache_read_mask(&mc, hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask, xpixels * ypixels);
   if (pixel_mask[0] == -9999) {
     fprintf(stderr, "WARNING: failed to read the pixel mask from /entry/instrument/detector/detectorSpecific/pixel_mask.\n");
     fprintf(stderr, " Thus, we mask pixels whose intensity is %u (= (2 ^ bit_depth_image) - 1) by converting them to -1. \n", error_val);
@@ -418,145 +1220,331 @@ int main(int argc, char **argv) {
     group = entry; // leak!
   }
 
-  int block_start = 1;
-  if (H5LTfind_dataset(group, "data_000000")) {
-    fprintf(stderr, "This dataset starts from data_000000.\n");
-    block_start = 0;
-  } else {
-    fprintf(stderr, "This dataset starts from data_000001.\n");
-  }
+  frame_source fs;
+  const frame_layout *layouts[] = {&frame_layout_eiger, NULL};
+  frame_source_init(&fs, &mc, group, layouts, xpixels, ypixels);
+  fprintf(stderr, "This dataset starts from %s.\n", fs.name);
 
-  char data_name[20] = {};
-  hid_t data, dataspace;
-  int number_per_block = 0;
+  hid_t data;
   
   // Open the first data block to get the number of frames in a block
-  snprintf(data_name, 20, "data_%06d", block_start); 
-  data = H5Dopen2(group, data_name, H5P_DEFAULT);
-  dataspace = H5Dget_space(data);
-  if (data < 0) {
-    fprintf(stderr, "failed to open /entry/%s\n", data_name);
-    return -1;
-  }
-  if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-    fprintf(stderr, "Dimension of /entry/%s is not 3!\n", data_name);
-    return -1;    
+  hsize_t dims[3], maxdims[3];
+  if (fw.timeout) {
+    // a block still being written is only as long as the frames so far;
+    // unless its final size is fixed, wait for it to be complete
+    data = follow_open_block(&fw, group, fs.name, 1, dims, maxdims);
+    if (data >= 0 && maxdims[0] == H5S_UNLIMITED) {
+      char next_name[20];
+      hid_t next;
+      struct timespec start, now;
+      snprintf(next_name, 20, "data_%06d", fs.block_start + 1);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      while (dims[0] < (hsize_t)nimages) {
+        // the link is there from the start; the block exists once it opens
+        next = H5Dopen2(group, next_name, H5P_DEFAULT);
+        if (next >= 0) {
+          H5Dclose(next);
+          break;
+        }
+        H5Dclose(data);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - start.tv_sec >= fw.timeout) {
+          data = -1;
+          break;
+        }
+        follow_wait(&fw);
+        data = follow_open_block(&fw, group, fs.name, 1, dims, maxdims);
+        if (data < 0) break;
+      }
+    } else if (data >= 0) {
+      dims[0] = maxdims[0];
+    }
+    if (data < 0) {
+      fprintf(stderr, "eiger2cbf error: /entry/%s did not appear within %d s\n", fs.name, fw.timeout);
+      return -1;
+    }
+    fs.per_block = dims[0];
+    H5Dclose(data);
+    fs.open = follow_open_frame;
+    fs.open_arg = &fw;
+    fs.reopen = 1;
+  } else {
+    ret = frame_source_dims(&fs, &mc, dims);
+    if (ret < 0) {
+      fprintf(stderr, "failed to open /entry/%s\n", fs.name);
+      return -1;
+    }
+    if (ret != 3) {
+      fprintf(stderr, "Dimension of /entry/%s is not 3!\n", fs.name);
+      return -1;    
+    }
   }
-  hsize_t dims[3];
-  H5Sget_simple_extent_dims(dataspace, dims, NULL);
-  number_per_block = dims[0];
-  fprintf(stderr, "The number of images per data block is %d.\n", number_per_block);
+  fprintf(stderr, "The number of images per data block is %d.\n", fs.per_block);
 
-  H5Sclose(dataspace);
-  H5Dclose(data);
+  if (metacache_save(&mc) < 0) {
+    fprintf(stderr, "eiger2cbf warning: failed to write the metadata cache %s\n", mc.path);
+  }
 
   fprintf(stderr, "\nFile analysis completed.\n\n");
-  int frame;
-  for (frame = from; frame <= to; frame++) {
-    fprintf(stderr, "Converting frame %d (%d / %d)\n", frame, frame - from + 1, to - from + 1);
-    if (angles[0] != -9999) {
-      osc_start = angles[frame - 1];
-      fprintf(stderr, " /entry/sample/goniometer/omega[%d] = %.3f (1-indexed)\n", frame, osc_start);
-    } else {
-      fprintf(stderr, " oscillation start not defined. \"Start_angle\" field in the output is set to 0!\n");
-      osc_start = osc_width * frame; // old firmware
+
+#ifndef _WIN32
+  // Coordinator mode: the metadata above (including omega and the pixel mask)
+  // is inherited copy-on-write by forked workers, which take frames one at a
+  // time from a shared counter. HDF5 handles are not shared across fork, so
+  // the file is closed here and reopened by each worker.
+  if (nproc > 1 && to > from && argc-optcount > 3 && !stream_dest && !pk.nframes && !fw.timeout) {
+    int worker, status, failed = 0;
+    pid_t pid;
+    if (nproc > to - from + 1) nproc = to - from + 1;
+    next_frame = (int*)mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (next_frame == MAP_FAILED) {
+      fprintf(stderr, "eiger2cbf error: failed to map the frame counter\n");
+      return -1;
+    }
+    *next_frame = from;
+    if (group != entry) H5Gclose(group);
+    H5Gclose(entry);
+    H5Fclose(hdf);
+    fflush(NULL);
+    for (worker = 0; worker < nproc; worker++) {
+      pid = fork();
+      if (pid < 0) {
+        fprintf(stderr, "eiger2cbf error: fork failed for worker %d\n", worker);
+        failed++;
+        break;
+      }
+      if (pid == 0) break;
+    }
+    if (worker == nproc || pid != 0) {
+      // coordinator
+      while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+      }
+      munmap(next_frame, sizeof(int));
+      free(buf);
+      free(buf_signed);
+      free(pixel_mask);
+      if (failed) {
+        fprintf(stderr, "eiger2cbf error: %d worker(s) failed\n", failed);
+        return -1;
+      }
+      fprintf(stderr, "\nAll done!\n");
+      return 0;
+    }
+    // worker
+    hdf = H5Fopen(argv[1+optcount], H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (hdf < 0) {
+      fprintf(stderr, "eiger2cbf error: worker failed to open file %s\n", argv[1+optcount]);
+      return -1;
     }
+    entry = H5Gopen2(hdf, "/entry", H5P_DEFAULT);
+    group = H5Gopen2(entry, "data", H5P_DEFAULT);
+    if (group < 0) {
+      group = entry;
+    }
+    fs.group = group;
+  }
+#endif
 
-    if (frame > nimages) {
-      fprintf(stderr, "WARNING: invalid frame number specified. %d is bigger than nimages (%d)\n", frame, nimages);
-      // Due to a firmware bug, nimages can be smaller than the actual value.
-      // So we don't exit here
+  if (stream_dest) {
+#ifndef _WIN32
+    if (!strcmp(stream_dest, "-")) {
+      stream_fh = stdout;
+    } else if (!strncmp(stream_dest, "unix:", 5)) {
+      struct sockaddr_un addr;
+      int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, stream_dest + 5, sizeof(addr.sun_path) - 1);
+      if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "eiger2cbf error: failed to connect to %s\n", stream_dest);
+        return -1;
+      }
+      stream_fh = fdopen(sock, "wb");
+    }
+    // a consumer going away should be an error, not a silent exit
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    if (stream_fh == NULL) {
+      fprintf(stderr, "eiger2cbf error: invalid --stream destination %s\n", stream_dest);
+      return -1;
     }
+  }
+
+  // --sum: sums saturate at the overload level of nsum frames, which is
+  // what the header gives as the cutoff, and each image spans nsum frames
+  // in angle and in time
+  int count_cutoff = countrate_cutoff;
+  double angle_increment = osc_width;
+  double exposure_time = count_time, exposure_period = frame_time;
+  unsigned int *sum_buf = NULL;
+  if (sum > 1) {
+    unsigned long long cap = (unsigned long long)countrate_cutoff * sum;
+    count_cutoff = cap > INT_MAX ? INT_MAX : (int)cap;
+    angle_increment = osc_width * sum;
+    if (count_time > 0) exposure_time = count_time * sum;
+    if (frame_time > 0) exposure_period = frame_time * sum;
+    sum_buf = (unsigned int*)malloc(sizeof(unsigned int) * xpixels * ypixels);
+    if (sum_buf == NULL) {
+      fprintf(stderr, "Failed to allocate image buffer.\n");
+      return -1;
+    }
+  }
 
-    char header_format[] = 
-      "\n"
-      "# Detector: %s, S/N %s\n"
-      "# Pixel_size %de-6 m x %de-6 m\n"
-      "# Silicon sensor, thickness %de-6 m\n"
-      "# Exposure_time %f s\n"
-      "# Exposure_period %f s\n"
-      "# Count_cutoff %d counts\n"
-      "# Wavelength %f A\n"
-      "# Detector_distance %f m\n"
-      "# Beam_xy (%.2f, %.2f) pixels\n"
-      "# Start_angle %f deg.\n"
-      "# Angle_increment %f deg.\n";
+  char header_format[] = 
+    "\n"
+    "# Detector: %s, S/N %s\n"
+    "# Pixel_size %de-6 m x %de-6 m\n"
+    "# Silicon sensor, thickness %de-6 m\n"
+    "# Exposure_time %f s\n"
+    "# Exposure_period %f s\n"
+    "# Count_cutoff %d counts\n"
+    "# Wavelength %f A\n"
+    "# Detector_distance %f m\n"
+    "# Beam_xy (%.2f, %.2f) pixels\n"
+    "# Start_angle %s deg.\n"
+    "# Angle_increment %f deg.\n";
 
+  // --template: render the header once, leaving out the Start_angle value
+  cbf_template tmpl;
+  if (use_template) {
     char header_content[4096] = {};
+    char *mark;
     snprintf(header_content, 4096, header_format,
 	     description, detector_sn,
 	     pixelsizexint, pixelsizeyint,
 	     thicknessint,
-	     count_time, frame_time, countrate_cutoff, wavelength, distance,
-	     new_beam_cent?nbeamx:beamx, new_beam_cent?nbeamy:beamy, osc_start, osc_width);
-
-
-    // Now open the required data
-
-    int block_number = block_start + (frame - 1) / number_per_block;
-    int frame_in_block = (frame - 1) % number_per_block;
-    //    fprintf(stderr, " frame %d is in data_%06d frame %d (1-indexed).\n", 
-    //            frame, block_number, frame_in_block + 1);
-    
-    snprintf(data_name, 20, "data_%06d", block_number); 
-    data = H5Dopen2(group, data_name, H5P_DEFAULT);
-    dataspace = H5Dget_space(data);
-    if (data < 0) {
-      fprintf(stderr, "failed to open /entry/%s\n", data_name);
+	     exposure_time, exposure_period, count_cutoff, wavelength, distance,
+	     new_beam_cent?nbeamx:beamx, new_beam_cent?nbeamy:beamy, "\001", angle_increment);
+    mark = strchr(header_content, '\001');
+    *mark = '\0';
+    if (cbf_template_init(&tmpl, header_content, mark + 1, xpixels, ypixels, digest) < 0) {
+      fprintf(stderr, "eiger2cbf error: failed to prepare the CBF template\n");
       return -1;
     }
-    if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-      fprintf(stderr, "Dimension of /entry/%s is not 3!\n", data_name);
-      return -1;    
-    }
+  }
 
-    // Get the frame
-    H5Sget_simple_extent_dims(dataspace, dims, NULL);
-    hsize_t offset_in[3] = {frame_in_block, 0, 0};
-    hsize_t offset_out[3] = {0, 0, 0};
-    hsize_t count[3] = {1, ypixels, xpixels};
-    hid_t memspace = H5Screate_simple(3, dims, NULL);   
-    if (memspace < 0) {
-      fprintf(stderr, "failed to create memspace\n");
-      return -1;
+  int frame;
+  for (frame = next_frame ? __sync_fetch_and_add(next_frame, 1) : from; frame <= to;
+       frame = next_frame ? __sync_fetch_and_add(next_frame, 1) : frame + 1) {
+    if (journal_sizes) {
+      char done_name[4096];
+      snprintf(done_name, 4096, "%s%06d.cbf", argv[3+optcount], frame);
+      if (journal_done(journal_sizes, from, frame, done_name)) {
+        fprintf(stderr, "Skipping frame %d (%d / %d), already converted\n", frame, frame - from + 1, to - from + 1);
+        continue;
+      }
+    }
+    fprintf(stderr, "Converting frame %d (%d / %d)\n", frame, frame - from + 1, to - from + 1);
+    // the frames making up this image, and its start angle from the first
+    int first = (frame - 1) * sum + 1, last = frame * sum, part;
+    if (sum > 1) fprintf(stderr, " summing frames %d to %d\n", first, last);
+    ret = omega_window_get(&omega, &mc, hdf, first, osc_width, &osc_start);
+    if (ret == 0) {
+      fprintf(stderr, " /entry/sample/goniometer/omega[%d] = %.3f (1-indexed)\n", first, osc_start);
+    } else if (ret == 1) {
+      fprintf(stderr, " WARNING: frame %d is past the end of /entry/sample/goniometer/omega (%llu values). \"Start_angle\" is extrapolated to %.3f\n",
+              first, (unsigned long long)omega.extent, osc_start);
+    } else {
+      fprintf(stderr, " oscillation start not defined. \"Start_angle\" field in the output is set to 0!\n");
+      osc_start = osc_width * first; // old firmware
     }
 
-    ret = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset_in, NULL, 
-			      count, NULL);
-    if (ret < 0) {
-      fprintf(stderr, "select_hyperslab for file failed\n");
-      return -1;
+    if (last > nimages) {
+      fprintf(stderr, "WARNING: invalid frame number specified. %d is bigger than nimages (%d)\n", last, nimages);
+      // Due to a firmware bug, nimages can be smaller than the actual value.
+      // So we don't exit here
     }
-    ret = H5Sselect_hyperslab(memspace, H5S_SELECT_SET, offset_out, NULL, 
-			      count, NULL);
-    if (ret < 0) {
-      fprintf(stderr, "select_hyperslab for memory failed\n");
-      return -1;
+
+    char osc_start_str[64];
+    snprintf(osc_start_str, 64, "%f", osc_start);
+    char header_content[4096] = {};
+    if (!use_template) {
+      snprintf(header_content, 4096, header_format,
+	       description, detector_sn,
+	       pixelsizexint, pixelsizeyint,
+	       thicknessint,
+	       exposure_time, exposure_period, count_cutoff, wavelength, distance,
+	       new_beam_cent?nbeamx:beamx, new_beam_cent?nbeamy:beamy, osc_start_str, angle_increment);
     }
-    ret = H5Dread(data, H5T_NATIVE_UINT, memspace, dataspace, H5P_DEFAULT, buf);
-    if (ret < 0) {
-      fprintf(stderr, "H5Dread for image failed. Wrong frame number?\n");
-      return -1;
+
+
+    // Now read the frame(s); the data block stays open for the next one
+    if (sum_buf) memset(sum_buf, 0, sizeof(unsigned int) * xpixels * ypixels);
+    for (part = first; part <= last; part++) {
+      struct timespec read_start, read_end;
+      clock_gettime(CLOCK_MONOTONIC, &read_start);
+      ret = frame_source_read(&fs, part, buf);
+      if (ret == -1 && fw.timeout) {
+        fprintf(stderr, "eiger2cbf error: frame %d did not appear within %d s\n", part, fw.timeout);
+        return -1;
+      } else if (ret == -1) {
+        fprintf(stderr, "failed to open /entry/%s\n", fs.name);
+        return -1;
+      } else if (ret == -2) {
+        fprintf(stderr, "Dimension of /entry/%s is not 3!\n", fs.name);
+        return -1;    
+      } else if (ret < 0) {
+        fprintf(stderr, "H5Dread for image failed. Wrong frame number?\n");
+        return -1;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &read_end);
+      if (verbose) {
+        double read_time = (read_end.tv_sec - read_start.tv_sec) + (read_end.tv_nsec - read_start.tv_nsec) * 1e-9;
+        fprintf(stderr, " read and decoded in %.3f ms (%.1f MB/s)\n", read_time * 1e3,
+                sizeof(unsigned int) * xpixels * ypixels / read_time / 1e6);
+      }
+      if (sum_buf) sum_frame(sum_buf, buf, countrate_cutoff, count_cutoff, error_val, xpixels * ypixels);
     }
-    H5Sclose(dataspace);
-    H5Sclose(memspace);
-    H5Dclose(data);
 
     /////////////////////////////////////////////////////////////////
     // Reading done. Here output starts...
 
     FILE *fh = stdout;
+    char *stream_buf = NULL;
+    size_t stream_len = 0;
+    char filename[4096];
+    char tmpname[4096 + 8];
+    int use_files = argc-optcount > 3 && !pk.nframes;
 
     if (argc-optcount > 3) {
       if (from == to && retfromto !=2 ) {
-	fh = fopen(argv[3+optcount], "wb");
+	snprintf(filename, 4096, "%s", argv[3+optcount]);
       } else {
-	char filename[4096];
 	snprintf(filename, 4096, "%s%06d.cbf", argv[3+optcount], frame);
-	fh = fopen(filename, "wb");
+      }
+      // written under a temporary name so a partial CBF is never mistaken
+      // for a finished one
+      snprintf(tmpname, sizeof(tmpname), "%s.part", filename);
+    }
+    int rendered = stream_fh || argc-optcount > 3;
+    if (rendered) {
+      // render into memory first; the data is written out below, where
+      // write errors can be checked (CBFlib closes its stream itself)
+      fh = render_open(&stream_buf, &stream_len, tmpname);
+      if (fh == NULL) {
+        fprintf(stderr, "eiger2cbf error: failed to create a memory stream\n");
+        return -1;
       }
     }
 
+    if (sum_buf) {
+      mask_frame(sum_buf, pixel_mask[0] != -9999 ? pixel_mask : NULL, SUM_ERROR, buf_signed, xpixels * ypixels);
+    } else {
+      mask_frame(buf, pixel_mask[0] != -9999 ? pixel_mask : NULL, error_val, buf_signed, xpixels * ypixels);
+    }
+
+    if (use_template) {
+      if (cbf_template_write(&tmpl, fh, osc_start_str, buf_signed) < 0) {
+        fprintf(stderr, "eiger2cbf error: failed to write frame %d\n", frame);
+        return -1;
+      }
+      if ((fh != stdout ? fclose(fh) : fflush(fh)) != 0) {
+        fprintf(stderr, "eiger2cbf error: failed to write frame %d\n", frame);
+        return -1;
+      }
+    } else {
     // create a CBF
     cbf_make_handle(&cbf);
     cbf_new_datablock(cbf, "image_1");
@@ -571,17 +1559,6 @@ int main(int argc, char **argv) {
     // put the image
     cbf_new_category(cbf, "array_data");
     cbf_new_column(cbf, "data");
-    int i;
-    for (i = 0; i < xpixels * ypixels; i++) {
-      if ((pixel_mask[0] != -9999 && pixel_mask[i] == 1) || // the pixel mask is available
-	  (pixel_mask[0] == -9999 && buf[i] == error_val)) { // not available
-	buf_signed[i] = -1;
-      } else if (pixel_mask[0] != -9999 && pixel_mask[i] > 1) { // the pixel mask is 2, 4, 8, 16
-	buf_signed[i] = -2;
-      } else {
-	buf_signed[i] = buf[i];
-      }
-    }
     cbf_set_integerarray_wdims_fs(cbf,
 				  CBF_BYTE_OFFSET,
 				  1, // binary id
@@ -595,19 +1572,74 @@ int main(int argc, char **argv) {
 				  0,
 				  0); //padding
 
-    cbf_write_file(cbf, fh, 1, CBF, MSG_DIGEST | MIME_HEADERS | PAD_4K, 0);
+    cbf_write_file(cbf, fh, 1, CBF, (digest ? MSG_DIGEST : MSG_NODIGEST) | MIME_HEADERS | PAD_4K, 0);
     // no need to fclose() here as the 3rd argument "readable" is 1
     cbf_free_handle(cbf);
+    }
+
+    if (rendered && render_finish(&stream_buf, &stream_len, tmpname) < 0) {
+      fprintf(stderr, "eiger2cbf error: failed to render frame %d\n", frame);
+      return -1;
+    }
+    if (stream_fh) {
+      if (write_stream_record(stream_fh, frame, stream_buf, stream_len) < 0) {
+        fprintf(stderr, "eiger2cbf error: failed to stream frame %d\n", frame);
+        return -1;
+      }
+      free(stream_buf);
+    } else if (use_files) {
+      if (out_backend_write(&ob, tmpname, filename, frame, stream_buf, stream_len) < 0) {
+        fprintf(stderr, "eiger2cbf error: failed to write %s\n", filename);
+        return -1;
+      }
+      free(stream_buf);
+    } else if (pk.nframes) {
+      char *member = strrchr(filename, '/');
+      member = member ? member + 1 : filename;
+      if (pack_write(&pk, argv[3+optcount], member, frame, stream_buf, stream_len) < 0) {
+        fprintf(stderr, "eiger2cbf error: failed to pack frame %d into %s%06d.tar\n",
+                frame, argv[3+optcount], frame - pk.count);
+        return -1;
+      }
+      free(stream_buf);
+    }
+  }
+
+  if (pack_close(&pk) < 0) {
+    fprintf(stderr, "eiger2cbf error: failed to finish the last --pack container\n");
+    return -1;
   }
 
+  if (out_backend_flush(&ob) < 0) {
+    fprintf(stderr, "eiger2cbf error: fsync of CBF files failed; they are left as .part files\n");
+    return -1;
+  }
+
+  if (stream_fh) {
+    if (write_stream_record(stream_fh, 0, NULL, 0) < 0 || fflush(stream_fh) != 0) {
+      fprintf(stderr, "eiger2cbf error: failed to finish the stream\n");
+      return -1;
+    }
+    if (stream_fh != stdout) fclose(stream_fh);
+  }
+
+  frame_source_close(&fs);
   H5Gclose(group);
   H5Fclose(hdf);
 
   free(buf);
   free(buf_signed);
-  free(angles);
+  free(sum_buf);
+  if (use_template) cbf_template_free(&tmpl);
+  metacache_free(&mc);
+  if (journal) fclose(journal);
+  free(journal_sizes);
+  if (fw.timeout) {
+    if (fw.fd >= 0) close(fw.fd);
+    H5Pclose(fw.lapl);
+  }
 
-  fprintf(stderr, "\nAll done!\n");
+  if (next_frame == NULL) fprintf(stderr, "\nAll done!\n");
 
   return 0;
 }
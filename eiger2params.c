@@ -40,9 +40,17 @@ gcc -std=c99 -o eiger2params -g \
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 
 #include "hdf5.h"
 #include "hdf5_hl.h"
+#include "metacache.h"
 
 char* strcasestr(const char *, const char *);
 
@@ -57,9 +65,171 @@ void register_filters() {
   H5Zregister(&bshuf_H5Filter);
 }
 
+/* Structured output (--json, --binary). Unknown values are null in JSON;
+   in the binary record they are -1 for integers and NaN for reals.
+
+   Binary record, little endian, PARAMS_RECORD_SIZE bytes:
+      0  char[4]    "E2PR"
+      4  uint32     layout version (1)
+      8  uint32     record size
+     12  int32      nimages
+     16  int32      ntrigger
+     20  int32      x_pixels
+     24  int32      y_pixels
+     28  int32      bit_depth
+     32  int32      countrate_cutoff (pixel_max)
+     36  int32      0
+     40  float64    sensor_thickness (m)
+     48  float64    pixel_size (m)
+     56  float64    beam_center_x (px)
+     64  float64    beam_center_y (px)
+     72  float64    count_time (s)
+     80  float64    frame_time (s)
+     88  float64    detector_distance (m)
+     96  float64    wavelength (A)
+    104  float64    fraction_polarization
+    112  float64    oscillation_range (deg)
+    120  float64    omega_start (deg)
+    128  float64    omega_step (deg)
+    136  char[64]   detector
+    200  char[256]  description
+    456  char[256]  detector_number
+    712  char[256]  software_version
+    968  char[1024] file name
+   1992  zero padding
+   Strings are NUL padded and truncated to fit. In --batch, a master file
+   that cannot be read still gets a record, with only the file name set,
+   so record k always describes the k-th file. */
+#define PARAMS_FORMAT_DOZOR 0
+#define PARAMS_FORMAT_JSON 1
+#define PARAMS_FORMAT_BINARY 2
+#define PARAMS_RECORD_SIZE 2048
+#define PARAMS_RECORD_VERSION 1
+
+struct ParamsRecord {
+  const char *filename, *detector, *description, *detector_sn, *version;
+  int nimages, ntrigger, xpixels, ypixels, depth, countrate_cutoff;
+  double thickness, pixelsize, beamx, beamy, count_time, frame_time,
+    distance, wavelength, frac_polar, osc_width, omega_start, omega_step;
+};
+
+void json_string(FILE *out, const char *key, const char *value) {
+  const unsigned char *p;
+  fprintf(out, "\"%s\":\"", key);
+  for (p = (const unsigned char *)value; *p; p++) {
+    if (*p == '"' || *p == '\\') fprintf(out, "\\%c", *p);
+    else if (*p < 0x20) fprintf(out, "\\u%04x", *p);
+    else fputc(*p, out);
+  }
+  fprintf(out, "\",");
+}
+
+void json_int(FILE *out, const char *key, int value, int last) {
+  if (value >= 0) fprintf(out, "\"%s\":%d%s", key, value, last ? "" : ",");
+  else fprintf(out, "\"%s\":null%s", key, last ? "" : ",");
+}
+
+void json_double(FILE *out, const char *key, double value, int last) {
+  if (!isnan(value)) fprintf(out, "\"%s\":%.17g%s", key, value, last ? "" : ",");
+  else fprintf(out, "\"%s\":null%s", key, last ? "" : ",");
+}
+
+void write_params_json(FILE *out, const struct ParamsRecord *r) {
+  fprintf(out, "{");
+  json_string(out, "file", r->filename);
+  json_string(out, "detector", r->detector);
+  json_string(out, "description", r->description);
+  json_string(out, "detector_number", r->detector_sn);
+  json_string(out, "software_version", r->version);
+  json_int(out, "nimages", r->nimages, 0);
+  json_int(out, "ntrigger", r->ntrigger, 0);
+  json_int(out, "x_pixels", r->xpixels, 0);
+  json_int(out, "y_pixels", r->ypixels, 0);
+  json_int(out, "bit_depth", r->depth, 0);
+  json_int(out, "countrate_cutoff", r->countrate_cutoff, 0);
+  json_double(out, "sensor_thickness", r->thickness, 0);
+  json_double(out, "pixel_size", r->pixelsize, 0);
+  json_double(out, "beam_center_x", r->beamx, 0);
+  json_double(out, "beam_center_y", r->beamy, 0);
+  json_double(out, "count_time", r->count_time, 0);
+  json_double(out, "frame_time", r->frame_time, 0);
+  json_double(out, "detector_distance", r->distance, 0);
+  json_double(out, "wavelength", r->wavelength, 0);
+  json_double(out, "fraction_polarization", r->frac_polar, 0);
+  json_double(out, "oscillation_range", r->osc_width, 0);
+  json_double(out, "omega_start", r->omega_start, 0);
+  json_double(out, "omega_step", r->omega_step, 1);
+  fprintf(out, "}\n");
+}
+
+void put_u32(unsigned char *p, unsigned int v) {
+  int i;
+  for (i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xff;
+}
+
+void put_f64(unsigned char *p, double v) {
+  unsigned long long bits;
+  int i;
+  memcpy(&bits, &v, sizeof(bits));
+  for (i = 0; i < 8; i++) p[i] = (bits >> (8 * i)) & 0xff;
+}
+
+void put_str(unsigned char *p, const char *v, size_t size) {
+  size_t len = strlen(v);
+  if (len > size - 1) len = size - 1;
+  memcpy(p, v, len);
+}
+
+int write_params_binary(FILE *out, const struct ParamsRecord *r) {
+  unsigned char rec[PARAMS_RECORD_SIZE];
+  memset(rec, 0, sizeof(rec));
+  memcpy(rec, "E2PR", 4);
+  put_u32(rec + 4, PARAMS_RECORD_VERSION);
+  put_u32(rec + 8, PARAMS_RECORD_SIZE);
+  put_u32(rec + 12, (unsigned int)r->nimages);
+  put_u32(rec + 16, (unsigned int)r->ntrigger);
+  put_u32(rec + 20, (unsigned int)r->xpixels);
+  put_u32(rec + 24, (unsigned int)r->ypixels);
+  put_u32(rec + 28, (unsigned int)r->depth);
+  put_u32(rec + 32, (unsigned int)r->countrate_cutoff);
+  put_f64(rec + 40, r->thickness);
+  put_f64(rec + 48, r->pixelsize);
+  put_f64(rec + 56, r->beamx);
+  put_f64(rec + 64, r->beamy);
+  put_f64(rec + 72, r->count_time);
+  put_f64(rec + 80, r->frame_time);
+  put_f64(rec + 88, r->distance);
+  put_f64(rec + 96, r->wavelength);
+  put_f64(rec + 104, r->frac_polar);
+  put_f64(rec + 112, r->osc_width);
+  put_f64(rec + 120, r->omega_start);
+  put_f64(rec + 128, r->omega_step);
+  put_str(rec + 136, r->detector, 64);
+  put_str(rec + 200, r->description, 256);
+  put_str(rec + 456, r->detector_sn, 256);
+  put_str(rec + 712, r->version, 256);
+  put_str(rec + 968, r->filename, 1024);
+  return fwrite(rec, 1, sizeof(rec), out) == sizeof(rec) ? 0 : -1;
+}
+
+/* The record for a master file that could not be read. */
+int write_params_binary_unread(FILE *out, const char *filename) {
+  struct ParamsRecord r;
+  r.filename = filename;
+  r.detector = r.description = r.detector_sn = r.version = "";
+  r.nimages = r.ntrigger = r.xpixels = r.ypixels = r.depth = r.countrate_cutoff = -1;
+  r.thickness = r.pixelsize = r.beamx = r.beamy = r.count_time = r.frame_time =
+    r.distance = r.wavelength = r.frac_polar = r.osc_width = r.omega_start =
+    r.omega_step = NAN;
+  return write_params_binary(out, &r);
+}
+
 void usage( int argc, char **argv ) {
     printf("Usage:\n");
     printf("  %s [options] filename.h5           -- write parameters to STDOUT\n", argv[0]);
+    printf("  %s --batch [options] [files.h5 ...] -- one record per file, in the order given;\n", argv[0]);
+    printf("                                        file names are read from STDIN, one per\n");
+    printf("                                        line, if none are given\n");
     printf("  The file should be \"master\" h5.\n");
     printf("  options:\n");
     printf("    -h or --help                     -- print this message\n");
@@ -69,191 +239,128 @@ void usage( int argc, char **argv ) {
     printf("    --exclude dozordat.dat           -- dozor data file of parameters to exclude\n");
     printf("    --dozor-dat                      -- format as a dozor data file\n");
     printf("    --dozor-cli                      -- format as dozor cli options\n");
+    printf("    --json                           -- one JSON object per line with every field\n");
+    printf("    --binary                         -- fixed layout %d byte little endian record\n", PARAMS_RECORD_SIZE);
+    printf("                                        (see eiger2params.c for the layout)\n");
+    printf("    --jobs njobs                     -- with --batch, read njobs files at a time\n");
+    printf("                                        in separate processes\n");
+    printf("    --meta-cache dir                 -- keep the metadata read from each master file\n");
+    printf("                                        in dir and reuse it while the file is unchanged\n");
+    printf("                                        (default: $EIGER2CBF_META_CACHE)\n");
     return;  
 }
 
 
+/* Options that apply to every master file. The ex_ flags mark parameters
+   listed in the --exclude file. */
+struct ParamsOptions {
+  int verbose;
+  int new_beam_cent;
+  double nbeamx, nbeamy;
+  int new_nimages;
+  long nnimages;
+  int dozor_dat;
+  int format;                /* PARAMS_FORMAT_DOZOR, _JSON or _BINARY */
+  int batch;                 /* many files: skip the data block check */
+  char * meta_cache;         /* --meta-cache directory, NULL if off */
+  char * param_prologue;
+  char * param_epilogue;
+  int ex_detector;
+  int ex_exposure;
+  int ex_detector_distance;
+  int ex_X_ray_wavelength;
+  int ex_fraction_polarization;
+  int ex_pixel_min;
+  int ex_pixel_max;
+  int ex_ix_min;
+  int ex_iy_min;
+  int ex_ix_max;
+  int ex_iy_max;
+  int ex_orgx;
+  int ex_orgy;
+  int ex_oscillation_range;
+  int ex_image_step;
+  int ex_starting_angle;
+  int ex_first_image_number;
+  int ex_number_images;
+  int ex_name_template_image;
+};
 
+void read_exclude(FILE *dozor_exclude_stream, struct ParamsOptions *opt) {
+  char * cline;
+  size_t cline_len, cur_len;
+  char buf[256];
+  while (cline = fgetln(dozor_exclude_stream, &cline_len)) {
+    for (cur_len=0; cur_len<cline_len && cur_len <  255; cur_len++) {
+      buf[cur_len]=cline[cur_len];
+    }
+    buf[255] = buf[cur_len] = 0;
+    if (strcasestr(cline,"detector ") || strcasestr(cline,"detector	")) opt->ex_detector = 1; 
+    if (strcasestr(cline,"exposure ") || strcasestr(cline,"exposure	")) opt->ex_exposure = 1; 
+    if (strcasestr(cline,"detector_distance"))      opt->ex_detector_distance = 1; 
+    if (strcasestr(cline,"X-ray_wavelength"))       opt->ex_X_ray_wavelength = 1; 
+    if (strcasestr(cline,"fraction_polarization"))  opt->ex_fraction_polarization = 1; 
+    if (strcasestr(cline,"pixel_min"))              opt->ex_pixel_min = 1; 
+    if (strcasestr(cline,"pixel_max"))              opt->ex_pixel_max = 1; 
+    if (strcasestr(cline,"ix_min"))                 opt->ex_ix_min = 1; 
+    if (strcasestr(cline,"iy_min"))                 opt->ex_iy_min = 1; 
+    if (strcasestr(cline,"iy_max"))                 opt->ex_iy_max = 1; 
+    if (strcasestr(cline,"orgx"))                   opt->ex_orgx = 1; 
+    if (strcasestr(cline,"orgy"))                   opt->ex_orgy = 1; 
+    if (strcasestr(cline,"oscillation_range"))      opt->ex_oscillation_range = 1; 
+    if (strcasestr(cline,"image_step"))             opt->ex_image_step = 1; 
+    if (strcasestr(cline,"starting_angle"))         opt->ex_starting_angle = 1; 
+    if (strcasestr(cline,"first_image_number"))     opt->ex_first_image_number = 1; 
+    if (strcasestr(cline,"number_images"))          opt->ex_number_images = 1; 
+    if (strcasestr(cline,"name_template_image"))    opt->ex_name_template_image = 1; 
+  }
+}
 
-int main(int argc, char **argv) {
-  char header[4096] = {};
+/* Read the metadata of one master file and write its parameters to out.
+   Returns 0 on success, -1 if the file could not be read. */
+int write_params(const char *filename, FILE *out, struct ParamsOptions *opt) {
   int xpixels = -1, ypixels = -1; 
   double beamx = -10000000., beamy = -10000000.;
-  long ibeamx, ibeamy; 
   int nimages = -1, depth = -1, countrate_cutoff = -1;
   int ntrigger = -1;
-  double nbeamx = -10000000., nbeamy = -10000000.;
-  long nnimages = -1L;
-  int from = -1, to = -1;
-  int ret;
-  int retfromto;
-  int usage_printed = 0;
-  int optcount = 0;      /* count of command line options */
-  int verbose = 0;       /* verbose mode */
-  int new_beam_cent = 0; /* new beam center provided */
-  int new_nimages = 0;   /* new number of images provided */
-  int dozor_dat = 0;     /* flag for dozor dat file output */
-  int dozor_cli = 0;     /* flag for dozor cli options output */
-  char * param_prologue="";
-  char * param_epilogue="\n";
-  char * dozor_exclude=NULL;
-  char * dozor_exclude_buf=NULL;
-  FILE * dozor_exclude_stream=NULL;
-  int ii;
-  char* endptr;
-  char* fndptr;
   double pixelsize = -1, wavelength = -1, distance = -1, count_time = -1, 
     frame_time = -1, osc_width = -1, osc_start = -9999, thickness = -1;
   double frac_polar = -1;
   double polar[2]={-1,-1};
   double spolar[4]={-1,-1,-1,-1};
+  hsize_t polar_extent;
   char detector_sn[256] = {}, description[256] = {}, version[256] = {};
   char * detector;  
 
-  int ex_detector = 0;
-  int ex_exposure = 0;
-  int ex_detector_distance = 0;
-  int ex_X_ray_wavelength = 0;
-  int ex_fraction_polarization = 0;
-  int ex_pixel_min = 0;
-  int ex_pixel_max = 0;
-  int ex_ix_min = 0;
-  int ex_iy_min = 0;
-  int ex_ix_max = 0;
-  int ex_iy_max = 0;
-  int ex_orgx = 0;
-  int ex_orgy = 0;
-  int ex_oscillation_range = 0;
-  int ex_image_step = 0;
-  int ex_starting_angle = 0;
-  int ex_first_image_number = 0;
-  int ex_number_images = 0;
-  int ex_name_template_image = 0;
-
   hid_t hdf;
+  metacache mc;
 
-
-  for (ii=1; ii < argc; ii++) {
-    if (!strcmp(argv[ii],"-h") || !strcmp(argv[ii],"--help")) {
-      usage (argc, argv);
-      optcount ++;
-      usage_printed ++;
-    } else if (!strcmp(argv[ii],"-v") || !strcmp(argv[ii],"--verbose")) {
-      fprintf(stderr, "EIGER HDF5 to PARAMETERS converter (version 170711)\n");
-      fprintf(stderr, " derived by Herbert J. Bernstein, yayahjb@gmail.com from\n");
-      fprintf(stderr, "EIGER HDF5 to CBF converter (version 160929)\n");
-      fprintf(stderr, " written by Takanori Nakane\n");
-      fprintf(stderr, " see https://github.com/biochem-fan/eiger2cbf for details.\n\n");
-      verbose = 1;
-      optcount ++;
-    } else if (!strcmp(argv[ii],"--beam-center")) {
-      new_beam_cent = 1;
-      optcount ++;
-      if (ii  < argc-1) {
-        ii++;
-        optcount ++;
-        nbeamx=strtod(argv[ii],&endptr);
-        if (!endptr || endptr==argv[ii] || *endptr!=',') {
-          new_beam_cent = 0;
-          fprintf(stderr, "eiger2cbf error:  --beam-center provided without two comma-separated values; ignored\n");
-          usage(argc, argv);
-          usage_printed  ++;
-        } else {
-          endptr++;
-          nbeamy=strtod(endptr,&fndptr);
-          if (!fndptr || fndptr==endptr|| *fndptr!='\0') {
-              new_beam_cent = 0;
-              fprintf(stderr, "eiger2cbf error:  --beam-center provided without two comma-separated values; ignored\n");
-              usage(argc, argv);
-              usage_printed  ++;         }
-        }
-      } else {
-        fprintf(stderr, "eiger2cbf error:  --beam-center provided without a value; ignored\n");
-        usage(argc, argv);
-        usage_printed  ++;
-        new_beam_cent = 0;
-      }
-    } else if (!strcmp(argv[ii],"--exclude")) {
-      optcount ++;
-      if (ii < argc-1) {
-        ii++;
-        optcount ++;
-        dozor_exclude =  argv[ii];
-        dozor_exclude_stream = fopen(dozor_exclude,"r");
-        if (!dozor_exclude_stream) dozor_exclude=NULL;
-      } else {
-        fprintf(stderr, "eiger2cbf error:  --exclude provided without a file name ignored\n");
-        dozor_exclude = NULL;
-        dozor_exclude_stream = NULL;
-      }
-    } else if (!strcmp(argv[ii],"--nimages")) {
-      new_nimages = 1;
-      optcount ++;
-      if (ii < argc-1) {
-        ii++;
-        optcount ++;
-        nnimages=strtol(argv[ii],&endptr,10);
-        if (!endptr || endptr==argv[ii]) {
-          new_nimages = 0;
-          fprintf(stderr, "eiger2cbf error: --nimages invalid value; ignored\n");
-          usage(argc,argv);
-          usage_printed++;
-        }
-      } else {
-        fprintf(stderr, "eiger2cbf error:  --nimages provided without a value; ignored\n");
-        usage(argc, argv);
-        usage_printed  ++;
-        new_nimages = 0;
-      }
-    } else if (!strcmp(argv[ii],"--dozor-dat")) {
-      dozor_dat = 1;
-      dozor_cli = 0;
-      param_prologue = "";
-      param_epilogue = "\n";
-      optcount++;
-    } else if (!strcmp(argv[ii],"--dozor-cli")) {
-      dozor_dat = 0;
-      dozor_cli = 1;
-      param_prologue = "--";
-      param_epilogue = "  ";  
-      optcount++;
-    } else break;
-  }
-
-  if (argc-optcount <= 1 || argc-optcount  >= 3) {
-    if (usage_printed == 0) usage (argc, argv); 
-    return -1;
-  }
-
-  register_filters();
-
-  if (dozor_dat == 0 && dozor_cli == 0) dozor_dat = 1;
-
-  hdf = H5Fopen(argv[1+optcount], H5F_ACC_RDONLY, H5P_DEFAULT);
+  hdf = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
   if (hdf < 0) {
-    fprintf(stderr, "eiger2cbf error: failed to open file %s\n", argv[1+optcount]);
+    fprintf(stderr, "eiger2cbf error: failed to open file %s\n", filename);
     return -1;
   }
+  metacache_open(&mc, opt->meta_cache, filename);
 
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
   if (nimages == 1 && ntrigger > 1) {
     fprintf(stderr, "eiger2cbf warning: nimages == 1 and ntrigger == %d \n", ntrigger);
     fprintf(stderr, "eiger2cbf warning: setting nimages to ntrigger \n");
     nimages = ntrigger;
   }
-  if (new_nimages && nnimages > 0) {
-    nimages = nnimages;
+  if (opt->new_nimages && opt->nnimages > 0) {
+    nimages = opt->nnimages;
     fprintf(stderr, "eiger2cbf warning: setting nimages to %d \n",nimages);
   }
   
   
   H5Eset_auto(0, NULL, NULL); // Comment out this line for debugging.
 
-  if (verbose) fprintf(stderr, "Metadata in HDF5:\n");
+  if (opt->verbose) fprintf(stderr, "Metadata in HDF5:\n");
   detector = "unknown_detector";
-  H5LTread_dataset_string(hdf, "/entry/instrument/detector/description", description);
-   if (verbose) fprintf(stderr, " /entry/instrument/detector/description = %s\n", description);
+  metacache_read_string(&mc, hdf, "/entry/instrument/detector/description", description, sizeof(description));
+   if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/description = %s\n", description);
    if (strcasestr(description,"Eiger")) {
      if (strcasestr(description,"16m")) {
        detector = "eiger16m";
@@ -285,13 +392,13 @@ int main(int argc, char **argv) {
    } else {
      detector = description;
    }
-  H5LTread_dataset_string(hdf, "/entry/instrument/detector/detector_number", detector_sn);
-   if (verbose) fprintf(stderr, " /entry/instrument/detector/detector_number = %s\n", detector_sn);
-  H5LTread_dataset_string(hdf, "/entry/instrument/detector/detectorSpecific/software_version", version);
-   if (verbose)fprintf(stderr, " /entry/instrument/detector/detectorSpecific/software_version = %s\n", version);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/bit_depth_image", &depth);
+  metacache_read_string(&mc, hdf, "/entry/instrument/detector/detector_number", detector_sn, sizeof(detector_sn));
+   if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/detector_number = %s\n", detector_sn);
+  metacache_read_string(&mc, hdf, "/entry/instrument/detector/detectorSpecific/software_version", version, sizeof(version));
+   if (opt->verbose)fprintf(stderr, " /entry/instrument/detector/detectorSpecific/software_version = %s\n", version);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/bit_depth_image", &depth);
   if (depth > 0) {
-     if (verbose) fprintf(stderr, " /entry/instrument/detector/bit_depth_image = %d\n", depth);
+     if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/bit_depth_image = %d\n", depth);
   } else {
     fprintf(stderr, " WARNING: /entry/instrument/detector/bit_depth_image is not avaialble. We assume 16 bit.\n");
     depth = 16;
@@ -300,20 +407,20 @@ int main(int argc, char **argv) {
 
   // Saturation value
   // Firmware >= 1.5
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/saturation_value", &countrate_cutoff);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/saturation_value", &countrate_cutoff);
   if (countrate_cutoff > 0) {
-     if (verbose) fprintf(stderr, " /entry/instrument/detector/detectorSpecific/saturation_value = %d\n", countrate_cutoff);
+     if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/detectorSpecific/saturation_value = %d\n", countrate_cutoff);
   } else {
     // Firmware >= 1.4
-     if (verbose) fprintf(stderr, "  /entry/instrument/detector/detectorSpecific/saturation_value not present. Trying another place.\n");
-    H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff", &countrate_cutoff);
+     if (opt->verbose) fprintf(stderr, "  /entry/instrument/detector/detectorSpecific/saturation_value not present. Trying another place.\n");
+    metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff", &countrate_cutoff);
     if (countrate_cutoff > 0) {
-       if (verbose) fprintf(stderr, " /entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff = %d\n", countrate_cutoff);
+       if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff = %d\n", countrate_cutoff);
       countrate_cutoff++;
     } else {
       fprintf(stderr, "  /entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff not present. Trying another place.\n");
       // < 1.4
-      H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff", &countrate_cutoff);
+      metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff", &countrate_cutoff);
       if (countrate_cutoff > 0) {
         fprintf(stderr, " /entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff = %d\n", countrate_cutoff);
 	fprintf(stderr, "  WARNING: The use of this field is not recommended now.\n");
@@ -328,51 +435,53 @@ int main(int argc, char **argv) {
     }
   }
 
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/sensor_thickness", &thickness); // in m 
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/sensor_thickness", &thickness); // in m 
+  // structured output reports what the file says, not the assumed value
+  double thickness_read = thickness > 0 ? thickness : NAN;
   if (thickness > 0) {
-     if (verbose) fprintf(stderr, " /entry/instrument/detector/sensor_thickness = %f (um)\n", thickness * 1E6);
+     if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/sensor_thickness = %f (um)\n", thickness * 1E6);
   } else {
     thickness = 450E-6;
-     if (verbose) fprintf(stderr, " /entry/instrument/detector/sensor_thickness is not avaialble. We assume it is %f um\n", thickness * 1E6);
+     if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/sensor_thickness is not avaialble. We assume it is %f um\n", thickness * 1E6);
   }
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
-   if (verbose) fprintf(stderr, " /entry/instrument/detector/detectorSpecific/{x,y}_pixels_in_detector = (%d, %d) (px)\n",
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
+   if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/detectorSpecific/{x,y}_pixels_in_detector = (%d, %d) (px)\n",
 	  xpixels, ypixels);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/beam_center_x", &beamx);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/beam_center_y", &beamy);
-   if (verbose) fprintf(stderr, " /entry/instrument/detector/beam_center_{x,y} = (%.2f, %.2f) (px)\n", new_beam_cent?nbeamx:beamx, new_beam_cent?nbeamy:beamy);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/count_time", &count_time); // in s
-   if (verbose) fprintf(stderr, " /entry/instrument/detector/count_time = %f (sec)\n", count_time);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/frame_time", &frame_time); // in s
-   if (verbose) fprintf(stderr, " /entry/instrument/detector/frame_time = %f (sec)\n", frame_time);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/x_pixel_size", &pixelsize); // in m
-   if (verbose) fprintf(stderr, " /entry/instrument/detector/x_pixel_size = %f (m)\n", pixelsize);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/beam_center_x", &beamx);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/beam_center_y", &beamy);
+   if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/beam_center_{x,y} = (%.2f, %.2f) (px)\n", opt->new_beam_cent?opt->nbeamx:beamx, opt->new_beam_cent?opt->nbeamy:beamy);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/count_time", &count_time); // in s
+   if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/count_time = %f (sec)\n", count_time);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/frame_time", &frame_time); // in s
+   if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/frame_time = %f (sec)\n", frame_time);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/x_pixel_size", &pixelsize); // in m
+   if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/x_pixel_size = %f (m)\n", pixelsize);
 
   // Detector distance
 
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/distance", &distance); // Firmware >= 1.7
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/distance", &distance); // Firmware >= 1.7
   if (distance > 0) {
-     if (verbose) fprintf(stderr, " /entry/instrument/detector/distance = %f (m)\n", distance);
+     if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/distance = %f (m)\n", distance);
   } else {
-     if (verbose) fprintf(stderr, "  /entry/instrument/detector/distance not present. Trying another place.\n");
+     if (opt->verbose) fprintf(stderr, "  /entry/instrument/detector/distance not present. Trying another place.\n");
 
-    H5LTread_dataset_double(hdf, "/entry/instrument/detector/detector_distance", &distance); // Firmware< 1.7
+    metacache_read_double(&mc, hdf, "/entry/instrument/detector/detector_distance", &distance); // Firmware< 1.7
     if (distance > 0) {
-       if (verbose) fprintf(stderr, " /entry/instrument/detector/detector_distance = %f (m)\n", distance);
+       if (opt->verbose) fprintf(stderr, " /entry/instrument/detector/detector_distance = %f (m)\n", distance);
  
    } else {
-       if (verbose) fprintf(stderr, "  /entry/instrument/detector/detector_distance not present.\n");
-       if (verbose) fprintf(stderr, " WARNING: detector distance was not defined! \"Detector distance\" field in the output is set to -1.\n");
+       if (opt->verbose) fprintf(stderr, "  /entry/instrument/detector/detector_distance not present.\n");
+       if (opt->verbose) fprintf(stderr, " WARNING: detector distance was not defined! \"Detector distance\" field in the output is set to -1.\n");
     }
   }
 
 
   // Polarization
   frac_polar = -1.;
-  H5LTread_dataset_double(hdf, "/entry/sample/beam/incident_polarisation_stokes_average", spolar);
+  metacache_read_doubles(&mc, hdf, "/entry/sample/beam/incident_polarisation_stokes_average", 0, sizeof(spolar) / sizeof(double), spolar, &polar_extent);
   if (spolar[0] > 0.) {
-     if (verbose) fprintf(stderr, " /entry/sample/beam/incident_polarisation_stokes_average = [%g,%g,%g,%g] (W/m^2)\n", 
+     if (opt->verbose) fprintf(stderr, " /entry/sample/beam/incident_polarisation_stokes_average = [%g,%g,%g,%g] (W/m^2)\n", 
           spolar[0], spolar[1], spolar[2], spolar[3]); 
      frac_polar = -1.;
      if (spolar[0] > 0. && sqrt(spolar[1]*spolar[1]+spolar[2]*spolar[2]) >= spolar[0]) {
@@ -383,9 +492,9 @@ int main(int argc, char **argv) {
      frac_polar = -1.;
   }
   if (frac_polar < 0.) {
-     H5LTread_dataset_double(hdf, "/entry/sample/beam/incident_polarisation_stokes", spolar);
+     metacache_read_doubles(&mc, hdf, "/entry/sample/beam/incident_polarisation_stokes", 0, sizeof(spolar) / sizeof(double), spolar, &polar_extent);
      if (spolar[0] >= 0.) {
-       if (verbose) fprintf(stderr, " /entry/sample/beam/incident_polarisation_stokes[0] = [%g,%g,%g,%g] (W/m^2)\n",
+       if (opt->verbose) fprintf(stderr, " /entry/sample/beam/incident_polarisation_stokes[0] = [%g,%g,%g,%g] (W/m^2)\n",
            spolar[0], spolar[1], spolar[2], spolar[3]); 
        frac_polar = -1;
        if (spolar[0] > 0. && sqrt(spolar[1]*spolar[1]+spolar[2]*spolar[2]) >= spolar[0]) {
@@ -397,9 +506,9 @@ int main(int argc, char **argv) {
     }
   }
   if (frac_polar < 0.) {
-     H5LTread_dataset_double(hdf, "/entry/sample/beam/incident_polarization", polar);
+     metacache_read_doubles(&mc, hdf, "/entry/sample/beam/incident_polarization", 0, sizeof(polar) / sizeof(double), polar, &polar_extent);
      if (polar[0] >= 0.) {
-       if (verbose) fprintf(stderr, " /entry/sample/beam/incident_polarization = [%g,%g] (ratio, angle)\n",
+       if (opt->verbose) fprintf(stderr, " /entry/sample/beam/incident_polarization = [%g,%g] (ratio, angle)\n",
            polar[0], polar[1]); 
            if (polar[0] >= 0. && polar[0] <= 1.) frac_polar = polar[0];
        }
@@ -407,27 +516,27 @@ int main(int argc, char **argv) {
 
 
   // Wavelength
-  H5LTread_dataset_double(hdf, "/entry/sample/beam/incident_wavelength", &wavelength); // Firmware >= 1.7
+  metacache_read_double(&mc, hdf, "/entry/sample/beam/incident_wavelength", &wavelength); // Firmware >= 1.7
   if (wavelength > 0) {
-     if (verbose) fprintf(stderr, " /entry/sample/beam/incident_wavelength = %f (A)\n", wavelength);
+     if (opt->verbose) fprintf(stderr, " /entry/sample/beam/incident_wavelength = %f (A)\n", wavelength);
   } else {
-     if (verbose) fprintf(stderr, "  /entry/sample/beam/incident_wavelength not present. Trying another place.\n");
+     if (opt->verbose) fprintf(stderr, "  /entry/sample/beam/incident_wavelength not present. Trying another place.\n");
 
-    H5LTread_dataset_double(hdf, "/entry/instrument/beam/wavelength", &wavelength);
+    metacache_read_double(&mc, hdf, "/entry/instrument/beam/wavelength", &wavelength);
     if (wavelength > 0) {
-       if (verbose) fprintf(stderr, " /entry/instrument/beam/wavelength = %f (A)\n", wavelength);
+       if (opt->verbose) fprintf(stderr, " /entry/instrument/beam/wavelength = %f (A)\n", wavelength);
     } else {
       fprintf(stderr, "  /entry/instrument/beam/wavelength not present. Trying another place.\n");
 
-      H5LTread_dataset_double(hdf, "/entry/instrument/monochromator/wavelength", &wavelength);
+      metacache_read_double(&mc, hdf, "/entry/instrument/monochromator/wavelength", &wavelength);
       if (wavelength > 0) {
-	 if (verbose) fprintf(stderr, " /entry/instrument/monochromator/wavelength = %f (A)\n", wavelength);
+	 if (opt->verbose) fprintf(stderr, " /entry/instrument/monochromator/wavelength = %f (A)\n", wavelength);
       } else {
 	fprintf(stderr, "  /entry/instrument/monochromator/wavelength not present. Trying another place.\n");
 
-	H5LTread_dataset_double(hdf, "/entry/instrument/beam/incident_wavelength", &wavelength); // Firmware 1.6
+	metacache_read_double(&mc, hdf, "/entry/instrument/beam/incident_wavelength", &wavelength); // Firmware 1.6
 	if (wavelength > 0) {
-	   if (verbose) fprintf(stderr, " /entry/instrument/beam/incident_wavelength = %f (A)\n", wavelength);
+	   if (opt->verbose) fprintf(stderr, " /entry/instrument/beam/incident_wavelength = %f (A)\n", wavelength);
 	} else {
 	  fprintf(stderr, "  /entry/instrument/beam/incident_wavelength not present.\n");
 	}
@@ -438,30 +547,30 @@ int main(int argc, char **argv) {
     fprintf(stderr, " WARNING: wavelength was not defined! \"Wavelength\" field in the output is set to -1.\n");
   }
 
-  H5LTread_dataset_double(hdf, "/entry/sample/goniometer/omega_range_average", &osc_width);
+  metacache_read_double(&mc, hdf, "/entry/sample/goniometer/omega_range_average", &osc_width);
+  double osc_width_read = osc_width > 0 ? osc_width : NAN;
   if (osc_width > 0) {
-     if (verbose) fprintf(stderr, " /entry/sample/goniometer/omega_range_average = %f (deg)\n", osc_width);
+     if (opt->verbose) fprintf(stderr, " /entry/sample/goniometer/omega_range_average = %f (deg)\n", osc_width);
   } else {
     fprintf(stderr, " WARNING: oscillation width was not defined. \"Start_angle\" field in the output is set to 0!\n");
     osc_width = 0;
   }
 
   // TODO: Is it always in omega?
-  int bufsize = (nimages < 100000) ? 100000 : nimages;
-  double *angles = (double*)malloc(bufsize * sizeof(double));
-  // I don't know why but nimages can be too small ...
-  if (angles == NULL) {
-    fprintf(stderr, "failed to allocate buffer for omega.\n");
-    return -1;
-  }
-  angles[0] = -9999;
-  H5LTread_dataset_double(hdf, "/entry/sample/goniometer/omega", angles);
+  // Only the start angle and the step are needed, so only the first two
+  // values are read.
+  double angles[2] = {-9999, -9999};
+  hsize_t omega_extent;
+  int nangles = metacache_read_doubles(&mc, hdf, "/entry/sample/goniometer/omega", 0, 2, angles, &omega_extent);
+  if (nangles < 1) angles[0] = -9999;
   fprintf(stderr, "\n");
 
   hid_t entry, group;
   entry = H5Gopen2(hdf, "/entry", H5P_DEFAULT);
   if (entry < 0) {
     fprintf(stderr, "/entry does not exist!\n");
+    H5Fclose(hdf);
+    metacache_free(&mc);
     return -1;
   }
 
@@ -472,177 +581,570 @@ int main(int argc, char **argv) {
   }
 
   int block_start = 1;
-  if (H5LTfind_dataset(group, "data_000000")) {
+  if (metacache_find_dataset(&mc, group, "data_000000")) {
     fprintf(stderr, "This dataset starts from data_000000.\n");
     block_start = 0;
   } else {
     fprintf(stderr, "This dataset starts from data_000001.\n");
   }
 
-  char data_name[20] = {};
-  hid_t data, dataspace;
-  int number_per_block = 0;
+  // The block size is not part of the parameters; in batch mode the data
+  // files are not opened at all.
+  if (!opt->batch) {
+    char data_name[20] = {};
+    hsize_t dims[3];
+    int number_per_block = 0, rank;
   
-  // Open the first data block to get the number of frames in a block
-  snprintf(data_name, 20, "data_%06d", block_start); 
-  data = H5Dopen2(group, data_name, H5P_DEFAULT);
-  dataspace = H5Dget_space(data);
-  if (data < 0) {
-    fprintf(stderr, "failed to open /entry/%s\n", data_name);
-    return -1;
-  }
-  if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-    fprintf(stderr, "Dimension of /entry/%s is not 3!\n", data_name);
-    return -1;    
+    // Open the first data block to get the number of frames in a block
+    snprintf(data_name, 20, "data_%06d", block_start); 
+    rank = metacache_get_dims(&mc, group, data_name, dims);
+    if (rank != 3) {
+      if (rank < 0) fprintf(stderr, "failed to open /entry/%s\n", data_name);
+      else fprintf(stderr, "Dimension of /entry/%s is not 3!\n", data_name);
+      if (group != entry) H5Gclose(group);
+      H5Gclose(entry);
+      H5Fclose(hdf);
+      metacache_free(&mc);
+        return -1;
+    }
+    number_per_block = dims[0];
+    fprintf(stderr, "The number of images per data block is %d.\n", number_per_block);
   }
-  hsize_t dims[3];
-  H5Sget_simple_extent_dims(dataspace, dims, NULL);
-  number_per_block = dims[0];
-  fprintf(stderr, "The number of images per data block is %d.\n", number_per_block);
 
-  H5Sclose(dataspace);
-  H5Dclose(data);
+  if (metacache_save(&mc) < 0) {
+    fprintf(stderr, "eiger2cbf warning: failed to write the metadata cache %s\n", mc.path);
+  }
 
   fprintf(stderr, "\nFile analysis completed.\n\n");
  
-  {
-
-    /////////////////////////////////////////////////////////////////
-    // Reading done. Here output starts...
-
-    FILE *fh = stdout;
-
-    ex_detector = 0;
-    ex_exposure = 0;
-    ex_detector_distance = 0;
-    ex_X_ray_wavelength = 0;
-    ex_fraction_polarization = 0;
-    ex_pixel_min = 0;
-    ex_pixel_max = 0;
-    ex_ix_min = 0;
-    ex_iy_min = 0;
-    ex_ix_max = 0;
-    ex_iy_max = 0;
-    ex_orgx = 0;
-    ex_orgy = 0;
-    ex_oscillation_range = 0;
-    ex_image_step = 0;
-    ex_starting_angle = 0;
-    ex_first_image_number = 0;
-    ex_number_images = 0;
-    ex_name_template_image = 0;
-
-    dozor_exclude_buf = NULL;
-    if (dozor_exclude_stream) {
-      char * cline;
-      size_t cline_len, cur_len;
-      char buf[256];
-      while (cline = fgetln(dozor_exclude_stream, &cline_len)) {
-        for (cur_len=0; cur_len<cline_len && cur_len <  255; cur_len++) {
-          buf[cur_len]=cline[cur_len];
+  /////////////////////////////////////////////////////////////////
+  // Reading done. Here output starts...
+
+  if (opt->format != PARAMS_FORMAT_DOZOR) {
+    struct ParamsRecord r;
+    r.filename = filename;
+    r.detector = detector;
+    r.description = description;
+    r.detector_sn = detector_sn;
+    r.version = version;
+    r.nimages = nimages;
+    r.ntrigger = ntrigger;
+    r.xpixels = xpixels;
+    r.ypixels = ypixels;
+    r.depth = depth;
+    r.countrate_cutoff = countrate_cutoff;
+    r.thickness = thickness_read;
+    r.pixelsize = pixelsize > 0 ? pixelsize : NAN;
+    r.beamx = opt->new_beam_cent ? opt->nbeamx : beamx;
+    r.beamy = opt->new_beam_cent ? opt->nbeamy : beamy;
+    if (r.beamx <= -9999999. || r.beamy <= -9999999.) r.beamx = r.beamy = NAN;
+    r.count_time = count_time > 0 ? count_time : NAN;
+    r.frame_time = frame_time > 0 ? frame_time : NAN;
+    r.distance = distance >= 0 ? distance : NAN;
+    r.wavelength = wavelength >= 0 ? wavelength : NAN;
+    r.frac_polar = frac_polar >= 0 ? frac_polar : NAN;
+    r.osc_width = osc_width_read;
+    r.omega_start = angles[0] > -9999. ? angles[0] : NAN;
+    r.omega_step = nangles > 1 ? angles[1] - angles[0] : NAN;
+    if (opt->format == PARAMS_FORMAT_JSON) write_params_json(out, &r);
+    else write_params_binary(out, &r);
+
+    if (group != entry) H5Gclose(group);
+    H5Gclose(entry);
+    H5Fclose(hdf);
+    metacache_free(&mc);
+    return 0;
+  }
+
+  if (opt->dozor_dat) fprintf(out,"!\n");
+  if (!opt->ex_detector) fprintf(out,"%sdetector %s%s",opt->param_prologue,detector,opt->param_epilogue);
+  if (count_time > 0.) {
+    if (!opt->ex_exposure) fprintf(out,"%sexposure %f%s",opt->param_prologue,count_time,opt->param_epilogue);
+  } else if (opt->verbose) {
+    if (!opt->ex_exposure) fprintf(out,"%sexposure %s%s",opt->param_prologue,"unknown_exposure",opt->param_epilogue);
+  }
+  if (distance >= 0.) {
+    if (!opt->ex_detector_distance) fprintf(out,"%sdetector_distance %f%s",opt->param_prologue,distance*1.e3,opt->param_epilogue);  
+  } else if (opt->verbose) {
+    if (!opt->ex_detector_distance) fprintf(out,"%sdetector_distance %s%s",opt->param_prologue,"unknown_distance",opt->param_epilogue);  
+  }
+  if (wavelength >= 0.) {
+    if (!opt->ex_X_ray_wavelength) fprintf(out,"%sX-ray_wavelength %f%s",opt->param_prologue,wavelength,opt->param_epilogue);  
+  } else if (opt->verbose) {
+    if (!opt->ex_X_ray_wavelength) fprintf(out,"%sX-ray_wavelength %s%s",opt->param_prologue,"unknown_wavelength",opt->param_epilogue);  
+  }
+  if (frac_polar >= 0.) {
+    if (!opt->ex_fraction_polarization) fprintf(out,"%sfraction_polarization %f%s",opt->param_prologue,frac_polar,opt->param_epilogue);  
+  } else if (opt->verbose) {
+    if (!opt->ex_fraction_polarization) fprintf(out,"%sfraction_polarization %s%s",opt->param_prologue,"unknown_polarization",opt->param_epilogue);  
+  }
+  if (opt->verbose) {
+    if (!opt->ex_pixel_min) fprintf(out,"%spixel_min 1%s",opt->param_prologue,opt->param_epilogue);
+  }
+  if (countrate_cutoff >= 0) {
+    if (!opt->ex_pixel_max) fprintf(out,"%spixel_max %d%s",opt->param_prologue,countrate_cutoff,opt->param_epilogue);
+  } else if (opt->verbose) {
+    if (!opt->ex_pixel_max) fprintf(out,"%spixel_max %s%s",opt->param_prologue,"unknown_pixel_max",opt->param_epilogue);
+  }
+
+  beamx=opt->new_beam_cent?opt->nbeamx:beamx;
+  beamy=opt->new_beam_cent?opt->nbeamy:beamy;
+  if (beamx > -9999999. && beamy > -9999999.) {
+    if (!opt->ex_ix_min) fprintf(out,"%six_min %.0f%s",opt->param_prologue,beamx-50.,opt->param_epilogue);
+    if (!opt->ex_ix_max) fprintf(out,"%six_max %.0f%s",opt->param_prologue,beamx+50.,opt->param_epilogue);
+    if (!opt->ex_iy_min) fprintf(out,"%siy_min %.0f%s",opt->param_prologue,beamy-50.,opt->param_epilogue);
+    if (!opt->ex_iy_max) fprintf(out,"%siy_max %.0f%s",opt->param_prologue,beamy+50.,opt->param_epilogue);
+    if (!opt->ex_orgx) fprintf(out,"%sorgx %f%s",opt->param_prologue,beamx,opt->param_epilogue);
+    if (!opt->ex_orgy) fprintf(out,"%sorgy %f%s",opt->param_prologue,beamy,opt->param_epilogue);
+  } else if (opt->verbose) {
+    if (!opt->ex_ix_min) fprintf(out,"%six_min %s%s",opt->param_prologue,"unknown_ix_min",opt->param_epilogue);
+    if (!opt->ex_ix_max) fprintf(out,"%six_max %s%s",opt->param_prologue,"unknown_ix_max",opt->param_epilogue);
+    if (!opt->ex_iy_min) fprintf(out,"%siy_min %s%s",opt->param_prologue,"unknown_iy_min",opt->param_epilogue);
+    if (!opt->ex_iy_max) fprintf(out,"%siy_max %s%s",opt->param_prologue,"unknown_iy_max",opt->param_epilogue);
+    if (!opt->ex_orgx) fprintf(out,"%sorgx %s%s",opt->param_prologue,"unknown_orgx",opt->param_epilogue);
+    if (!opt->ex_orgy) fprintf(out,"%sorgy %s%s",opt->param_prologue,"unknown_orgy",opt->param_epilogue); 
+  }
+  if (osc_width >= 0.) {
+    if (!opt->ex_oscillation_range) fprintf(out,"%soscillation_range %f%s",opt->param_prologue,osc_width,opt->param_epilogue);
+  } else if (opt->verbose) {
+    if (!opt->ex_oscillation_range)fprintf(out,"%soscillation_range %s%s",opt->param_prologue,"unknown_oscillation_range",opt->param_epilogue);
+  }
+  if (nimages > 0 && nangles > 1) {
+    if (!opt->ex_image_step) fprintf(out,"%simage_step %.0f%s",opt->param_prologue,angles[1]-angles[0],opt->param_epilogue);
+  } else if (opt->verbose) {
+    if (!opt->ex_image_step) fprintf(out,"%simage_step %s%s",opt->param_prologue,"unknown_image_step",opt->param_epilogue);
+  }
+  if (angles[0] > -9999.) {
+    if (!opt->ex_starting_angle) fprintf(out,"%sstarting_angle %f%s",opt->param_prologue,angles[0],opt->param_epilogue);
+  } else {
+    if (!opt->ex_starting_angle) fprintf(out,"%sstarting_angle %s%s",opt->param_prologue,"unknown_starting_angle",opt->param_epilogue);
+  }
+  if (nimages > 0) {
+    if (!opt->ex_first_image_number) fprintf(out,"%sfirst_image_number %d%s",opt->param_prologue,1,opt->param_epilogue);
+    if (!opt->ex_number_images) fprintf(out,"%snumber_images %d%s",opt->param_prologue,nimages,opt->param_epilogue);
+  } else if (opt->verbose) {
+    if (!opt->ex_first_image_number) fprintf(out,"%sfirst_image_number %s%s",opt->param_prologue,"unknown_first_image_number",opt->param_epilogue);
+    if (!opt->ex_number_images) fprintf(out,"%snumber_images %s%s",opt->param_prologue,"unknown_number_images",opt->param_epilogue);
+  }
+ 
+  if (!opt->ex_name_template_image) fprintf(out,"%sname_template_image %s%s",opt->param_prologue,filename,opt->param_epilogue);
+
+  if (group != entry) H5Gclose(group);
+  H5Gclose(entry);
+  H5Fclose(hdf);
+  metacache_free(&mc);
+
+
+  return 0;
+}
+
+/* Batch mode: many master files, one record each, in the order given.
+   With --jobs N, N forked workers take files one at a time from a shared
+   counter (as eiger2cbf --nproc does with frames) and send each record
+   back over a pipe as [index, status, length, text]; the parent prints
+   them in input order. HDF5 is initialised once before the fork, so a
+   file costs only its open and reads. */
+int write_record(const char *filename, FILE *out, struct ParamsOptions *opt, int dozor_cli) {
+  int ret = write_params(filename, out, opt);
+  if (ret == 0 && dozor_cli) fprintf(out, "\n");
+  if (ret < 0 && opt->format == PARAMS_FORMAT_BINARY) write_params_binary_unread(out, filename);
+  return ret;
+}
+
+#ifndef _WIN32
+int write_all(int fd, const void *data, size_t len) {
+  const char *p = (const char *)data;
+  ssize_t n;
+  while (len > 0) {
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int read_all(int fd, void *data, size_t len) {
+  char *p = (char *)data;
+  ssize_t n;
+  while (len > 0) {
+    n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int run_batch_jobs(char **files, int nfiles, int njobs, struct ParamsOptions *opt, int dozor_cli) {
+  int *next_file, *current, *fds, *status;
+  char **records;
+  size_t *lens;
+  pid_t *pids;
+  int job, nopen, next_out = 0, failed = 0, i;
+  size_t map_size = sizeof(int) * (1 + njobs);
+  struct pollfd *pfds;
+
+  // the file counter, then the file each job is reading (-1 for none),
+  // so that a job that dies can be reported with its file
+  next_file = (int*)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (next_file == MAP_FAILED) {
+    fprintf(stderr, "eiger2cbf error: failed to map the file counter\n");
+    return -1;
+  }
+  *next_file = 0;
+  current = next_file + 1;
+  for (job = 0; job < njobs; job++) current[job] = -1;
+  pids = (pid_t*)malloc(sizeof(pid_t) * njobs);
+  fds = (int*)malloc(sizeof(int) * njobs);
+  pfds = (struct pollfd*)malloc(sizeof(struct pollfd) * njobs);
+  records = (char**)calloc(nfiles, sizeof(char*));
+  lens = (size_t*)calloc(nfiles, sizeof(size_t));
+  status = (int*)calloc(nfiles, sizeof(int));
+  fflush(NULL);
+
+  for (job = 0; job < njobs; job++) {
+    int pipefd[2];
+    pid_t pid;
+    if (pipe(pipefd) != 0 || (pid = fork()) < 0) {
+      fprintf(stderr, "eiger2cbf error: failed to start job %d\n", job);
+      break;
+    }
+    if (pid == 0) {
+      // worker
+      int k, ret;
+      char *buf;
+      size_t len;
+      FILE *out;
+      for (k = 0; k < job; k++) close(fds[k]);
+      close(pipefd[0]);
+      while ((i = __sync_fetch_and_add(next_file, 1)) < nfiles) {
+        current[job] = i;
+        buf = NULL;
+        len = 0;
+        out = open_memstream(&buf, &len);
+        ret = out ? write_record(files[i], out, opt, dozor_cli) : -1;
+        if (out) fclose(out);
+        // only a binary placeholder is kept from a failed file
+        if (ret < 0 && opt->format != PARAMS_FORMAT_BINARY) len = 0;
+        if (write_all(pipefd[1], &i, sizeof(i)) < 0 ||
+            write_all(pipefd[1], &ret, sizeof(ret)) < 0 ||
+            write_all(pipefd[1], &len, sizeof(len)) < 0 ||
+            write_all(pipefd[1], buf, len) < 0) {
+          _exit(1);
         }
-        buf[255] = buf[cur_len] = 0;
-        if (strcasestr(cline,"detector ") || strcasestr(cline,"detector	")) ex_detector = 1; 
-        if (strcasestr(cline,"exposure ") || strcasestr(cline,"exposure	")) ex_exposure = 1; 
-        if (strcasestr(cline,"detector_distance"))      ex_detector_distance = 1; 
-        if (strcasestr(cline,"X-ray_wavelength"))       ex_X_ray_wavelength = 1; 
-        if (strcasestr(cline,"fraction_polarization"))  ex_fraction_polarization = 1; 
-        if (strcasestr(cline,"pixel_min"))              ex_pixel_min = 1; 
-        if (strcasestr(cline,"pixel_max"))              ex_pixel_max = 1; 
-        if (strcasestr(cline,"ix_min"))                 ex_ix_min = 1; 
-        if (strcasestr(cline,"iy_min"))                 ex_iy_min = 1; 
-        if (strcasestr(cline,"iy_max"))                 ex_iy_max = 1; 
-        if (strcasestr(cline,"orgx"))                   ex_orgx = 1; 
-        if (strcasestr(cline,"orgy"))                   ex_orgy = 1; 
-        if (strcasestr(cline,"oscillation_range"))      ex_oscillation_range = 1; 
-        if (strcasestr(cline,"image_step"))             ex_image_step = 1; 
-        if (strcasestr(cline,"starting_angle"))         ex_starting_angle = 1; 
-        if (strcasestr(cline,"first_image_number"))     ex_first_image_number = 1; 
-        if (strcasestr(cline,"number_images"))          ex_number_images = 1; 
-        if (strcasestr(cline,"name_template_image"))    ex_name_template_image = 1; 
+        free(buf);
+        current[job] = -1;
       }
+      _exit(0);
     }
-    if (dozor_dat) fprintf(stdout,"!\n");
-    if (!ex_detector) fprintf(stdout,"%sdetector %s%s",param_prologue,detector,param_epilogue);
-    if (count_time > 0.) {
-      if (!ex_exposure) fprintf(stdout,"%sexposure %f%s",param_prologue,count_time,param_epilogue);
-    } else if (verbose) {
-      if (!ex_exposure) fprintf(stdout,"%sexposure %s%s",param_prologue,"unknown_exposure",param_epilogue);
-    }
-    if (distance >= 0.) {
-      if (!ex_detector_distance) fprintf(stdout,"%sdetector_distance %f%s",param_prologue,distance*1.e3,param_epilogue);  
-    } else if (verbose) {
-      if (!ex_detector_distance) fprintf(stdout,"%sdetector_distance %s%s",param_prologue,"unknown_distance",param_epilogue);  
-    }
-    if (wavelength >= 0.) {
-      if (!ex_X_ray_wavelength) fprintf(stdout,"%sX-ray_wavelength %f%s",param_prologue,wavelength,param_epilogue);  
-    } else if (verbose) {
-      if (!ex_X_ray_wavelength) fprintf(stdout,"%sX-ray_wavelength %s%s",param_prologue,"unknown_wavelength",param_epilogue);  
+    close(pipefd[1]);
+    fds[job] = pipefd[0];
+    pids[job] = pid;
+  }
+  njobs = job;
+
+  nopen = njobs;
+  while (nopen > 0) {
+    for (job = 0; job < njobs; job++) {
+      pfds[job].fd = fds[job];
+      pfds[job].events = POLLIN;
+      pfds[job].revents = 0;
     }
-    if (frac_polar >= 0.) {
-      if (!ex_fraction_polarization) fprintf(stdout,"%sfraction_polarization %f%s",param_prologue,frac_polar,param_epilogue);  
-    } else if (verbose) {
-      if (!ex_fraction_polarization) fprintf(stdout,"%sfraction_polarization %s%s",param_prologue,"unknown_polarization",param_epilogue);  
+    if (poll(pfds, njobs, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
     }
-    if (verbose) {
-      if (!ex_pixel_min) fprintf(stdout,"%spixel_min 1%s",param_prologue,param_epilogue);
+    for (job = 0; job < njobs; job++) {
+      int ret;
+      size_t len;
+      if (fds[job] < 0 || !(pfds[job].revents & (POLLIN | POLLHUP))) continue;
+      if (read_all(fds[job], &i, sizeof(i)) < 0) {
+        // this job has finished
+        close(fds[job]);
+        fds[job] = -1;
+        nopen--;
+        continue;
+      }
+      if (read_all(fds[job], &ret, sizeof(ret)) < 0 ||
+          read_all(fds[job], &len, sizeof(len)) < 0 ||
+          i < 0 || i >= nfiles || (records[i] = (char*)malloc(len + 1)) == NULL ||
+          read_all(fds[job], records[i], len) < 0) {
+        fprintf(stderr, "eiger2cbf error: lost the output of a job\n");
+        close(fds[job]);
+        fds[job] = -1;
+        nopen--;
+        continue;
+      }
+      lens[i] = len;
+      status[i] = ret < 0 ? -1 : 1;
+      // print whatever is now complete, in input order
+      while (next_out < nfiles && status[next_out] != 0) {
+        fwrite(records[next_out], 1, lens[next_out], stdout);
+        free(records[next_out]);
+        records[next_out] = NULL;
+        next_out++;
+      }
     }
-    if (countrate_cutoff >= 0) {
-      if (!ex_pixel_max) fprintf(stdout,"%spixel_max %d%s",param_prologue,countrate_cutoff,param_epilogue);
-    } else if (verbose) {
-      if (!ex_pixel_max) fprintf(stdout,"%spixel_max %s%s",param_prologue,"unknown_pixel_max",param_epilogue);
+  }
+  // a job that died leaves a gap; print what follows it all the same
+  for (; next_out < nfiles; next_out++) {
+    if (status[next_out] != 0) fwrite(records[next_out], 1, lens[next_out], stdout);
+    else if (opt->format == PARAMS_FORMAT_BINARY) write_params_binary_unread(stdout, files[next_out]);
+  }
+  for (job = 0; job < njobs; job++) {
+    int wstatus;
+    if (waitpid(pids[job], &wstatus, 0) < 0) continue;
+    if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) continue;
+    if (WIFSIGNALED(wstatus)) {
+      fprintf(stderr, "eiger2cbf error: job %d died with signal %d", job, WTERMSIG(wstatus));
+    } else {
+      fprintf(stderr, "eiger2cbf error: job %d exited with status %d", job, WEXITSTATUS(wstatus));
     }
+    if (current[job] >= 0) fprintf(stderr, " while reading %s", files[current[job]]);
+    fprintf(stderr, "\n");
+  }
+  while (wait(NULL) > 0);
 
-    beamx=new_beam_cent?nbeamx:beamx;
-    beamy=new_beam_cent?nbeamy:beamy;
-    if (beamx > -9999999. && beamy > -9999999.) {
-      if (!ex_ix_min) fprintf(stdout,"%six_min %.0f%s",param_prologue,beamx-50.,param_epilogue);
-      if (!ex_ix_max) fprintf(stdout,"%six_max %.0f%s",param_prologue,beamx+50.,param_epilogue);
-      if (!ex_iy_min) fprintf(stdout,"%siy_min %.0f%s",param_prologue,beamy-50.,param_epilogue);
-      if (!ex_iy_max) fprintf(stdout,"%siy_max %.0f%s",param_prologue,beamy+50.,param_epilogue);
-      if (!ex_orgx) fprintf(stdout,"%sorgx %f%s",param_prologue,beamx,param_epilogue);
-      if (!ex_orgy) fprintf(stdout,"%sorgy %f%s",param_prologue,beamy,param_epilogue);
-    } else if (verbose) {
-      if (!ex_ix_min) fprintf(stdout,"%six_min %s%s",param_prologue,"unknown_ix_min",param_epilogue);
-      if (!ex_ix_max) fprintf(stdout,"%six_max %s%s",param_prologue,"unknown_ix_max",param_epilogue);
-      if (!ex_iy_min) fprintf(stdout,"%siy_min %s%s",param_prologue,"unknown_iy_min",param_epilogue);
-      if (!ex_iy_max) fprintf(stdout,"%siy_max %s%s",param_prologue,"unknown_iy_max",param_epilogue);
-      if (!ex_orgx) fprintf(stdout,"%sorgx %s%s",param_prologue,"unknown_orgx",param_epilogue);
-      if (!ex_orgy) fprintf(stdout,"%sorgy %s%s",param_prologue,"unknown_orgy",param_epilogue); 
-    }
-    if (osc_width >= 0.) {
-      if (!ex_oscillation_range) fprintf(stdout,"%soscillation_range %f%s",param_prologue,osc_width,param_epilogue);
-    } else if (verbose) {
-      if (!ex_oscillation_range)fprintf(stdout,"%soscillation_range %s%s",param_prologue,"unknown_oscillation_range",param_epilogue);
+  for (i = 0; i < nfiles; i++) {
+    if (status[i] <= 0) {
+      fprintf(stderr, "eiger2cbf error: no parameters for %s\n", files[i]);
+      failed++;
     }
-    if (nimages > 0 && angles[0] > -9999.) {
-      if (!ex_image_step) fprintf(stdout,"%simage_step %.0f%s",param_prologue,angles[1]-angles[0],param_epilogue);
-    } else if (verbose) {
-      if (!ex_image_step) fprintf(stdout,"%simage_step %s%s",param_prologue,"unknown_image_step",param_epilogue);
-    }
-    if (angles[0] > -9999.) {
-      if (!ex_starting_angle) fprintf(stdout,"%sstarting_angle %f%s",param_prologue,angles[0],param_epilogue);
-    } else {
-      if (!ex_starting_angle) fprintf(stdout,"%sstarting_angle %s%s",param_prologue,"unknown_starting_angle",param_epilogue);
+    free(records[i]);
+  }
+  munmap(next_file, map_size);
+  free(pids);
+  free(fds);
+  free(pfds);
+  free(records);
+  free(lens);
+  free(status);
+  return failed ? -1 : 0;
+}
+#endif
+
+int run_batch(char **files, int nfiles, int njobs, struct ParamsOptions *opt, int dozor_cli) {
+  int i, failed = 0;
+#ifndef _WIN32
+  if (njobs > nfiles) njobs = nfiles;
+  if (njobs > 1) return run_batch_jobs(files, nfiles, njobs, opt, dozor_cli);
+#endif
+  for (i = 0; i < nfiles; i++) {
+    if (write_record(files[i], stdout, opt, dozor_cli) < 0) {
+      fprintf(stderr, "eiger2cbf error: no parameters for %s\n", files[i]);
+      failed++;
     }
-    if (nimages > 0) {
-      if (!ex_first_image_number) fprintf(stdout,"%sfirst_image_number %d%s",param_prologue,1,param_epilogue);
-      if (!ex_number_images) fprintf(stdout,"%snumber_images %d%s",param_prologue,nimages,param_epilogue);
-    } else if (verbose) {
-      if (!ex_first_image_number) fprintf(stdout,"%sfirst_image_number %s%s",param_prologue,"unknown_first_image_number",param_epilogue);
-      if (!ex_number_images) fprintf(stdout,"%snumber_images %s%s",param_prologue,"unknown_number_images",param_epilogue);
+  }
+  return failed ? -1 : 0;
+}
+
+/* Master file names, one per line, from stream. */
+char **read_file_list(FILE *stream, int *nfiles) {
+  char **files = NULL;
+  char *cline;
+  size_t cline_len;
+  int nalloc = 0;
+  *nfiles = 0;
+  while ((cline = fgetln(stream, &cline_len))) {
+    while (cline_len > 0 && (cline[cline_len - 1] == '\n' || cline[cline_len - 1] == '\r')) cline_len--;
+    if (cline_len == 0) continue;
+    if (*nfiles == nalloc) {
+      nalloc = nalloc ? 2 * nalloc : 256;
+      files = (char**)realloc(files, sizeof(char*) * nalloc);
+      if (files == NULL) return NULL;
     }
-   
-    if (!ex_name_template_image) fprintf(stdout,"%sname_template_image %s%s",param_prologue,argv[1+optcount],param_epilogue);
+    files[*nfiles] = (char*)malloc(cline_len + 1);
+    memcpy(files[*nfiles], cline, cline_len);
+    files[*nfiles][cline_len] = '\0';
+    (*nfiles)++;
+  }
+  return files;
+}
+
+int main(int argc, char **argv) {
+  struct ParamsOptions opt = {0};
+  int usage_printed = 0;
+  int optcount = 0;      /* count of command line options */
+  int dozor_cli = 0;     /* flag for dozor cli options output */
+  int njobs = 1;         /* --jobs */
+  char * dozor_exclude=NULL;
+  FILE * dozor_exclude_stream=NULL;
+  int ii, ret;
+  char* endptr;
+  char* fndptr;
+
+  opt.nbeamx = opt.nbeamy = -10000000.;
+  opt.nnimages = -1L;
+  opt.param_prologue = "";
+  opt.param_epilogue = "\n";
+  opt.meta_cache = getenv("EIGER2CBF_META_CACHE");
 
+  for (ii=1; ii < argc; ii++) {
+    if (!strcmp(argv[ii],"-h") || !strcmp(argv[ii],"--help")) {
+      usage (argc, argv);
+      optcount ++;
+      usage_printed ++;
+    } else if (!strcmp(argv[ii],"-v") || !strcmp(argv[ii],"--verbose")) {
+      fprintf(stderr, "EIGER HDF5 to PARAMETERS converter (version 170711)\n");
+      fprintf(stderr, " derived by Herbert J. Bernstein, yayahjb@gmail.com from\n");
+      fprintf(stderr, "EIGER HDF5 to CBF converter (version 160929)\n");
+      fprintf(stderr, " written by Takanori Nakane\n");
+      fprintf(stderr, " see https://github.com/biochem-fan/eiger2cbf for details.\n\n");
+      opt.verbose = 1;
+      optcount ++;
+    } else if (!strcmp(argv[ii],"--beam-center")) {
+      opt.new_beam_cent = 1;
+      optcount ++;
+      if (ii  < argc-1) {
+        ii++;
+        optcount ++;
+        opt.nbeamx=strtod(argv[ii],&endptr);
+        if (!endptr || endptr==argv[ii] || *endptr!=',') {
+          opt.new_beam_cent = 0;
+          fprintf(stderr, "eiger2cbf error:  --beam-center provided without two comma-separated values; ignored\n");
+          usage(argc, argv);
+          usage_printed  ++;
+        } else {
+          endptr++;
+          opt.nbeamy=strtod(endptr,&fndptr);
+          if (!fndptr || fndptr==endptr|| *fndptr!='\0') {
+              opt.new_beam_cent = 0;
+              fprintf(stderr, "eiger2cbf error:  --beam-center provided without two comma-separated values; ignored\n");
+              usage(argc, argv);
+              usage_printed  ++;         }
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --beam-center provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+        opt.new_beam_cent = 0;
+      }
+    } else if (!strcmp(argv[ii],"--exclude")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        dozor_exclude =  argv[ii];
+        dozor_exclude_stream = fopen(dozor_exclude,"r");
+        if (!dozor_exclude_stream) dozor_exclude=NULL;
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --exclude provided without a file name ignored\n");
+        dozor_exclude = NULL;
+        dozor_exclude_stream = NULL;
+      }
+    } else if (!strcmp(argv[ii],"--nimages")) {
+      opt.new_nimages = 1;
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        opt.nnimages=strtol(argv[ii],&endptr,10);
+        if (!endptr || endptr==argv[ii]) {
+          opt.new_nimages = 0;
+          fprintf(stderr, "eiger2cbf error: --nimages invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --nimages provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+        opt.new_nimages = 0;
+      }
+    } else if (!strcmp(argv[ii],"--batch")) {
+      opt.batch = 1;
+      optcount++;
+    } else if (!strcmp(argv[ii],"--jobs")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        njobs=strtol(argv[ii],&endptr,10);
+        if (!endptr || endptr==argv[ii] || *endptr!='\0' || njobs < 1) {
+          njobs = 1;
+          fprintf(stderr, "eiger2cbf error: --jobs invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --jobs provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--meta-cache")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++;
+        optcount ++;
+        opt.meta_cache = argv[ii];
+      } else {
+        fprintf(stderr, "eiger2cbf error:  --meta-cache provided without a value; ignored\n");
+        usage(argc, argv);
+        usage_printed  ++;
+      }
+    } else if (!strcmp(argv[ii],"--json")) {
+      opt.format = PARAMS_FORMAT_JSON;
+      dozor_cli = 0;
+      optcount++;
+    } else if (!strcmp(argv[ii],"--binary")) {
+      opt.format = PARAMS_FORMAT_BINARY;
+      dozor_cli = 0;
+      optcount++;
+    } else if (!strcmp(argv[ii],"--dozor-dat")) {
+      opt.format = PARAMS_FORMAT_DOZOR;
+      opt.dozor_dat = 1;
+      dozor_cli = 0;
+      opt.param_prologue = "";
+      opt.param_epilogue = "\n";
+      optcount++;
+    } else if (!strcmp(argv[ii],"--dozor-cli")) {
+      opt.format = PARAMS_FORMAT_DOZOR;
+      opt.dozor_dat = 0;
+      dozor_cli = 1;
+      opt.param_prologue = "--";
+      opt.param_epilogue = "  ";  
+      optcount++;
+    } else break;
   }
 
-  H5Gclose(group);
-  H5Fclose(hdf);
+  if (opt.batch) {
+    if (usage_printed && argc-optcount <= 1) return -1;
+  } else if (argc-optcount <= 1 || argc-optcount  >= 3) {
+    if (usage_printed == 0) usage (argc, argv); 
+    return -1;
+  }
+
+  register_filters();
+
+  if (opt.dozor_dat == 0 && dozor_cli == 0) opt.dozor_dat = 1;
+
+  if (dozor_exclude_stream) {
+    read_exclude(dozor_exclude_stream, &opt);
+    fclose(dozor_exclude_stream);
+  }
+
+  if (opt.batch) {
+    char **files = argv + 1 + optcount;
+    int nfiles = argc - 1 - optcount;
+    if (nfiles == 0 || (nfiles == 1 && !strcmp(files[0], "-"))) {
+      files = read_file_list(stdin, &nfiles);
+      if (files == NULL) {
+        fprintf(stderr, "eiger2cbf error: no master files given\n");
+        return -1;
+      }
+    }
+    ret = run_batch(files, nfiles, njobs, &opt, dozor_cli);
+    if (opt.verbose) fprintf(stderr, "\nAll done!\n");
+    return ret;
+  }
 
-  free(angles);
+  if (write_params(argv[1+optcount], stdout, &opt) < 0) return -1;
 
-  if (verbose) fprintf(stderr, "\nAll done!\n");
+  if (opt.verbose) fprintf(stderr, "\nAll done!\n");
 
   return 0;
 }
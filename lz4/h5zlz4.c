@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "lz4.h"
 #include <H5PLextern.h>
 //#include <netinet/in.h>
@@ -34,17 +35,139 @@
 
 #define DEFAULT_BLOCK_SIZE 1<<30; /* 1GB. LZ4 needs blocks < 1.9GB. */
 
+/* Chunks with several blocks are decoded in two phases: the block size
+   headers are walked once to find where each block starts, then the blocks
+   are decompressed by a pool of LZ4_NTHREADS worker threads. The default
+   is 1, the serial decoder: the tools that use the filter already run one
+   process per CPU with --nproc, eiger2cbf_par or the XDS plugin, and a
+   thread per CPU in each of them would oversubscribe the machine. Set
+   LZ4_NTHREADS for a single process decoding large chunks. */
+#define MAX_DECODE_THREADS 32
+#define MIN_PARALLEL_BYTES (1<<20) /* not worth starting threads below 1MB */
+
+typedef struct {
+  const char *src;          /* start of the compressed block */
+  char *dst;                /* where the block decompresses to */
+  uint32_t compressedSize;
+  uint32_t blockSize;
+} lz4_block_t;
+
+typedef struct {
+  lz4_block_t *blocks;
+  size_t nBlocks;
+  size_t next;              /* next block to hand out, under lock */
+  int failed;
+  pthread_mutex_t lock;
+} lz4_decode_job_t;
+
+static int lz4_decode_block(const lz4_block_t *b)
+{
+  if(b->compressedSize == b->blockSize) /* there was no compression */
+    {
+      memcpy(b->dst, b->src, b->blockSize);
+      return 0;
+    }
+  int decompressedBytes = LZ4_decompress_safe(b->src, b->dst, b->compressedSize, b->blockSize);
+  if(decompressedBytes != (int)b->blockSize)
+    {
+      fprintf(stderr, "decompressed size not the same: %d, != %d\n", decompressedBytes, b->blockSize);
+      return -1;
+    }
+  return 0;
+}
+
+static void *lz4_decode_worker(void *arg)
+{
+  lz4_decode_job_t *job = (lz4_decode_job_t *)arg;
+  for(;;)
+    {
+      pthread_mutex_lock(&job->lock);
+      size_t i = job->next++;
+      int failed = job->failed;
+      pthread_mutex_unlock(&job->lock);
+      if(failed || i >= job->nBlocks)
+	break;
+      if(lz4_decode_block(&job->blocks[i]) < 0)
+	{
+	  pthread_mutex_lock(&job->lock);
+	  job->failed = 1;
+	  pthread_mutex_unlock(&job->lock);
+	}
+    }
+  return NULL;
+}
+
+static int lz4_decode_threads(void)
+{
+  static int nthreads = 0;
+  if(nthreads > 0)
+    return nthreads;
+  char *env_nthreads = getenv("LZ4_NTHREADS"); // Do not free!
+  int n = 1;
+  if(env_nthreads != NULL)
+    n = atoi(env_nthreads);
+  if(n < 1)
+    n = 1;
+  if(n > MAX_DECODE_THREADS)
+    n = MAX_DECODE_THREADS;
+  nthreads = n;
+  return nthreads;
+}
+
+/* Decompress all blocks, in parallel when that pays off. Returns 0 on success. */
+static int lz4_decode_blocks(lz4_block_t *blocks, size_t nBlocks, uint64_t origSize)
+{
+  int nthreads = lz4_decode_threads();
+  if((size_t)nthreads > nBlocks)
+    nthreads = (int)nBlocks;
+  if(nthreads < 2 || origSize < MIN_PARALLEL_BYTES)
+    {
+      for(size_t i = 0; i < nBlocks; i++)
+	if(lz4_decode_block(&blocks[i]) < 0)
+	  return -1;
+      return 0;
+    }
+
+  lz4_decode_job_t job;
+  pthread_t threads[MAX_DECODE_THREADS];
+  int started = 0;
+  job.blocks = blocks;
+  job.nBlocks = nBlocks;
+  job.next = 0;
+  job.failed = 0;
+  pthread_mutex_init(&job.lock, NULL);
+
+  /* the calling thread is one of the workers */
+  for(int t = 0; t < nthreads - 1; t++)
+    {
+      if(pthread_create(&threads[started], NULL, lz4_decode_worker, &job) != 0)
+	break; /* carry on with the threads we have */
+      started++;
+    }
+  lz4_decode_worker(&job);
+  for(int t = 0; t < started; t++)
+    pthread_join(threads[t], NULL);
+
+  pthread_mutex_destroy(&job.lock);
+  return job.failed ? -1 : 0;
+}
+
 static size_t lz4_filter(unsigned int flags, size_t cd_nelmts,  
 			 const unsigned int cd_values[], size_t nbytes,
 			 size_t *buf_size, void **buf)
 {
   void * outBuf = NULL;
+  lz4_block_t * blocks = NULL;
   size_t ret_value;
   
   if (flags & H5Z_FLAG_REVERSE)
     {
       const char* rpos = (char*)*buf; /* pointer to current read position */
-
+      if(nbytes < 12)
+	{
+	  fprintf(stderr, "lz4 chunk too short for its header\n");
+	  goto error;
+	}
       
       const uint64_t * const i64Buf = (uint64_t *) rpos;
       const uint64_t origSize = (uint64_t)(be64toht(*i64Buf));/* is saved in be format */
@@ -58,38 +181,55 @@ static size_t lz4_filter(unsigned int flags, size_t cd_nelmts,
       
       if (NULL==(outBuf = malloc(origSize)))
 	{
-	  printf("cannot malloc\n");
+	  fprintf(stderr, "cannot malloc\n");
+	  goto error;
+	}
+      const char *rend = (char*)*buf + nbytes; /* end of the compressed chunk */
+      if(blockSize == 0 && origSize > 0)
+	{
+	  fprintf(stderr, "invalid lz4 chunk header\n");
+	  goto error;
+	}
+      size_t nBlocks = blockSize ? (origSize + blockSize - 1) / blockSize : 0;
+      if (NULL==(blocks = malloc((nBlocks ? nBlocks : 1) * sizeof(lz4_block_t))))
+	{
+	  fprintf(stderr, "cannot malloc\n");
 	  goto error;
 	}
       char *roBuf = (char*)outBuf;   /* pointer to current write position */      
       uint64_t decompSize     = 0;
-      /// start with the first block ///
-           while(decompSize < origSize)
+      /// phase 1: walk the block headers to locate every block ///
+      for(size_t block = 0; block < nBlocks; ++block)
 	{
-
 	  if(origSize-decompSize < blockSize) /* the last block can be smaller than blockSize. */
 	    blockSize = origSize-decompSize;
+	  if(rend - rpos < 4)
+	    {
+	      fprintf(stderr, "lz4 chunk truncated at block %zu\n", block);
+	      goto error;
+	    }
 	  i32Buf = (uint32_t*)rpos;
 	  uint32_t compressedBlockSize =  be32toht(*i32Buf);  /// is saved in be format
 	  rpos += 4;
-	  if(compressedBlockSize == blockSize) /* there was no compression */
-	    {
-	      memcpy(roBuf, rpos, blockSize);
-	    }
-	  else /* do the decompression */
+	  if(compressedBlockSize > (size_t)(rend - rpos))
 	    {
-	      int compressedBytes = LZ4_uncompress(rpos, roBuf, blockSize); 
-	      if(compressedBytes != compressedBlockSize)
-		{
-		  printf("decompressed size not the same: %d, != %d\n", compressedBytes, compressedBlockSize);
-		  goto error;
-		}
+	      fprintf(stderr, "lz4 block %zu overruns the chunk\n", block);
+	      goto error;
 	    }
+	  blocks[block].src = rpos;
+	  blocks[block].dst = roBuf;
+	  blocks[block].compressedSize = compressedBlockSize;
+	  blocks[block].blockSize = blockSize;
 	  
 	  rpos += compressedBlockSize;   /* advance the read pointer to the next block */
 	  roBuf += blockSize;            /* advance the write pointer */
 	  decompSize += blockSize;
 	}
+      /// phase 2: decompress the blocks ///
+      if(lz4_decode_blocks(blocks, nBlocks, origSize) < 0)
+	goto error;
+      free(blocks);
+      blocks = NULL;
       free(*buf);
       *buf = outBuf;
       outBuf = NULL;
@@ -143,10 +283,9 @@ static size_t lz4_filter(unsigned int flags, size_t cd_nelmts,
 	  if(nbytes - origWritten < blockSize) /* the last block may be < blockSize */
 	    blockSize = nbytes - origWritten;
 	  
-	  uint32_t compBlockSize = LZ4_compress(rpos, roBuf+4, blockSize); /// reserve space for compBlockSize
-	  if(!compBlockSize)
-	    goto error;
-	  if(compBlockSize >= blockSize) /* compression did not save any space, do a memcpy instead */
+	  /* limit the output to blockSize-1 so that LZ4 gives up early on incompressible blocks */
+	  uint32_t compBlockSize = LZ4_compress_default(rpos, roBuf+4, blockSize, blockSize-1); /// reserve space for compBlockSize
+	  if(!compBlockSize || compBlockSize >= blockSize) /* compression did not save any space, do a memcpy instead */
 	    {
 	      compBlockSize = blockSize;
 	      memcpy(roBuf+4, rpos, blockSize);
@@ -175,6 +314,8 @@ static size_t lz4_filter(unsigned int flags, size_t cd_nelmts,
   
   
  error:
+  if(blocks)
+    free(blocks);
   if(outBuf)
     free(outBuf);
   outBuf = NULL;
@@ -129,6 +129,21 @@ LZ4_compress_limitedOutput() :
 int LZ4_compress_limitedOutput (const char* source, char* dest, int sourceSize, int maxOutputSize);
 
 
+/*
+LZ4_compress_default() :
+    Same as LZ4_compress_limitedOutput(), under the name used by current LZ4 releases.
+    If maxOutputSize >= LZ4_compressBound(sourceSize), compression is guaranteed to succeed.
+
+LZ4_compress_fast() :
+    Same as LZ4_compress_default(), with an "acceleration" factor.
+    The larger the acceleration value, the faster the algorithm, but also the lesser the compression.
+    An acceleration value of 1 gives the same output as LZ4_compress_default().
+    Values <= 0 are replaced by the default (1).
+*/
+int LZ4_compress_default (const char* source, char* dest, int sourceSize, int maxOutputSize);
+int LZ4_compress_fast    (const char* source, char* dest, int sourceSize, int maxOutputSize, int acceleration);
+
+
 /*
 LZ4_compress_withState() :
     Same compression functions, but using an externally allocated memory space to store compression state.
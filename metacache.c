@@ -0,0 +1,639 @@
+/* metacache.c -- metadata cache for repeat opens of a master file
+
+   See metacache.h. A cache file is a header followed by one record per
+   HDF5 read, in host byte order (a cache is not meant to move between
+   machines; the byte order mark makes a foreign one read as stale):
+
+     char     magic[4]  "E2MC"
+     uint32   version, byte order mark 0x01020304, number of records
+     uint64   device, inode, size, mtime seconds, mtime nanoseconds
+   and for each record
+     uint32   type
+     int32    status    what the read returned; < 0 if it failed
+     uint32   length of the HDF5 path
+     uint64   n         number of values
+     uint64   total     elements in the dataset, for masks
+     char     path[length]
+     values   n values of the size for the type; a mask is stored as n
+              (int32 index, int32 value) pairs of its non-zero pixels
+
+   Reads that miss the cache (or all reads, with caching off) first consult
+   a link index of /entry, built by one H5Lvisit on the first such read.
+   A path under /entry that is not in the index, while every group on the
+   way to it is, does not exist, so the read fails at once instead of
+   walking the path in HDF5 and unwinding the error stack; this is what
+   the fallback chains of the tools mostly consist of. Likewise
+   metacache_find_dataset is answered from the index alone. Paths going through
+   a soft or external link, or through a group reachable by more than one
+   hard link (H5Lvisit lists its members only once), are left to HDF5.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hdf5.h"
+#include "hdf5_hl.h"
+#include "metacache.h"
+
+#define METACACHE_VERSION 2
+#define METACACHE_ORDER 0x01020304
+
+enum {
+  MC_INT = 1, MC_FLOAT, MC_DOUBLE, MC_STRING, MC_FIND, MC_DIMS, MC_DOUBLES, MC_MASK
+};
+
+struct metacache_link {
+  char *name;                 /* absolute HDF5 path */
+  int plain;                  /* hard link, and the only one to its object */
+  unsigned char addr[16];     /* object address (token in HDF5 >= 1.12) */
+};
+
+struct metacache_entry {
+  char *name;       /* absolute HDF5 path */
+  int type;
+  int status;
+  size_t n, total;
+  void *data;
+};
+
+static size_t value_size(int type) {
+  switch (type) {
+  case MC_INT: case MC_FLOAT: return 4;
+  case MC_DOUBLE: case MC_DIMS: case MC_DOUBLES: case MC_MASK: return 8;
+  case MC_STRING: return 1;
+  default: return 0;
+  }
+}
+
+static int enabled(const metacache *mc) {
+  return mc != NULL && mc->path[0] != '\0';
+}
+
+/* name as an absolute path, for the cache key. Returns -1 if that does not
+   fit in out; such names are read without the cache. */
+static int full_name(hid_t loc, const char *name, char *out, size_t size) {
+  char group[4096];
+  int len;
+  if (name[0] == '/' || H5Iget_name(loc, group, sizeof(group)) <= 0) {
+    len = snprintf(out, size, "%s", name);
+  } else {
+    len = snprintf(out, size, "%s/%s", strcmp(group, "/") ? group : "", name);
+  }
+  return (len < 0 || (size_t)len >= size) ? -1 : 0;
+}
+
+static int compare_link_names(const void *a, const void *b) {
+  return strcmp(((const metacache_link*)a)->name, ((const metacache_link*)b)->name);
+}
+
+static int compare_link_addrs(const void *a, const void *b) {
+  return memcmp(((const metacache_link*)a)->addr, ((const metacache_link*)b)->addr, 16);
+}
+
+#if H5_VERSION_GE(1,12,0)
+static herr_t index_link(hid_t group, const char *name, const H5L_info2_t *info, void *op_data) {
+#else
+static herr_t index_link(hid_t group, const char *name, const H5L_info_t *info, void *op_data) {
+#endif
+  metacache *mc = (metacache*)op_data;
+  metacache_link *l;
+
+  (void)group;
+  if (mc->nlinks == mc->links_cap) {
+    size_t cap = mc->links_cap ? 2 * mc->links_cap : 256;
+    l = (metacache_link*)realloc(mc->links, cap * sizeof(metacache_link));
+    if (l == NULL) return -1;
+    mc->links = l;
+    mc->links_cap = cap;
+  }
+  l = &mc->links[mc->nlinks];
+  l->name = (char*)malloc(strlen(name) + 8);
+  if (l->name == NULL) return -1;
+  sprintf(l->name, "/entry/%s", name);
+  l->plain = info->type == H5L_TYPE_HARD;
+  memset(l->addr, 0, sizeof(l->addr));
+  if (l->plain) {
+#if H5_VERSION_GE(1,12,0)
+    memcpy(l->addr, &info->u.token, sizeof(info->u.token) < sizeof(l->addr) ? sizeof(info->u.token) : sizeof(l->addr));
+#else
+    memcpy(l->addr, &info->u.address, sizeof(info->u.address));
+#endif
+  }
+  mc->nlinks++;
+  return 0;
+}
+
+static void free_index(metacache *mc) {
+  size_t i;
+  for (i = 0; i < mc->nlinks; i++) free(mc->links[i].name);
+  free(mc->links);
+  mc->links = NULL;
+  mc->nlinks = mc->links_cap = 0;
+}
+
+static void build_index(metacache *mc, hid_t loc) {
+  hid_t entry;
+  herr_t ret;
+  size_t i, j;
+
+  mc->indexed = -1;
+  entry = H5Gopen2(loc, "/entry", H5P_DEFAULT);
+  if (entry < 0) return;
+#if H5_VERSION_GE(1,12,0)
+  ret = H5Lvisit2(entry, H5_INDEX_NAME, H5_ITER_NATIVE, index_link, mc);
+#else
+  ret = H5Lvisit(entry, H5_INDEX_NAME, H5_ITER_NATIVE, index_link, mc);
+#endif
+  H5Gclose(entry);
+  if (ret < 0) {
+    free_index(mc);
+    return;
+  }
+  // objects with more than one hard link
+  qsort(mc->links, mc->nlinks, sizeof(metacache_link), compare_link_addrs);
+  for (i = 0; i < mc->nlinks; i = j) {
+    for (j = i + 1; j < mc->nlinks && !compare_link_addrs(&mc->links[i], &mc->links[j]); j++);
+    if (j - i > 1 && mc->links[i].plain) {
+      while (i < j) mc->links[i++].plain = 0;
+    }
+  }
+  qsort(mc->links, mc->nlinks, sizeof(metacache_link), compare_link_names);
+  mc->indexed = 1;
+}
+
+static metacache_link *find_link(metacache *mc, const char *name) {
+  metacache_link l;
+  l.name = (char*)name;
+  return (metacache_link*)bsearch(&l, mc->links, mc->nlinks, sizeof(metacache_link), compare_link_names);
+}
+
+/* Look the absolute path name up in the link index: 1 if the link
+   exists, 0 if it does not, -1 if the index cannot tell. */
+static int indexed_link(metacache *mc, hid_t loc, const char *name) {
+  char prefix[4096];
+  const char *p;
+  metacache_link *l;
+
+  if (mc == NULL || !mc->resolve || strncmp(name, "/entry/", 7) != 0) return -1;
+  if (strstr(name, "//") || strstr(name, "/.") || name[strlen(name) - 1] == '/') return -1;
+  if (mc->indexed == 0) build_index(mc, loc);
+  if (mc->indexed < 0) return -1;
+  for (p = strchr(name + 7, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    if ((size_t)(p - name) >= sizeof(prefix)) return -1;
+    memcpy(prefix, name, p - name);
+    prefix[p - name] = '\0';
+    if ((l = find_link(mc, prefix)) == NULL) return 0;
+    if (!l->plain) return -1;
+  }
+  return find_link(mc, name) != NULL;
+}
+
+static int absent(metacache *mc, hid_t loc, const char *name) {
+  return indexed_link(mc, loc, name) == 0;
+}
+
+static metacache_entry *lookup(metacache *mc, int type, const char *name) {
+  size_t i;
+  for (i = 0; i < mc->count; i++) {
+    if (mc->entries[i].type == type && !strcmp(mc->entries[i].name, name)) return &mc->entries[i];
+  }
+  return NULL;
+}
+
+/* Record a read; data (n values) is copied. Failing to record only means
+   the value is read from HDF5 again next time. */
+static void record(metacache *mc, int type, const char *name, int status,
+                   size_t n, size_t total, const void *data) {
+  metacache_entry *e;
+  if (mc->count == mc->cap) {
+    size_t cap = mc->cap ? 2 * mc->cap : 32;
+    e = (metacache_entry*)realloc(mc->entries, cap * sizeof(metacache_entry));
+    if (e == NULL) return;
+    mc->entries = e;
+    mc->cap = cap;
+  }
+  e = &mc->entries[mc->count];
+  e->name = strdup(name);
+  e->data = n ? malloc(n * value_size(type)) : NULL;
+  if (e->name == NULL || (n && e->data == NULL)) {
+    free(e->name);
+    free(e->data);
+    return;
+  }
+  if (n) memcpy(e->data, data, n * value_size(type));
+  e->type = type;
+  e->status = status;
+  e->n = n;
+  e->total = total;
+  mc->count++;
+  mc->dirty = 1;
+}
+
+static void clear(metacache *mc) {
+  size_t i;
+  for (i = 0; i < mc->count; i++) {
+    free(mc->entries[i].name);
+    free(mc->entries[i].data);
+  }
+  mc->count = 0;
+}
+
+static int load(metacache *mc) {
+  FILE *fh;
+  unsigned char *buf = NULL, *p, *end;
+  long len;
+  uint32_t u[3], count, i;
+  uint64_t key[5];
+
+  fh = fopen(mc->path, "rb");
+  if (fh == NULL) return 1;
+  if (fseek(fh, 0, SEEK_END) == 0 && (len = ftell(fh)) > 0 && fseek(fh, 0, SEEK_SET) == 0) {
+    buf = (unsigned char*)malloc(len);
+    if (buf && fread(buf, 1, len, fh) != (size_t)len) {
+      free(buf);
+      buf = NULL;
+    }
+  }
+  fclose(fh);
+  if (buf == NULL) return 1;
+
+  p = buf;
+  end = buf + len;
+  if ((size_t)len < 4 + sizeof(u) + sizeof(key) || memcmp(p, "E2MC", 4)) goto stale;
+  memcpy(u, p + 4, sizeof(u));
+  memcpy(key, p + 4 + sizeof(u), sizeof(key));
+  p += 4 + sizeof(u) + sizeof(key);
+  if (u[0] != METACACHE_VERSION || u[1] != METACACHE_ORDER) goto stale;
+  for (i = 0; i < 5; i++) {
+    if (key[i] != mc->key[i]) goto stale;
+  }
+  count = u[2];
+  for (i = 0; i < count; i++) {
+    uint32_t type, namelen;
+    int32_t status;
+    uint64_t n, total;
+    char name[4096];
+    if ((size_t)(end - p) < 12 + 16) goto stale;
+    memcpy(&type, p, 4);
+    memcpy(&status, p + 4, 4);
+    memcpy(&namelen, p + 8, 4);
+    memcpy(&n, p + 12, 8);
+    memcpy(&total, p + 20, 8);
+    p += 28;
+    if (value_size(type) == 0 && type != MC_FIND) goto stale;
+    if (namelen >= sizeof(name) || (size_t)(end - p) < namelen) goto stale;
+    memcpy(name, p, namelen);
+    name[namelen] = '\0';
+    p += namelen;
+    if (n > (uint64_t)(end - p) / (value_size(type) ? value_size(type) : 1)) goto stale;
+    record(mc, type, name, status, n, total, p);
+    p += n * value_size(type);
+  }
+  free(buf);
+  mc->dirty = 0;
+  return 0;
+
+ stale:
+  free(buf);
+  clear(mc);
+  return 1;
+}
+
+int metacache_open(metacache *mc, const char *dir, const char *master) {
+  struct stat st;
+
+  memset(mc, 0, sizeof(*mc));
+  mc->resolve = 1;
+  if (dir == NULL || dir[0] == '\0' || stat(master, &st) != 0) return 1;
+  mc->key[0] = st.st_dev;
+  mc->key[1] = st.st_ino;
+  mc->key[2] = st.st_size;
+  mc->key[3] = st.st_mtime;
+  // nanoseconds where struct stat has them; 0 (seconds only) elsewhere
+#if defined(__APPLE__)
+  mc->key[4] = st.st_mtimespec.tv_nsec;
+#elif defined(st_mtime) && !defined(_WIN32)
+  // st_mtime is a macro for st_mtim.tv_sec wherever st_mtim exists
+  mc->key[4] = st.st_mtim.tv_nsec;
+#endif
+  snprintf(mc->path, sizeof(mc->path), "%s/%llx_%llx.e2cmeta", dir,
+           (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+  return load(mc);
+}
+
+herr_t metacache_read_int(metacache *mc, hid_t loc, const char *name, int *value) {
+  char key[4096];
+  metacache_entry *e;
+  herr_t ret;
+
+  if (full_name(loc, name, key, sizeof(key)) < 0) mc = NULL;
+  if (enabled(mc) && (e = lookup(mc, MC_INT, key)) != NULL) {
+    if (e->status >= 0) memcpy(value, e->data, sizeof(int));
+    return e->status;
+  }
+  ret = absent(mc, loc, key) ? -1 : H5LTread_dataset_int(loc, name, value);
+  if (enabled(mc)) record(mc, MC_INT, key, ret, ret >= 0, 0, value);
+  return ret;
+}
+
+herr_t metacache_read_float(metacache *mc, hid_t loc, const char *name, float *value) {
+  char key[4096];
+  metacache_entry *e;
+  herr_t ret;
+
+  if (full_name(loc, name, key, sizeof(key)) < 0) mc = NULL;
+  if (enabled(mc) && (e = lookup(mc, MC_FLOAT, key)) != NULL) {
+    if (e->status >= 0) memcpy(value, e->data, sizeof(float));
+    return e->status;
+  }
+  ret = absent(mc, loc, key) ? -1 : H5LTread_dataset_float(loc, name, value);
+  if (enabled(mc)) record(mc, MC_FLOAT, key, ret, ret >= 0, 0, value);
+  return ret;
+}
+
+herr_t metacache_read_double(metacache *mc, hid_t loc, const char *name, double *value) {
+  char key[4096];
+  metacache_entry *e;
+  herr_t ret;
+
+  if (full_name(loc, name, key, sizeof(key)) < 0) mc = NULL;
+  if (enabled(mc) && (e = lookup(mc, MC_DOUBLE, key)) != NULL) {
+    if (e->status >= 0) memcpy(value, e->data, sizeof(double));
+    return e->status;
+  }
+  ret = absent(mc, loc, key) ? -1 : H5LTread_dataset_double(loc, name, value);
+  if (enabled(mc)) record(mc, MC_DOUBLE, key, ret, ret >= 0, 0, value);
+  return ret;
+}
+
+herr_t metacache_read_string(metacache *mc, hid_t loc, const char *name, char *value, size_t size) {
+  char key[4096];
+  metacache_entry *e;
+  hsize_t dims[H5S_MAX_RANK];
+  H5T_class_t type_class;
+  size_t type_size;
+  char *buf;
+  herr_t ret = -1;
+
+  if (full_name(loc, name, key, sizeof(key)) < 0) mc = NULL;
+  if (enabled(mc) && (e = lookup(mc, MC_STRING, key)) != NULL) {
+    if (e->status >= 0) {
+      size_t len = e->n < size ? e->n : size - 1;
+      memcpy(value, e->data, len);
+      value[len] = '\0';
+    }
+    return e->status;
+  }
+  // read into a buffer of the stored size, so a long value cannot overrun
+  if (!absent(mc, loc, key) &&
+      H5LTget_dataset_info(loc, name, dims, &type_class, &type_size) >= 0 &&
+      (buf = (char*)calloc(type_size + 1, 1)) != NULL) {
+    ret = H5LTread_dataset_string(loc, name, buf);
+    if (ret >= 0) snprintf(value, size, "%s", buf);
+    free(buf);
+  }
+  if (enabled(mc)) record(mc, MC_STRING, key, ret, ret >= 0 ? strlen(value) : 0, 0, value);
+  return ret;
+}
+
+int metacache_find_dataset(metacache *mc, hid_t loc, const char *name) {
+  char key[4096];
+  metacache_entry *e;
+  int ret;
+
+  if (full_name(loc, name, key, sizeof(key)) < 0) mc = NULL;
+  if (enabled(mc) && (e = lookup(mc, MC_FIND, key)) != NULL) return e->status;
+  // H5LTfind_dataset only looks for a link of that name, as the index does
+  if ((ret = indexed_link(mc, loc, key)) < 0) ret = H5LTfind_dataset(loc, name);
+  if (enabled(mc)) record(mc, MC_FIND, key, ret, 0, 0, NULL);
+  return ret;
+}
+
+/* Non-zero if name is a hard link, i.e. a dataset in the master file
+   itself. Data blocks behind external links are written after the master
+   file, so what they hold now says nothing about a later open. */
+static int in_master(hid_t loc, const char *name) {
+#if H5_VERSION_GE(1,12,0)
+  H5L_info2_t info;
+#else
+  H5L_info_t info;
+#endif
+  return H5Lget_info(loc, name, &info, H5P_DEFAULT) >= 0 && info.type == H5L_TYPE_HARD;
+}
+
+int metacache_get_dims(metacache *mc, hid_t loc, const char *name, hsize_t dims[3]) {
+  char key[4096];
+  metacache_entry *e;
+  hid_t data, space;
+  hsize_t d[H5S_MAX_RANK];
+  int rank = -1, i;
+
+  if (full_name(loc, name, key, sizeof(key)) < 0) mc = NULL;
+  if (enabled(mc) && (e = lookup(mc, MC_DIMS, key)) != NULL) {
+    for (i = 0; i < (int)e->n; i++) dims[i] = ((uint64_t*)e->data)[i];
+    return e->status;
+  }
+  data = absent(mc, loc, key) ? -1 : H5Dopen2(loc, name, H5P_DEFAULT);
+  if (data >= 0) {
+    space = H5Dget_space(data);
+    if (space >= 0) {
+      rank = H5Sget_simple_extent_dims(space, d, NULL);
+      H5Sclose(space);
+    }
+    H5Dclose(data);
+  }
+  for (i = 0; i < rank && i < 3; i++) dims[i] = d[i];
+  // neither failures nor external data blocks are kept: both change while
+  // the master file does not
+  if (enabled(mc) && rank >= 0 && in_master(loc, name)) {
+    uint64_t v[3];
+    for (i = 0; i < rank && i < 3; i++) v[i] = d[i];
+    record(mc, MC_DIMS, key, rank, rank > 0 ? (rank < 3 ? rank : 3) : 0, 0, v);
+  }
+  return rank;
+}
+
+/* Read count values from start. 1-D datasets are read as a hyperslab;
+   scalars and arrays of higher rank are read whole and the values taken
+   in storage order. */
+static int read_hyperslab(hid_t loc, const char *name, hsize_t start, hsize_t count,
+                          double *values, hsize_t *extent) {
+  hid_t dset, space, memspace;
+  hssize_t n;
+  double *all;
+  int ret = -1;
+
+  dset = H5Dopen2(loc, name, H5P_DEFAULT);
+  if (dset < 0) return -1;
+  space = H5Dget_space(dset);
+  n = (space < 0) ? -1 : H5Sget_simple_extent_npoints(space);
+  if (n >= 0) {
+    *extent = n;
+    if (start >= (hsize_t)n) {
+      ret = 0;
+    } else {
+      if (count > n - start) count = n - start;
+      if (H5Sget_simple_extent_ndims(space) == 1) {
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, &start, NULL, &count, NULL);
+        memspace = H5Screate_simple(1, &count, NULL);
+        if (memspace >= 0 &&
+            H5Dread(dset, H5T_NATIVE_DOUBLE, memspace, space, H5P_DEFAULT, values) >= 0) {
+          ret = count;
+        }
+        if (memspace >= 0) H5Sclose(memspace);
+      } else if ((all = (double*)malloc(n * sizeof(double))) != NULL) {
+        if (H5Dread(dset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, all) >= 0) {
+          memcpy(values, all + start, count * sizeof(double));
+          ret = count;
+        }
+        free(all);
+      }
+    }
+  }
+  if (space >= 0) H5Sclose(space);
+  H5Dclose(dset);
+  return ret;
+}
+
+int metacache_read_doubles(metacache *mc, hid_t loc, const char *name, hsize_t start,
+                           hsize_t count, double *values, hsize_t *extent) {
+  char key[4096];
+  metacache_entry *e;
+
+  if (full_name(loc, name, key, sizeof(key)) < 0) mc = NULL;
+  e = enabled(mc) ? lookup(mc, MC_DOUBLES, key) : NULL;
+  if (e == NULL && absent(mc, loc, key)) {
+    if (enabled(mc)) record(mc, MC_DOUBLES, key, -1, 0, 0, NULL);
+    return -1;
+  }
+  if (!enabled(mc)) return read_hyperslab(loc, name, start, count, values, extent);
+  if (e == NULL) {
+    // the whole array goes into the cache, so later windows come from memory
+    hsize_t n = 0;
+    double *all;
+    int ret = -1;
+    hid_t dset = H5Dopen2(loc, name, H5P_DEFAULT), space;
+    if (dset >= 0) {
+      space = H5Dget_space(dset);
+      if (space >= 0) {
+        hssize_t points = H5Sget_simple_extent_npoints(space);
+        if (points >= 0) {
+          n = points;
+          ret = 0;
+        }
+        H5Sclose(space);
+      }
+      H5Dclose(dset);
+    }
+    if (ret < 0) {
+      record(mc, MC_DOUBLES, key, -1, 0, 0, NULL);
+    } else {
+      all = (double*)malloc((n ? n : 1) * sizeof(double));
+      if (all == NULL) return read_hyperslab(loc, name, start, count, values, extent);
+      ret = n ? read_hyperslab(loc, name, 0, n, all, &n) : 0;
+      if (ret == (int)n) record(mc, MC_DOUBLES, key, 0, n, 0, all);
+      free(all);
+      if (ret != (int)n) return read_hyperslab(loc, name, start, count, values, extent);
+    }
+    if ((e = lookup(mc, MC_DOUBLES, key)) == NULL) {
+      return read_hyperslab(loc, name, start, count, values, extent);
+    }
+  }
+  if (e->status < 0) return -1;
+  *extent = e->n;
+  if (start >= e->n) return 0;
+  if (count > e->n - start) count = e->n - start;
+  memcpy(values, (double*)e->data + start, count * sizeof(double));
+  return count;
+}
+
+herr_t metacache_read_mask(metacache *mc, hid_t loc, const char *name, int *mask, size_t n) {
+  char key[4096];
+  metacache_entry *e;
+  int32_t *pairs;
+  size_t i, k, nonzero = 0;
+  herr_t ret;
+
+  if (full_name(loc, name, key, sizeof(key)) < 0) mc = NULL;
+  if (!enabled(mc)) return absent(mc, loc, key) ? -1 : H5LTread_dataset_int(loc, name, mask);
+  e = lookup(mc, MC_MASK, key);
+  if (e != NULL && (e->status < 0 || e->total == n)) {
+    if (e->status < 0) return e->status;
+    memset(mask, 0, n * sizeof(int));
+    pairs = (int32_t*)e->data;
+    for (k = 0; k < e->n; k++) {
+      if (pairs[2 * k] >= 0 && (size_t)pairs[2 * k] < n) mask[pairs[2 * k]] = pairs[2 * k + 1];
+    }
+    return e->status;
+  }
+  ret = absent(mc, loc, key) ? -1 : H5LTread_dataset_int(loc, name, mask);
+  if (e != NULL) return ret; // recorded for a different image size
+  if (ret < 0) {
+    record(mc, MC_MASK, key, ret, 0, n, NULL);
+    return ret;
+  }
+  for (i = 0; i < n; i++) {
+    if (mask[i] != 0) nonzero++;
+  }
+  pairs = (int32_t*)malloc((nonzero ? nonzero : 1) * 2 * sizeof(int32_t));
+  if (pairs == NULL) return ret;
+  for (i = 0, k = 0; i < n; i++) {
+    if (mask[i] != 0) {
+      pairs[2 * k] = i;
+      pairs[2 * k + 1] = mask[i];
+      k++;
+    }
+  }
+  record(mc, MC_MASK, key, ret, nonzero, n, pairs);
+  free(pairs);
+  return ret;
+}
+
+int metacache_save(metacache *mc) {
+  char tmpname[4096 + 32];
+  uint32_t u[3] = {METACACHE_VERSION, METACACHE_ORDER, 0};
+  uint64_t key[5];
+  FILE *fh;
+  size_t i;
+  int failed = 0;
+
+  if (!enabled(mc) || !mc->dirty) return 0;
+  snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", mc->path, (int)getpid());
+  fh = fopen(tmpname, "wb");
+  if (fh == NULL) return -1;
+  u[2] = mc->count;
+  for (i = 0; i < 5; i++) key[i] = mc->key[i];
+  if (fwrite("E2MC", 1, 4, fh) != 4 || fwrite(u, sizeof(u), 1, fh) != 1 ||
+      fwrite(key, sizeof(key), 1, fh) != 1) failed = 1;
+  for (i = 0; i < mc->count && !failed; i++) {
+    metacache_entry *e = &mc->entries[i];
+    uint32_t type = e->type, namelen = strlen(e->name);
+    int32_t status = e->status;
+    uint64_t n = e->n, total = e->total;
+    if (fwrite(&type, 4, 1, fh) != 1 || fwrite(&status, 4, 1, fh) != 1 ||
+        fwrite(&namelen, 4, 1, fh) != 1 || fwrite(&n, 8, 1, fh) != 1 ||
+        fwrite(&total, 8, 1, fh) != 1 || fwrite(e->name, 1, namelen, fh) != namelen ||
+        (n && fwrite(e->data, value_size(e->type), n, fh) != n)) failed = 1;
+  }
+  if (fclose(fh) != 0) failed = 1;
+  if (failed || rename(tmpname, mc->path) != 0) {
+    remove(tmpname);
+    return -1;
+  }
+  mc->dirty = 0;
+  return 0;
+}
+
+void metacache_free(metacache *mc) {
+  clear(mc);
+  free_index(mc);
+  mc->indexed = 0;
+  free(mc->entries);
+  mc->entries = NULL;
+  mc->cap = 0;
+}
@@ -0,0 +1,89 @@
+/* metacache.h -- metadata cache for repeat opens of a master file
+
+   Every tool resolves the same metadata from a master file: header values
+   through a list of fallback paths, the data block layout, omega and the
+   pixel mask. Reading those through a metacache records each result, found
+   or not, and saves them to a compact binary file; a later open of the same
+   master file is then answered from that file without touching the HDF5
+   metadata at all. The fallback logic of the tools is unchanged, it simply
+   runs against the recorded answers.
+
+   The cache lives in a directory given by --meta-cache or the
+   EIGER2CBF_META_CACHE environment variable (which the XDS plugin and its
+   workers use). A master file's entry is DIR/<device>_<inode>.e2cmeta and
+   is only used while the master file's inode, size and mtime are the
+   ones recorded; otherwise it is rebuilt. With no directory every call
+   reads HDF5 directly, as before.
+
+   Whether cached or not, a read that has to go to HDF5 is first checked
+   against an index of the links under /entry, made by a single H5Lvisit
+   pass the first time it is needed. Paths the index shows to be absent,
+   which is what most steps of the fallback chains are, fail without an
+   HDF5 lookup.
+*/
+
+#ifndef METACACHE_H
+#define METACACHE_H
+
+#include <stddef.h>
+#include "hdf5.h"
+
+typedef struct metacache_entry metacache_entry;
+typedef struct metacache_link metacache_link;
+
+typedef struct {
+  char path[4096];                    /* cache file; empty when caching is off */
+  unsigned long long key[5];          /* device, inode, size, mtime (s, ns) */
+  metacache_entry *entries;
+  size_t count, cap;
+  int dirty;                          /* entries added since loading */
+  int resolve;                        /* answer absent paths from the link index;
+                                         set by metacache_open, clear it for a file
+                                         that is still being written */
+  int indexed;                        /* 0: index not built yet, 1: built, -1: unavailable */
+  metacache_link *links;              /* links under /entry, sorted by path */
+  size_t nlinks, links_cap;
+} metacache;
+
+/* Set up the cache of master in dir and load what is already recorded.
+   dir may be NULL or empty to disable caching; the link index is used
+   either way. Returns 0 if a valid cache was loaded, 1 if not (off,
+   missing or stale). */
+int metacache_open(metacache *mc, const char *dir, const char *master);
+
+/* Drop-in replacements for H5LTread_dataset_{int,float,double,string}.
+   A relative name is taken relative to loc. Return < 0 if the dataset is
+   absent or unreadable, as HDF5 does. value is left alone in that case. */
+herr_t metacache_read_int(metacache *mc, hid_t loc, const char *name, int *value);
+herr_t metacache_read_float(metacache *mc, hid_t loc, const char *name, float *value);
+herr_t metacache_read_double(metacache *mc, hid_t loc, const char *name, double *value);
+herr_t metacache_read_string(metacache *mc, hid_t loc, const char *name, char *value, size_t size);
+
+/* H5LTfind_dataset: non-zero if name is a link in the group loc. */
+int metacache_find_dataset(metacache *mc, hid_t loc, const char *name);
+
+/* The rank and dimensions (up to 3) of a dataset. Returns the rank, or -1
+   if it cannot be opened. Only datasets stored in the master file itself
+   are cached; data blocks behind external links are read every time. */
+int metacache_get_dims(metacache *mc, hid_t loc, const char *name, hsize_t dims[3]);
+
+/* Read up to count values of a double dataset starting at index start,
+   storing its length in *extent. Returns the number of values read (0
+   past the end) or -1 if the dataset is absent. Arrays of higher rank are
+   taken in storage order. The cache keeps the whole dataset; uncached
+   reads of a 1-D dataset only touch the hyperslab. */
+int metacache_read_doubles(metacache *mc, hid_t loc, const char *name, hsize_t start,
+                           hsize_t count, double *values, hsize_t *extent);
+
+/* Read an n-element int mask such as the pixel mask. Only non-zero
+   pixels are kept in the cache. Returns < 0 if it could not be read. */
+herr_t metacache_read_mask(metacache *mc, hid_t loc, const char *name, int *mask, size_t n);
+
+/* Write the cache file if anything new was read. It is written under a
+   temporary name and renamed, so concurrent readers never see half a
+   file. Returns 0 on success or when there is nothing to do. */
+int metacache_save(metacache *mc);
+
+void metacache_free(metacache *mc);
+
+#endif /* METACACHE_H */
@@ -34,6 +34,8 @@ To build:
 #include "H5api_adpt.h"
 #include "hdf5_hl.h"
 #include "hdf5.h"
+#include "metacache.h"
+#include "convcore.h"
 
 #define INVALID -9999
 
@@ -45,15 +47,15 @@ void register_filters() {
 }
 
 struct GlobalData {
+  const char *filename;
   hid_t hdf, group;
   int dimx, dimy;
   int Nminus1, Nminus2;
   int datasize;
-  int nframesPerDataset;
   signed int *minus1, *minus2;
   float xpixelSize;
   float ypixelSize;
-  int block_start;
+  frame_source frames;     /* data blocks of the file */
   unsigned int error_val;
   unsigned int *mapped_buf;
 };
@@ -75,6 +77,7 @@ int open_file(const char *filename) {
 
   /* Setup global variables */
   GLOBAL_DATA = (struct GlobalData*)malloc(sizeof(struct GlobalData));
+  GLOBAL_DATA->filename = filename;
 
   GLOBAL_DATA->hdf = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
   if (GLOBAL_DATA->hdf < 0) {
@@ -104,10 +107,12 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   }
 
   hid_t hdf = GLOBAL_DATA->hdf;
+  metacache mc;
+  metacache_open(&mc, getenv("EIGER2CBF_META_CACHE"), GLOBAL_DATA->filename);
 
   /* Image depth*/
   int depth = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/bit_depth_image", &depth);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/bit_depth_image", &depth);
   if (depth > 0) {
     fprintf(stderr, "PLUGIN INFO: /entry/instrument/detector/bit_depth_image = %d\n", depth);
   } else {
@@ -117,13 +122,13 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   GLOBAL_DATA->error_val = (unsigned int)((1ULL << depth) - 1); 
 
   /* Pixel size */
-  H5LTread_dataset_float(hdf, "/entry/instrument/detector/x_pixel_size", &GLOBAL_DATA->xpixelSize);
-  H5LTread_dataset_float(hdf, "/entry/instrument/detector/y_pixel_size", &GLOBAL_DATA->ypixelSize);
+  metacache_read_float(&mc, hdf, "/entry/instrument/detector/x_pixel_size", &GLOBAL_DATA->xpixelSize);
+  metacache_read_float(&mc, hdf, "/entry/instrument/detector/y_pixel_size", &GLOBAL_DATA->ypixelSize);
 
   /* Image size */
   int xpixels = -1, ypixels = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
   GLOBAL_DATA->dimx = xpixels;
   GLOBAL_DATA->dimy = ypixels;
 
@@ -134,7 +139,7 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   GLOBAL_DATA->Nminus1 = 0;
   GLOBAL_DATA->Nminus2 = 0;
   pixel_mask[0] = INVALID;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask);
+  metacache_read_mask(&mc, hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask, xpixels * ypixels);
   if (pixel_mask[0] == INVALID) {
     fprintf(stderr, "PLUGIN WARNING: failed to read the pixel mask from /entry/instrument/detector/detectorSpecific/pixel_mask.\n");
     GLOBAL_DATA->Nminus1 = -1;
@@ -149,19 +154,21 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
 
   /* Number of images */
   int nimages = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
   if (nimages < 0) {
     fprintf(stderr, "PLUGIN ERROR: failed to read the nimages.\n");
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
 
   /* Number of triggers */
   int ntrigger = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
   if (ntrigger < 0) {
     fprintf(stderr, "PLUGIN ERROR: failed to read the ntrigger.\n");
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
 
@@ -172,6 +179,7 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   if (entry < 0) {
     fprintf(stderr, "PLUGIN ERROR: /entry does not exist!\n");
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
   GLOBAL_DATA->group = entry;
@@ -183,39 +191,31 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   }
 
   /* Is it 0-indexed? */
-  GLOBAL_DATA->block_start = 1;
-  if (H5LTfind_dataset(group, "data_000000")) {
-    fprintf(stderr, "PLUGIN INFO: This dataset starts from data_000000.\n");
-    GLOBAL_DATA->block_start = 0;
-  } else {
-    fprintf(stderr, "PLUGIN INFO: This dataset starts from data_000001.\n");
-  }
+  const frame_layout *layouts[] = {&frame_layout_eiger, NULL};
+  frame_source_init(&GLOBAL_DATA->frames, &mc, GLOBAL_DATA->group, layouts, xpixels, ypixels);
+  fprintf(stderr, "PLUGIN INFO: This dataset starts from %s.\n", GLOBAL_DATA->frames.name);
 
   // Open the first data block to get the number of frames in a block
-  char data_name[20] = {};
-  hid_t data, dataspace;
-  GLOBAL_DATA->nframesPerDataset = 0;
-  snprintf(data_name, 20, "data_%06d", GLOBAL_DATA->block_start); 
-  data = H5Dopen2(group, data_name, H5P_DEFAULT);
-  dataspace = H5Dget_space(data);
-  if (data < 0) {
-    fprintf(stderr, "PLUGIN ERROR: failed to open /entry/%s\n", data_name);
+  hsize_t dims[3];
+  int rank;
+  rank = frame_source_dims(&GLOBAL_DATA->frames, &mc, dims);
+  if (rank < 0) {
+    fprintf(stderr, "PLUGIN ERROR: failed to open /entry/%s\n", GLOBAL_DATA->frames.name);
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
-  if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-    fprintf(stderr, "PLUGIN ERROR: Dimension of /entry/%s is not 3!\n", data_name);
+  if (rank != 3) {
+    fprintf(stderr, "PLUGIN ERROR: Dimension of /entry/%s is not 3!\n", GLOBAL_DATA->frames.name);
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
 
-  hsize_t dims[3];
-  H5Sget_simple_extent_dims(dataspace, dims, NULL);
-  GLOBAL_DATA->nframesPerDataset = dims[0];
-  fprintf(stderr, "PLUGIN INFO: The number of images per data block is %d.\n", GLOBAL_DATA->nframesPerDataset);
+  fprintf(stderr, "PLUGIN INFO: The number of images per data block is %d.\n", GLOBAL_DATA->frames.per_block);
 
-  H5Sclose(dataspace);
-  H5Dclose(data);
+  metacache_save(&mc);
+  metacache_free(&mc);
 
   *nx = GLOBAL_DATA->dimx;
   *ny = GLOBAL_DATA->dimy;
@@ -230,67 +230,20 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   return;
 }
 
-int prev_block_number = -1;
-hid_t data = NULL, dataspace = NULL, memspace=NULL;
-
 int get_data(int myid, int frame_number, int *mapped_buf) {
   int ret;
   int xpixels = GLOBAL_DATA->dimx, ypixels = GLOBAL_DATA->dimy;
 
-  int block_number = GLOBAL_DATA->block_start + (frame_number - 1) / GLOBAL_DATA->nframesPerDataset;
-  int frame_in_block = (frame_number - 1) % GLOBAL_DATA->nframesPerDataset;
-
-  char data_name[20] = {};
- 
-  if (prev_block_number != block_number) {
-    prev_block_number = block_number;
-
-    if (data != NULL) H5Dclose(data); 
-    if (dataspace != NULL) H5Sclose(dataspace);
-
-    snprintf(data_name, 20, "data_%06d", block_number); 
-    data = H5Dopen2(GLOBAL_DATA->group, data_name, H5P_DEFAULT);
-    dataspace = H5Dget_space(data);
-    if (data < 0) {
-      fprintf(stderr, "failed to open /entry/%s\n", data_name);
-      return -4;
-    }
-    if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-      fprintf(stderr, "Dimension of /entry/%s is not 3!\n", data_name);
-      return -4;
-    }
-  }
-
-  hsize_t offset_in[3] = {frame_in_block, 0, 0};
-  hsize_t offset_out[3] = {0, 0, 0};
-  hsize_t count[3] = {1, ypixels, xpixels};
-
-  /* Create memory space */
-  if (memspace == NULL) {
-    hsize_t dims[3];
-    H5Sget_simple_extent_dims(dataspace, dims, NULL);
-
-    memspace = H5Screate_simple(3, dims, NULL);
-    if (memspace < 0) {
-      fprintf(stderr, "PLUGIN CHILD %d for frame #%d: failed to create memspace.\n", myid, frame_number);
-      return -4;
-    }
-    ret = H5Sselect_hyperslab(memspace, H5S_SELECT_SET, offset_out, NULL, 
-                              count, NULL);
-    if (ret < 0) {
-      fprintf(stderr, "PLUGIN CHILD %d for frame #%d: select_hyperslab for memory failed.\n", myid, frame_number);
-      return -2;
-    }
+  /* Get the frame; the data block stays open for the next one */
+  ret = frame_source_read(&GLOBAL_DATA->frames, frame_number, (unsigned int*)mapped_buf);
+  if (ret == -1) {
+    fprintf(stderr, "failed to open /entry/%s\n", GLOBAL_DATA->frames.name);
+    return -4;
   }
-  
-  /* Get the frame */
-  ret = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset_in, NULL, count, NULL);
-  if (ret < 0) {
-    fprintf(stderr, "PLUGIN CHILD %d for frame #%d: select_hyperslab for file failed.\n", myid, frame_number);
-    return -2;
+  if (ret == -2) {
+    fprintf(stderr, "Dimension of /entry/%s is not 3!\n", GLOBAL_DATA->frames.name);
+    return -4;
   }
-
-  ret = H5Dread(data, H5T_NATIVE_UINT, memspace, dataspace, H5P_DEFAULT, mapped_buf);
   if (ret < 0) {
     fprintf(stderr, "PLUGIN CHILD %d for frame #%d: H5Dread for image failed.\n", myid, frame_number);
     return -2;
@@ -49,6 +49,8 @@ TODO:
 #include "H5api_adpt.h"
 #include "hdf5_hl.h"
 #include "hdf5.h"
+#include "metacache.h"
+#include "convcore.h"
 
 #define INVALID -9999
 
@@ -72,10 +74,9 @@ struct GlobalData {
   int dimx, dimy;
   int Nminus1, Nminus2;
   int datasize;
-  int nframesPerDataset;
   float xpixelSize;
   float ypixelSize;
-  int block_start;
+  frame_source frames;     /* data blocks of the file */
   unsigned int error_val;
   int nchild;
   pthread_mutex_t locks[MAXCHILD];
@@ -224,10 +225,12 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   }
 
   hid_t hdf = GLOBAL_DATA->hdf;
+  metacache mc;
+  metacache_open(&mc, getenv("EIGER2CBF_META_CACHE"), GLOBAL_DATA->filename);
 
   /* Image depth*/
   int depth = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/bit_depth_image", &depth);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/bit_depth_image", &depth);
   if (depth > 0) {
     fprintf(stderr, "PLUGIN INFO: /entry/instrument/detector/bit_depth_image = %d\n", depth);
   } else {
@@ -237,31 +240,33 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   GLOBAL_DATA->error_val = (unsigned int)((1ULL << depth) - 1); 
 
   /* Pixel size */
-  H5LTread_dataset_float(hdf, "/entry/instrument/detector/x_pixel_size", &GLOBAL_DATA->xpixelSize);
-  H5LTread_dataset_float(hdf, "/entry/instrument/detector/y_pixel_size", &GLOBAL_DATA->ypixelSize);
+  metacache_read_float(&mc, hdf, "/entry/instrument/detector/x_pixel_size", &GLOBAL_DATA->xpixelSize);
+  metacache_read_float(&mc, hdf, "/entry/instrument/detector/y_pixel_size", &GLOBAL_DATA->ypixelSize);
 
   /* Image size */
   int xpixels = -1, ypixels = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
   GLOBAL_DATA->dimx = xpixels;
   GLOBAL_DATA->dimy = ypixels;
 
   /* Number of images */
   int nimages = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
   if (nimages < 0) {
     fprintf(stderr, "PLUGIN ERROR: failed to read the nimages.\n");
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
 
   /* Number of triggers */
   int ntrigger = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
   if (ntrigger < 0) {
     fprintf(stderr, "PLUGIN ERROR: failed to read the ntrigger.\n");
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
 
@@ -272,6 +277,7 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   if (entry < 0) {
     fprintf(stderr, "PLUGIN ERROR: /entry does not exist!\n");
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
   GLOBAL_DATA->group = entry;
@@ -283,39 +289,31 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   }
 
   /* Is it 0-indexed? */
-  GLOBAL_DATA->block_start = 1;
-  if (H5LTfind_dataset(group, "data_000000")) {
-    fprintf(stderr, "PLUGIN INFO: This dataset starts from data_000000.\n");
-    GLOBAL_DATA->block_start = 0;
-  } else {
-    fprintf(stderr, "PLUGIN INFO: This dataset starts from data_000001.\n");
-  }
+  const frame_layout *layouts[] = {&frame_layout_eiger, NULL};
+  frame_source_init(&GLOBAL_DATA->frames, &mc, GLOBAL_DATA->group, layouts, xpixels, ypixels);
+  fprintf(stderr, "PLUGIN INFO: This dataset starts from %s.\n", GLOBAL_DATA->frames.name);
 
   // Open the first data block to get the number of frames in a block
-  char data_name[20] = {};
-  hid_t data, dataspace;
-  GLOBAL_DATA->nframesPerDataset = 0;
-  snprintf(data_name, 20, "data_%06d", GLOBAL_DATA->block_start); 
-  data = H5Dopen2(group, data_name, H5P_DEFAULT);
-  dataspace = H5Dget_space(data);
-  if (data < 0) {
-    fprintf(stderr, "PLUGIN ERROR: failed to open /entry/%s\n", data_name);
+  hsize_t dims[3];
+  int rank;
+  rank = frame_source_dims(&GLOBAL_DATA->frames, &mc, dims);
+  if (rank < 0) {
+    fprintf(stderr, "PLUGIN ERROR: failed to open /entry/%s\n", GLOBAL_DATA->frames.name);
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
-  if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-    fprintf(stderr, "PLUGIN ERROR: Dimension of /entry/%s is not 3!\n", data_name);
+  if (rank != 3) {
+    fprintf(stderr, "PLUGIN ERROR: Dimension of /entry/%s is not 3!\n", GLOBAL_DATA->frames.name);
     *error_flag = -4;
+    metacache_free(&mc);
     return;
   }
 
-  hsize_t dims[3];
-  H5Sget_simple_extent_dims(dataspace, dims, NULL);
-  GLOBAL_DATA->nframesPerDataset = dims[0];
-  fprintf(stderr, "PLUGIN INFO: The number of images per data block is %d.\n", GLOBAL_DATA->nframesPerDataset);
+  fprintf(stderr, "PLUGIN INFO: The number of images per data block is %d.\n", GLOBAL_DATA->frames.per_block);
 
-  H5Sclose(dataspace);
-  H5Dclose(data);
+  metacache_save(&mc);
+  metacache_free(&mc);
 
   *nx = GLOBAL_DATA->dimx;
   *ny = GLOBAL_DATA->dimy;
@@ -36,15 +36,23 @@ gcc -std=c99 -o xsplambda2cbf -g \
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 
 #include "cbf.h"
 #include "cbf_simple.h"
 #include "cbf_string.h"
 #include "hdf5.h"
 #include "hdf5_hl.h"
+#include "metacache.h"
+#include "convcore.h"
 
 
 extern const H5Z_class2_t H5Z_LZ4;
@@ -70,9 +78,262 @@ void usage( int argc, char **argv ) {
     printf("    --osc-start ang                  -- new start angle for frame 1 in degrees\n");
     printf("    --osc-width wid                  -- new oscillation angle for each frame in degrees\n");
     printf("    --nimages images                 -- override the number of images\n");
+    printf("    --digest none|md5                -- Content-MD5 of each image (default md5)\n");
+    printf("    --nproc nproc                    -- convert N:M with nproc worker processes, each\n");
+    printf("                                        reading its frames from one open dataset\n");
+    printf("    --module file                    -- another module file of a multi-module\n");
+    printf("                                        detector (repeatable); frames of all modules\n");
+    printf("                                        are stitched into one image\n");
     return;  
 }
 
+#define MAX_MODULES 16
+
+/* A multi-module Lambda writes one file per module. Each module's frames
+   go into the stitched image at the module's position (x, y), taken in
+   pixels from /entry/instrument/detector/translation/distance. */
+typedef struct {
+  const char *filename;
+  int x, y;
+  int xpixels, ypixels;
+  int masked;              /* the module has a pixel mask */
+  hid_t hdf, entry, group;
+  frame_source fs;
+#ifndef _WIN32
+  pid_t reader;            /* process reading this module, 0 if none */
+  int cmd, ack;            /* frame numbers to the reader, status back */
+#endif
+} lambda_module;
+
+/* Open a module file and read its frame size and position. */
+int module_open(lambda_module *m) {
+  metacache mc;
+  double t[3] = {-1., -1., -1.};
+  hsize_t extent;
+
+  m->entry = m->group = -1;
+  m->fs.data = m->fs.space = m->fs.memspace = -1;
+  m->hdf = H5Fopen(m->filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (m->hdf < 0) {
+    fprintf(stderr, "xsplambda2cbf error: failed to open module file %s\n", m->filename);
+    return -1;
+  }
+  metacache_open(&mc, NULL, m->filename);
+  m->xpixels = m->ypixels = -1;
+  metacache_read_int(&mc, m->hdf, "/entry/instrument/detector/collection/frame_width", &m->xpixels);
+  metacache_read_int(&mc, m->hdf, "/entry/instrument/detector/collection/frame_height", &m->ypixels);
+  if (m->xpixels < 1 || m->ypixels < 1) {
+    metacache_read_int(&mc, m->hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &m->xpixels);
+    metacache_read_int(&mc, m->hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &m->ypixels);
+  }
+  if (metacache_read_doubles(&mc, m->hdf, "/entry/instrument/detector/translation/distance", 0, 3, t, &extent) < 2) {
+    t[0] = t[1] = -1.;
+  }
+  metacache_free(&mc);
+  if (m->xpixels < 1 || m->ypixels < 1) {
+    fprintf(stderr, "xsplambda2cbf error: module file %s has no frame size\n", m->filename);
+    return -1;
+  }
+  if (t[0] < 0. || t[1] < 0.) {
+    fprintf(stderr, "xsplambda2cbf error: module file %s has no position in /entry/instrument/detector/translation/distance\n", m->filename);
+    return -1;
+  }
+  m->x = (int)(t[0] + .5);
+  m->y = (int)(t[1] + .5);
+  fprintf(stderr, " module %s: %d x %d pixels at (%d, %d)\n", m->filename, m->xpixels, m->ypixels, m->x, m->y);
+  return 0;
+}
+
+/* Place the module's pixel mask into mask, width pixels wide. A module
+   without one is left unmasked there, and its pixels at error_val are
+   masked per frame by module_mask_errors. */
+void module_read_mask(lambda_module *m, int *mask, int width) {
+  metacache mc;
+  int *tile = (int*)malloc(sizeof(int) * m->xpixels * m->ypixels);
+  int row;
+
+  m->masked = 0;
+  if (tile != NULL) {
+    metacache_open(&mc, NULL, m->filename);
+    tile[0] = -9999;
+    metacache_read_mask(&mc, m->hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", tile, m->xpixels * m->ypixels);
+    metacache_free(&mc);
+    m->masked = tile[0] != -9999;
+  }
+  for (row = 0; row < m->ypixels; row++) {
+    int *out = mask + (size_t)(m->y + row) * width + m->x;
+    if (m->masked) memcpy(out, tile + (size_t)row * m->xpixels, sizeof(int) * m->xpixels);
+    else memset(out, 0, sizeof(int) * m->xpixels);
+  }
+  if (!m->masked) {
+    fprintf(stderr, "WARNING: module %s has no pixel mask; its pixels at (2 ^ bit_depth_image) - 1 are masked instead.\n",
+            m->filename);
+  }
+  free(tile);
+}
+
+void module_mask_errors(const lambda_module *m, const unsigned int *buf, unsigned int error_val,
+                        int *out, int width) {
+  int row, col;
+  size_t i;
+
+  if (m->masked) return;
+  for (row = 0; row < m->ypixels; row++) {
+    i = (size_t)(m->y + row) * width + m->x;
+    for (col = 0; col < m->xpixels; col++, i++) {
+      if (buf[i] == error_val) out[i] = -1;
+    }
+  }
+}
+
+/* Reopen a module file for reading frames into an image width pixels wide. */
+int module_start(lambda_module *m, int width) {
+  const frame_layout *layouts[] = {&frame_layout_single, &frame_layout_eiger, NULL};
+  hsize_t dims[3];
+
+  m->hdf = H5Fopen(m->filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (m->hdf < 0) return -1;
+  m->entry = H5Gopen2(m->hdf, "/entry", H5P_DEFAULT);
+  if (m->entry < 0) return -1;
+  m->group = H5Gopen2(m->entry, "data", H5P_DEFAULT);
+  if (m->group < 0) m->group = m->entry;
+  frame_source_init(&m->fs, NULL, m->group, layouts, m->xpixels, m->ypixels);
+  if (frame_source_dims(&m->fs, NULL, dims) != 3) return -2;
+  m->fs.out_width = width;
+  m->fs.out_x = m->x;
+  m->fs.out_y = m->y;
+  return 0;
+}
+
+void module_close(lambda_module *m) {
+  frame_source_close(&m->fs);
+  if (m->group >= 0 && m->group != m->entry) H5Gclose(m->group);
+  if (m->entry >= 0) H5Gclose(m->entry);
+  if (m->hdf >= 0) H5Fclose(m->hdf);
+  m->hdf = m->entry = m->group = -1;
+}
+
+#ifndef _WIN32
+/* A reader process: read each frame number sent on cmd into the shared
+   image and answer with the status of frame_source_read. */
+void module_reader(lambda_module *m, unsigned int *image, int width) {
+  int frame;
+  char status, started = module_start(m, width) == 0;
+
+  while (read(m->cmd, &frame, sizeof(frame)) == sizeof(frame)) {
+    status = started ? frame_source_read(&m->fs, frame, image) : -1;
+    if (write(m->ack, &status, 1) != 1) break;
+  }
+  module_close(m);
+  _exit(0);
+}
+#endif
+
+/* Set up reading the n modules into a width x height image and return the
+   image. Each module gets a reader process of its own, so that the modules
+   of a frame are read concurrently; HDF5 is not thread-safe, hence
+   processes rather than threads. Without fork the modules are read in
+   turn. */
+unsigned int *modules_start(lambda_module *mods, int n, int width, int height) {
+  size_t size = sizeof(unsigned int) * width * height;
+  unsigned int *image;
+  int k;
+
+#ifndef _WIN32
+  int cmd[2], ack[2], j;
+
+  image = (unsigned int*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "xsplambda2cbf error: failed to map the stitched image\n");
+    return NULL;
+  }
+  fflush(NULL);
+  for (k = 0; k < n; k++) {
+    if (pipe(cmd) < 0) return NULL;
+    if (pipe(ack) < 0) return NULL;
+    mods[k].reader = fork();
+    if (mods[k].reader < 0) {
+      fprintf(stderr, "xsplambda2cbf error: fork failed for module %s\n", mods[k].filename);
+      return NULL;
+    }
+    if (mods[k].reader == 0) {
+      for (j = 0; j < k; j++) {
+        close(mods[j].cmd);
+        close(mods[j].ack);
+      }
+      close(cmd[1]);
+      close(ack[0]);
+      mods[k].cmd = cmd[0];
+      mods[k].ack = ack[1];
+      module_reader(&mods[k], image, width);
+    }
+    close(cmd[0]);
+    close(ack[1]);
+    mods[k].cmd = cmd[1];
+    mods[k].ack = ack[0];
+  }
+#else
+  image = (unsigned int*)calloc(1, size);
+  if (image == NULL) {
+    fprintf(stderr, "Failed to allocate image buffer.\n");
+    return NULL;
+  }
+  for (k = 0; k < n; k++) {
+    if (module_start(&mods[k], width) < 0) {
+      fprintf(stderr, "xsplambda2cbf error: failed to open the data of module %s\n", mods[k].filename);
+      return NULL;
+    }
+  }
+#endif
+  return image;
+}
+
+/* Read frame of every module into the image. */
+int modules_read(lambda_module *mods, int n, int frame, unsigned int *image) {
+  int k, ret = 0;
+  char status;
+
+  for (k = 0; k < n; k++) {
+#ifndef _WIN32
+    if (write(mods[k].cmd, &frame, sizeof(frame)) != sizeof(frame)) {
+      fprintf(stderr, "xsplambda2cbf error: reader of module %s is gone\n", mods[k].filename);
+      ret = -1;
+    }
+  }
+  for (k = 0; k < n; k++) {
+    if (read(mods[k].ack, &status, 1) != 1) status = -1;
+#else
+    status = frame_source_read(&mods[k].fs, frame, image);
+#endif
+    if (status < 0) {
+      fprintf(stderr, "xsplambda2cbf error: failed to read frame %d of module %s\n",
+              frame, mods[k].filename);
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+void modules_stop(lambda_module *mods, int n, unsigned int *image, int width, int height) {
+  int k;
+
+  for (k = 0; k < n; k++) {
+#ifndef _WIN32
+    close(mods[k].cmd);
+    close(mods[k].ack);
+    waitpid(mods[k].reader, NULL, 0);
+#else
+    module_close(&mods[k]);
+#endif
+  }
+#ifndef _WIN32
+  munmap(image, sizeof(unsigned int) * width * height);
+#else
+  free(image);
+#endif
+}
+
 
 int main(int argc, char **argv) {
   cbf_handle cbf;
@@ -88,6 +349,9 @@ int main(int argc, char **argv) {
   int ret;
   int retfromto;
   int usage_printed = 0;
+  int digest = 1;
+  int nproc = 1;         /* number of worker processes for N:M */
+  int *next_frame = NULL; /* frame counter shared by the workers */
   int optcount = 0;      /* count of command line options */
   int verbose = 0;       /* verbose mode */
   int new_beam_cent = 0; /* new beam center provided */
@@ -104,6 +368,9 @@ int main(int argc, char **argv) {
   description="LAMBDA";
 
   hid_t hdf;
+  metacache mc;
+  lambda_module mods[MAX_MODULES] = {};
+  int nmodules = 1;      /* modules to stitch, the first being filename.h5 */
 
   fprintf(stderr, "X-Spectrum Lambda HDF5 to CBF converter (version 180818)\n");
   fprintf(stderr, " derived by Herbert J. Berstein\n");
@@ -231,6 +498,54 @@ int main(int argc, char **argv) {
           usage(argc,argv);
           usage_printed++;
       }  
+    } else if (!cbf_cistrcmp(argv[ii],"--digest")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++; optcount++;
+        if (!cbf_cistrcmp(argv[ii],"none")) {
+          digest = 0;
+        } else if (!cbf_cistrcmp(argv[ii],"md5")) {
+          digest = 1;
+        } else {
+          fprintf(stderr, "xsplambda2cbf error: --digest invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "xsplambda2cbf error: --digest no value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+      }  
+    } else if (!cbf_cistrcmp(argv[ii],"--nproc")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++; optcount++;
+        nproc=strtol(argv[ii],&endptr,10);
+        if (!endptr || endptr==argv[ii] || *endptr!='\0' || nproc < 1) {
+          nproc = 1;
+          fprintf(stderr, "xsplambda2cbf error: --nproc invalid value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+        }
+      } else {
+        fprintf(stderr, "xsplambda2cbf error: --nproc no value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+      }  
+    } else if (!cbf_cistrcmp(argv[ii],"--module")) {
+      optcount ++;
+      if (ii < argc-1) {
+        ii++; optcount++;
+        if (nmodules < MAX_MODULES) {
+          mods[nmodules++].filename = argv[ii];
+        } else {
+          fprintf(stderr, "xsplambda2cbf error: more than %d modules; %s ignored\n", MAX_MODULES, argv[ii]);
+        }
+      } else {
+        fprintf(stderr, "xsplambda2cbf error: --module no value; ignored\n");
+          usage(argc,argv);
+          usage_printed++;
+      }  
     } else break;
   }
 
@@ -246,13 +561,14 @@ int main(int argc, char **argv) {
     fprintf(stderr, "xsplambda2cbf error: failed to open file %s\n", argv[1+optcount]);
     return -1;
   }
+  metacache_open(&mc, getenv("EIGER2CBF_META_CACHE"), argv[1+optcount]);
 
   /* try for nimages from X-spectrum nxs favored location */
   nimages = 0;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/collection/number_of_frames", &nimages);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/collection/number_of_frames", &nimages);
   if (nimages < 1)  {/* If that did not work, try eiger locations */ 
-      H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
-      H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
+      metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
+      metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
       if (nimages == 1 && ntrigger > 1) {
         fprintf(stderr, "xsplambda2cbf warning: nimages == 1 and ntrigger == %d \n", ntrigger);
         fprintf(stderr, "xsplambda2cbf warning: setting nimages to ntrigger \n");
@@ -269,6 +585,8 @@ int main(int argc, char **argv) {
     } else {
       printf("No. images: %d\n", nimages);
     }
+    metacache_save(&mc);
+    metacache_free(&mc);
     H5Fclose(hdf);
     return 0;
   }
@@ -290,18 +608,18 @@ int main(int argc, char **argv) {
 
   fprintf(stderr, "Metadata in HDF5:\n");
 
-  if ( H5LTread_dataset_string(hdf, "/entry/instrument/detector/detector_number", detector_sn) >= 0 ) {
+  if ( metacache_read_string(&mc, hdf, "/entry/instrument/detector/detector_number", detector_sn, sizeof(detector_sn)) >= 0 ) {
   fprintf(stderr, " /entry/instrument/detector/detector_number = %s\n", detector_sn);
   } else {
     detector_sn[0]='0';
     detector_sn[1]='\0';
   }
-  if ( H5LTread_dataset_string(hdf, "/entry/instrument/detector/detectorSpecific/software_version", version) >= 0 ) {
+  if ( metacache_read_string(&mc, hdf, "/entry/instrument/detector/detectorSpecific/software_version", version, sizeof(version)) >= 0 ) {
   fprintf(stderr, " /entry/instrument/detector/detectorSpecific/software_version = %s\n", version);
   }
-  if ( H5LTread_dataset_int(hdf, "/entry/instrument/detector/collection/frame_depth", &depth) >= 0 
-       || H5LTread_dataset_int(hdf, "/entry/instrument/detector/bit_depth_readout", &depth) >= 0
-       ||  H5LTread_dataset_int(hdf, "/entry/instrument/detector/bit_depth_image", &depth) >= 0 ) {
+  if ( metacache_read_int(&mc, hdf, "/entry/instrument/detector/collection/frame_depth", &depth) >= 0 
+       || metacache_read_int(&mc, hdf, "/entry/instrument/detector/bit_depth_readout", &depth) >= 0
+       ||  metacache_read_int(&mc, hdf, "/entry/instrument/detector/bit_depth_image", &depth) >= 0 ) {
          fprintf(stderr, " /entry/instrument/detector/bit_depth_image = %d\n", depth);
   } else {
     fprintf(stderr, " WARNING: /entry/instrument/detector/bit_depth_image is not avaialble. We assume 16 bit.\n");
@@ -310,19 +628,19 @@ int main(int argc, char **argv) {
   unsigned int error_val = (unsigned int)(((unsigned long long)1 << depth) - 1);
 
   // Saturation value
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/saturation_value", &countrate_cutoff);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/saturation_value", &countrate_cutoff);
   if (countrate_cutoff > 0) {
     fprintf(stderr, " /entry/instrument/detector/detectorSpecific/saturation_value = %d\n", countrate_cutoff);
   } else {
     fprintf(stderr, "  /entry/instrument/detector/detectorSpecific/saturation_value not present. Trying another place.\n");
-    H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff", &countrate_cutoff);
+    metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff", &countrate_cutoff);
     if (countrate_cutoff > 0) {
       fprintf(stderr, " /entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff = %d\n", countrate_cutoff);
       countrate_cutoff++;
     } else {
       fprintf(stderr, "  /entry/instrument/detector/detectorSpecific/countrate_correction_count_cutoff not present. Trying another place.\n");
       // < 1.4
-      H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff", &countrate_cutoff);
+      metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff", &countrate_cutoff);
       if (countrate_cutoff > 0) {
         fprintf(stderr, " /entry/instrument/detector/detectorSpecific/detectorModule_000/countrate_correction_count_cutoff = %d\n", countrate_cutoff);
 	fprintf(stderr, "  WARNING: The use of this field is not recommended now.\n");
@@ -337,7 +655,7 @@ int main(int argc, char **argv) {
     }
   }
 
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/sensor_thickness", &thickness); // in um
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/sensor_thickness", &thickness); // in um
   if (thickness > 0) {
     if (thickness < .001) {
         fprintf(stderr, " /entry/instrument/detector/sensor_thickness = %f (mm)\n", thickness * 1E3);
@@ -353,11 +671,11 @@ int main(int argc, char **argv) {
   }
   xpixels = -1;
   ypixels = -1;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/collection/frame_width", &xpixels);
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/collection/frame_height", &ypixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/collection/frame_width", &xpixels);
+  metacache_read_int(&mc, hdf, "/entry/instrument/detector/collection/frame_height", &ypixels);
   if ( xpixels  < 1 || ypixels < 1 ) {
-      H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
-      H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
+      metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
+      metacache_read_int(&mc, hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
       fprintf(stderr, " /entry/instrument/detector/detectorSpecific/{x,y}_pixels_in_detector = (%d, %d) (px)\n",
 	  xpixels, ypixels);
   } else {
@@ -365,6 +683,26 @@ int main(int argc, char **argv) {
           xpixels, ypixels);
   }
 
+  // A multi-module detector: the image spans all modules
+  if (nmodules > 1) {
+    int k, j;
+    mods[0].filename = argv[1+optcount];
+    xpixels = ypixels = 0;
+    for (k = 0; k < nmodules; k++) {
+      if (module_open(&mods[k]) < 0) return -1;
+      if (mods[k].x + mods[k].xpixels > xpixels) xpixels = mods[k].x + mods[k].xpixels;
+      if (mods[k].y + mods[k].ypixels > ypixels) ypixels = mods[k].y + mods[k].ypixels;
+      for (j = 0; j < k; j++) {
+        if (mods[k].x < mods[j].x + mods[j].xpixels && mods[j].x < mods[k].x + mods[k].xpixels
+            && mods[k].y < mods[j].y + mods[j].ypixels && mods[j].y < mods[k].y + mods[k].ypixels) {
+          fprintf(stderr, "xsplambda2cbf error: modules %s and %s overlap\n", mods[j].filename, mods[k].filename);
+          return -1;
+        }
+      }
+    }
+    fprintf(stderr, " stitching %d modules into (%d, %d) (px)\n", nmodules, xpixels, ypixels);
+  }
+
   if ( xpixels >= 248 && xpixels <= 264 
        && ypixels >= 248 && ypixels <= 264) description = "LAMBDA-60K";
   if ( xpixels >= 504 && xpixels <= 520
@@ -378,26 +716,26 @@ int main(int argc, char **argv) {
   if ( xpixels == 1536
        && ( ypixels == 1536 || ypixels == 1528 ) ) description = "LAMBDA-2M";
 
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/beam_center_x", &beamx);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/beam_center_y", &beamy);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/beam_center_x", &beamx);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/beam_center_y", &beamy);
   fprintf(stderr, " /entry/instrument/detector/beam_center_{x,y} = (%.2f, %.2f) (px)\n", new_beam_cent?nbeamx:beamx, new_beam_cent?nbeamy:beamy);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/count_time", &count_time); // in m
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/count_time", &count_time); // in m
   fprintf(stderr, " /entry/instrument/detector/count_time = %f (sec)\n", count_time);
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/frame_time", &frame_time); // in 
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/frame_time", &frame_time); // in 
   fprintf(stderr, " /entry/instrument/detector/frame_time = %f (sec)\n", frame_time);
-  if (H5LTread_dataset_double(hdf, "/entry/instrument/detector/x_pixel_size", &pixelsize)> 0)
+  if (metacache_read_double(&mc, hdf, "/entry/instrument/detector/x_pixel_size", &pixelsize)> 0)
   fprintf(stderr, " /entry/instrument/detector/x_pixel_size = %f (um)\n", pixelsize);
 
   // Detector distance
 
-  H5LTread_dataset_double(hdf, "/entry/instrument/detector/distance", &distance);
+  metacache_read_double(&mc, hdf, "/entry/instrument/detector/distance", &distance);
   if (new_distance  > 0.) distance = new_distance; 
   if (distance > 0.) {
     fprintf(stderr, " /entry/instrument/detector/distance = %f (mm)\n", distance);
   } else {
     fprintf(stderr, "  /entry/instrument/detector/distance not present. Trying another place.\n");
 
-    H5LTread_dataset_double(hdf, "/entry/instrument/detector/detector_distance", &distance); // Firmware< 1.7
+    metacache_read_double(&mc, hdf, "/entry/instrument/detector/detector_distance", &distance); // Firmware< 1.7
     if (distance > 0) {
       fprintf(stderr, " /entry/instrument/detector/detector_distance = %f (m)\n", distance);
     } else {
@@ -407,7 +745,7 @@ int main(int argc, char **argv) {
   }
 
   // Wavelength
-  H5LTread_dataset_double(hdf, "/entry/sample/beam/incident_wavelength", &wavelength); // Firmware >= 1.7
+  metacache_read_double(&mc, hdf, "/entry/sample/beam/incident_wavelength", &wavelength); // Firmware >= 1.7
   if (new_wavelength > 0.) {
     wavelength = new_wavelength;
   }
@@ -416,19 +754,19 @@ int main(int argc, char **argv) {
   } else {
     fprintf(stderr, "  /entry/sample/beam/incident_wavelength not present. Trying another place.\n");
 
-    H5LTread_dataset_double(hdf, "/entry/instrument/beam/wavelength", &wavelength);
+    metacache_read_double(&mc, hdf, "/entry/instrument/beam/wavelength", &wavelength);
     if (wavelength > 0.) {
       fprintf(stderr, " /entry/instrument/beam/wavelength = %f (A)\n", wavelength);
     } else {
       fprintf(stderr, "  /entry/instrument/beam/wavelength not present. Trying another place.\n");
 
-      H5LTread_dataset_double(hdf, "/entry/instrument/monochromator/wavelength", &wavelength);
+      metacache_read_double(&mc, hdf, "/entry/instrument/monochromator/wavelength", &wavelength);
       if (wavelength > 0.) {
 	fprintf(stderr, " /entry/instrument/monochromator/wavelength = %f (A)\n", wavelength);
       } else {
 	fprintf(stderr, "  /entry/instrument/monochromator/wavelength not present. Trying another place.\n");
 
-	H5LTread_dataset_double(hdf, "/entry/instrument/beam/incident_wavelength", &wavelength); // Firmware 1.6
+	metacache_read_double(&mc, hdf, "/entry/instrument/beam/incident_wavelength", &wavelength); // Firmware 1.6
 	if (wavelength > 0.) {
 	  fprintf(stderr, " /entry/instrument/beam/incident_wavelength = %f (A)\n", wavelength);
 	} else {
@@ -441,7 +779,7 @@ int main(int argc, char **argv) {
     fprintf(stderr, " WARNING: wavelength was not defined! \"Wavelength\" field in the output is set to -1.\n");
   }
 
-  if (H5LTread_dataset_double(hdf, "/entry/sample/goniometer/omega_range_average", &osc_width)< 0) osc_width = -1.;
+  if (metacache_read_double(&mc, hdf, "/entry/sample/goniometer/omega_range_average", &osc_width)< 0) osc_width = -1.;
   if (new_osc_width > 0.) osc_width=new_osc_width;
   if (osc_width > 0.) {
     fprintf(stderr, " /entry/sample/goniometer/omega_range_average = %f (deg)\n", osc_width);
@@ -458,16 +796,20 @@ int main(int argc, char **argv) {
   }
 
   // TODO: Is it always in omega?
-  int bufsize = (nimages < 100000) ? 100000 : nimages;
-  double *angles = (double*)malloc(bufsize * sizeof(double));
-  // I don't know why but nimages can be too small ...
+  // Only the angles of frames from..to are read; angles[frame - from] is
+  // -9999. where omega is not present or ends before the frame.
+  double *angles = (double*)malloc((to >= from ? to - from + 1 : 1) * sizeof(double));
+  hsize_t omega_extent;
   if (angles == NULL) {
     fprintf(stderr, "failed to allocate buffer for omega.\n");
     return -1;
   }
-  for (ii=0; ii < bufsize; ii++) angles[ii]=-9999.;
-  H5LTread_dataset_double(hdf, "/entry/sample/goniometer/omega", angles);
-  if (new_osc_start > -9999.) osc_start = angles[0] = new_osc_start;
+  for (ii=0; ii <= to - from; ii++) angles[ii]=-9999.;
+  if (from >= 1 && to >= from) metacache_read_doubles(&mc, hdf, "/entry/sample/goniometer/omega", from - 1, to - from + 1, angles, &omega_extent);
+  if (new_osc_start > -9999.) {
+    osc_start = new_osc_start;
+    if (from == 1) angles[0] = new_osc_start;
+  }
   fprintf(stderr, "\n");
 
   hid_t entry, group;
@@ -477,8 +819,17 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  pixel_mask[0] = -9999;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask);
+  if (nmodules > 1) {
+    // Pixels between the modules are masked as 1
+    for (ii = 0; ii < xpixels * ypixels; ii++) pixel_mask[ii] = 1;
+    for (ii = 0; ii < nmodules; ii++) {
+      module_read_mask(&mods[ii], pixel_mask, xpixels);
+      module_close(&mods[ii]);
+    }
+  } else {
+    pixel_mask[0] = -9999;
+    metacache_read_mask(&mc, hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask, xpixels * ypixels);
+  }
   if (pixel_mask[0] == -9999) {
     fprintf(stderr, "WARNING: failed to read the pixel mask from /entry/instrument/detector/detectorSpecific/pixel_mask.\n");
     fprintf(stderr, " Thus, we mask pixels whose intensity is %u (= (2 ^ bit_depth_image) - 1) by converting them to -1. \n", error_val);
@@ -491,52 +842,114 @@ int main(int argc, char **argv) {
     group = entry; // leak!
   }
 
-  int block_start = 1;
-  if (H5LTfind_dataset(group, "data")) {
-    fprintf(stderr, "This dataset starts from data.\n");
-    block_start = -1;
-  } else if (H5LTfind_dataset(group, "data_000000")) {
-    fprintf(stderr, "This dataset starts from data_000000.\n");
-    block_start = 0;
-  } else {
-    fprintf(stderr, "This dataset starts from data_000001.\n");
-    block_start = 1;
-  }
+  // Lambda writes a single "data"; Eiger-style data_NNNNNN blocks also work
+  frame_source fs;
+  const frame_layout *layouts[] = {&frame_layout_single, &frame_layout_eiger, NULL};
+  frame_source_init(&fs, &mc, group, layouts, xpixels, ypixels);
+  fprintf(stderr, "This dataset starts from %s.\n", fs.name);
 
-  char data_name[20] = {};
-  hid_t data, dataspace;
-  int number_per_block = 0;
-  
   // Open the first data block to get the number of frames in a block
-  if (block_start > -1 ) {
-      snprintf(data_name, 20, "data_%06d", block_start); 
-  } else {
-      snprintf(data_name, 20, "data"); 
-  }
-  data = H5Dopen2(group, data_name, H5P_DEFAULT);
-  dataspace = H5Dget_space(data);
-  if (data < 0) {
-    fprintf(stderr, "failed to open /entry/%s\n", data_name);
+  hsize_t dims[3];
+  int rank = frame_source_dims(&fs, &mc, dims);
+  if (rank < 0) {
+    fprintf(stderr, "failed to open /entry/%s\n", fs.name);
     return -1;
   }
-  if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-    fprintf(stderr, "Dimension of /entry/%s is not 3!\n", data_name);
+  if (rank != 3) {
+    fprintf(stderr, "Dimension of /entry/%s is not 3!\n", fs.name);
     return -1;    
   }
-  hsize_t dims[3];
-  H5Sget_simple_extent_dims(dataspace, dims, NULL);
-  number_per_block = dims[0];
-  fprintf(stderr, "The number of images per data block is %d.\n", number_per_block);
-
-  H5Sclose(dataspace);
-  H5Dclose(data);
+  fprintf(stderr, "The number of images per data block is %d.\n", fs.per_block);
 
+  if (metacache_save(&mc) < 0) {
+    fprintf(stderr, "xsplambda2cbf warning: failed to write the metadata cache %s\n", mc.path);
+  }
   fprintf(stderr, "\nFile analysis completed.\n\n");
+
+#ifndef _WIN32
+  // As in eiger2cbf: forked workers inherit the metadata, angles and pixel
+  // mask, and take frames one at a time from a shared counter. HDF5 handles
+  // are not shared across fork, so each worker reopens the file.
+  if (nproc > 1 && to > from && argc-optcount > 3) {
+    int worker, status, failed = 0;
+    pid_t pid;
+    if (nproc > to - from + 1) nproc = to - from + 1;
+    next_frame = (int*)mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (next_frame == MAP_FAILED) {
+      fprintf(stderr, "xsplambda2cbf error: failed to map the frame counter\n");
+      return -1;
+    }
+    *next_frame = from;
+    if (group != entry) H5Gclose(group);
+    H5Gclose(entry);
+    H5Fclose(hdf);
+    fflush(NULL);
+    for (worker = 0; worker < nproc; worker++) {
+      pid = fork();
+      if (pid < 0) {
+        fprintf(stderr, "xsplambda2cbf error: fork failed for worker %d\n", worker);
+        failed++;
+        break;
+      }
+      if (pid == 0) break;
+    }
+    if (worker == nproc || pid != 0) {
+      // coordinator
+      while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+      }
+      munmap(next_frame, sizeof(int));
+      metacache_free(&mc);
+      free(buf);
+      free(buf_signed);
+      free(pixel_mask);
+      free(angles);
+      if (failed) {
+        fprintf(stderr, "xsplambda2cbf error: %d worker(s) failed\n", failed);
+        return -1;
+      }
+      fprintf(stderr, "\nAll done!\n");
+      return 0;
+    }
+    // worker; stitched frames are read by the module readers instead
+    hdf = -1;
+    if (nmodules == 1) {
+      hdf = H5Fopen(argv[1+optcount], H5F_ACC_RDONLY, H5P_DEFAULT);
+      if (hdf < 0) {
+        fprintf(stderr, "xsplambda2cbf error: worker failed to open file %s\n", argv[1+optcount]);
+        return -1;
+      }
+      entry = H5Gopen2(hdf, "/entry", H5P_DEFAULT);
+      group = H5Gopen2(entry, "data", H5P_DEFAULT);
+      if (group < 0) {
+        group = entry;
+      }
+      fs.group = group;
+    }
+  }
+#endif
+
+  // Each worker, or the only process, reads the modules of its frames
+  // concurrently into its own stitched image
+  unsigned int *image = buf;
+  if (nmodules > 1) {
+    if (hdf >= 0) {
+      if (group != entry) H5Gclose(group);
+      H5Gclose(entry);
+      H5Fclose(hdf);
+      hdf = -1;
+    }
+    image = modules_start(mods, nmodules, xpixels, ypixels);
+    if (image == NULL) return -1;
+  }
+
   int frame;
-  for (frame = from; frame <= to; frame++) {
+  for (frame = next_frame ? __sync_fetch_and_add(next_frame, 1) : from; frame <= to;
+       frame = next_frame ? __sync_fetch_and_add(next_frame, 1) : frame + 1) {
     fprintf(stderr, "Converting frame %d (%d / %d)\n", frame, frame - from + 1, to - from + 1);
-    if (angles[frame-1] != -9999.) {
-      osc_start = angles[frame - 1];
+    if (angles[frame - from] != -9999.) {
+      osc_start = angles[frame - from];
       fprintf(stderr, " /entry/sample/goniometer/omega[%d] = %.3f (1-indexed)\n", frame, osc_start);
     } else {
       if (new_osc_start != -9999.) {
@@ -577,62 +990,23 @@ int main(int argc, char **argv) {
 	     new_beam_cent?nbeamx:beamx, new_beam_cent?nbeamy:beamy, osc_start, osc_width);
 
 
-    // Now open the required data
-    int block_number;
-    int frame_in_block;
-
-    if (block_start > -1 ) {
-        block_number = block_start + (frame - 1) / number_per_block;
-        frame_in_block = (frame - 1) % number_per_block;
-        snprintf(data_name, 20, "data_%06d", block_number); 
+    // Now read the frame; the dataset stays open for the next one
+    if (nmodules > 1) {
+      if (modules_read(mods, nmodules, frame, image) < 0) return -1;
+      ret = 0;
     } else {
-        block_number = 0;
-        frame_in_block = frame -1;
-        snprintf(data_name, 20, "data");
+      ret = frame_source_read(&fs, frame, buf);
     }
-    
-    data = H5Dopen2(group, data_name, H5P_DEFAULT);
-    dataspace = H5Dget_space(data);
-    if (data < 0) {
-      fprintf(stderr, "failed to open /entry/%s\n", data_name);
+    if (ret == -1) {
+      fprintf(stderr, "failed to open /entry/%s\n", fs.name);
       return -1;
-    }
-    if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-      fprintf(stderr, "Dimension of /entry/%s is not 3!\n", data_name);
+    } else if (ret == -2) {
+      fprintf(stderr, "Dimension of /entry/%s is not 3!\n", fs.name);
       return -1;    
-    }
-
-    // Get the frame
-    H5Sget_simple_extent_dims(dataspace, dims, NULL);
-    hsize_t offset_in[3] = {frame_in_block, 0, 0};
-    hsize_t offset_out[3] = {0, 0, 0};
-    hsize_t count[3] = {1, ypixels, xpixels};
-    hid_t memspace = H5Screate_simple(3, dims, NULL);   
-    if (memspace < 0) {
-      fprintf(stderr, "failed to create memspace\n");
-      return -1;
-    }
-
-    ret = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset_in, NULL, 
-			      count, NULL);
-    if (ret < 0) {
-      fprintf(stderr, "select_hyperslab for file failed\n");
-      return -1;
-    }
-    ret = H5Sselect_hyperslab(memspace, H5S_SELECT_SET, offset_out, NULL, 
-			      count, NULL);
-    if (ret < 0) {
-      fprintf(stderr, "select_hyperslab for memory failed\n");
-      return -1;
-    }
-    ret = H5Dread(data, H5T_NATIVE_UINT, memspace, dataspace, H5P_DEFAULT, buf);
-    if (ret < 0) {
+    } else if (ret < 0) {
       fprintf(stderr, "H5Dread for image failed. Wrong frame number?\n");
       return -1;
     }
-    H5Sclose(dataspace);
-    H5Sclose(memspace);
-    H5Dclose(data);
 
     /////////////////////////////////////////////////////////////////
     // Reading done. Here output starts...
@@ -663,16 +1037,9 @@ int main(int argc, char **argv) {
     // put the image
     cbf_new_category(cbf, "array_data");
     cbf_new_column(cbf, "data");
-    int i;
-    for (i = 0; i < xpixels * ypixels; i++) {
-      if ((pixel_mask[0] != -9999 && pixel_mask[i] == 1) || // the pixel mask is available
-	  (pixel_mask[0] == -9999 && buf[i] == error_val)) { // not available
-	buf_signed[i] = -1;
-      } else if (pixel_mask[0] != -9999 && pixel_mask[i] > 1) { // the pixel mask is 2, 4, 8, 16
-	buf_signed[i] = -2;
-      } else {
-	buf_signed[i] = buf[i];
-      }
+    mask_frame(image, pixel_mask[0] != -9999 ? pixel_mask : NULL, error_val, buf_signed, xpixels * ypixels);
+    if (nmodules > 1) {
+      for (ii = 0; ii < nmodules; ii++) module_mask_errors(&mods[ii], image, error_val, buf_signed, xpixels);
     }
     cbf_set_integerarray_wdims_fs(cbf,
 				  CBF_BYTE_OFFSET,
@@ -687,19 +1054,25 @@ int main(int argc, char **argv) {
 				  0,
 				  0); //padding
 
-    cbf_write_file(cbf, fh, 1, CBF, MSG_DIGEST | MIME_HEADERS | PAD_4K, 0);
+    cbf_write_file(cbf, fh, 1, CBF, (digest ? MSG_DIGEST : MSG_NODIGEST) | MIME_HEADERS | PAD_4K, 0);
     // no need to fclose() here as the 3rd argument "readable" is 1
     cbf_free_handle(cbf);
   }
 
-  H5Gclose(group);
-  H5Fclose(hdf);
+  if (nmodules > 1) {
+    modules_stop(mods, nmodules, image, xpixels, ypixels);
+  } else {
+    frame_source_close(&fs);
+    H5Gclose(group);
+    H5Fclose(hdf);
+  }
+  metacache_free(&mc);
 
   free(buf);
   free(buf_signed);
   free(angles);
 
-  fprintf(stderr, "\nAll done!\n");
+  if (next_frame == NULL) fprintf(stderr, "\nAll done!\n");
 
   return 0;
 }